@@ -5,17 +5,26 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES:=                                      \
                   BandwidthController.cpp              \
                   CommandListener.cpp                  \
+                  ConfigData.cpp                       \
+                  CounterSampler.cpp                   \
                   DnsProxyListener.cpp                 \
+                  IptablesRestoreController.cpp        \
+                  IptablesRuleSet.cpp                  \
                   OEMListener.cpp                      \
                   NatController.cpp                    \
                   NetdCommand.cpp                      \
+                  NetfilterTableReader.cpp             \
                   NetlinkHandler.cpp                   \
                   NetlinkManager.cpp                   \
                   PanController.cpp                    \
+                  PckgRegistry.cpp                     \
+                  PolicyDelta.cpp                      \
                   PppController.cpp                    \
+                  QuotaJournal.cpp                     \
                   ResolverController.cpp               \
                   SecondaryTableController.cpp         \
                   SoftapController.cpp                 \
+                  SyncClient.cpp                       \
                   TetherController.cpp                 \
                   ThrottleController.cpp               \
                   oem_iptables_hook.cpp                \
@@ -27,12 +27,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <map>
 
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <linux/netfilter.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/pkt_sched.h>
@@ -45,18 +49,26 @@ extern "C" int logwrap(int argc, const char **argv, int background);
 extern "C" int system_nosh(const char *command);
 
 #include "BandwidthController.h"
+#include "CounterSampler.h"
+#include "IptablesRestoreController.h"
+#include "OEMListener.h"
 #include "oem_iptables_hook.h"
 
 /* Alphabetical */
 const char BandwidthController::ALERT_IPT_TEMPLATE[] = "%s %s %s -m quota2 ! --quota %lld --name %s";
 const int  BandwidthController::ALERT_RULE_POS_IN_COSTLY_CHAIN = 4;
 const char BandwidthController::ALERT_GLOBAL_NAME[] = "globalAlert";
+const char BandwidthController::BOOT_ID_PATH[] = "/proc/sys/kernel/random/boot_id";
 const char BandwidthController::IP6TABLES_PATH[] = "/system/bin/ip6tables";
 const char BandwidthController::IPTABLES_PATH[] = "/system/bin/iptables";
 const int  BandwidthController::MAX_CMD_ARGS = 32;
 const int  BandwidthController::MAX_CMD_LEN = 1024;
 const int  BandwidthController::MAX_IFACENAME_LEN = 64;
 const int  BandwidthController::MAX_IPT_OUTPUT_LINE_LEN = 256;
+const unsigned int BandwidthController::MAX_STAGED_NAUGHTY_APP_CHANGES = 8192;
+const char BandwidthController::OEM_CHAIN[] = "p30dw";
+const char BandwidthController::QTAGUID_STATS_PATH[] = "/proc/net/xt_qtaguid/stats";
+const char BandwidthController::STATE_PATH[] = "/data/system/bandwidth.state";
 
 bool BandwidthController::useLogwrapCall = false;
 
@@ -94,8 +106,12 @@ bool BandwidthController::useLogwrapCall = false;
  *
  * * penalty_box handling:
  *  - only one penalty_box for all interfaces
- *   E.g  Adding an app:
- *    iptables -A penalty_box -m owner --uid-owner app_3 \
+ *  - it dispatches on UID ranges, so a packet does not walk every app rule
+ *   E.g  with app_3 blocked:
+ *    iptables -A penalty_box -m owner --uid-owner 8192-12287 --goto penalty_2000_2fff
+ *    iptables -A penalty_2000_2fff -m owner --uid-owner 9984-10239 --goto penalty_2700_27ff
+ *    iptables -A penalty_2700_27ff -m owner --uid-owner 10000-10015 --goto penalty_2710_271f
+ *    iptables -A penalty_2710_271f -m owner --uid-owner app_3 \
  *        --jump REJECT --reject-with icmp-net-prohibited
  */
 const char *BandwidthController::IPT_CLEANUP_COMMANDS[] = {
@@ -105,14 +121,14 @@ const char *BandwidthController::IPT_CLEANUP_COMMANDS[] = {
     /* TODO: If at some point we need more user chains than here, then we will need
      * a different cleanup approach.
      */
-    "-X",  /* Should normally only be costly_shared, penalty_box, and costly_<iface>  */
+    "-X",  /* Should normally only be costly_shared, penalty_*, and costly_<iface>  */
 };
 
 const char *BandwidthController::IPT_SETUP_COMMANDS[] = {
     /* Created needed chains. */
     "-N costly_shared",
     "-N penalty_box",
-    "-N p30dw",
+    "-N p30dw",  /* OEM_CHAIN */
 };
 
 const char *BandwidthController::IPT_BASIC_ACCOUNTING_COMMANDS[] = {
@@ -138,8 +154,9 @@ const char *BandwidthController::IPT_BASIC_ACCOUNTING_COMMANDS[] = {
 BandwidthController::BandwidthController(void) {
     char value[PROPERTY_VALUE_MAX];
 
+    IptablesRestoreController::loadBackend();
     property_get("persist.bandwidth.enable", value, "0");
-    if (!strcmp(value, "1")) {
+    if (!strcmp(value, "1") && restoreState()) {
         enableBandwidthControl();
     }
 
@@ -147,12 +164,28 @@ BandwidthController::BandwidthController(void) {
     useLogwrapCall = !strcmp(value, "1");
 }
 
-int BandwidthController::runIpxtablesCmd(const char *cmd, IptRejectOp rejectHandling) {
+int BandwidthController::runIpxtablesCmd(const char *cmd, IptRejectOp rejectHandling,
+                                         RunCmdErrHandling cmdErrHandling) {
+    std::string v4Cmd;
+    std::string v6Cmd;
     int res = 0;
 
     LOGV("runIpxtablesCmd(cmd=%s)", cmd);
-    res |= runIptablesCmd(cmd, rejectHandling, IptIpV4);
-    res |= runIptablesCmd(cmd, rejectHandling, IptIpV6);
+    if (useLogwrapCall) {
+        res |= runIptablesCmd(cmd, rejectHandling, IptIpV4, cmdErrHandling);
+        res |= runIptablesCmd(cmd, rejectHandling, IptIpV6, cmdErrHandling);
+        return res;
+    }
+
+    /* The v4 and v6 tables are independent, so both are updated at once. */
+    v4Cmd = makeIptablesCmd(cmd, rejectHandling, IptIpV4);
+    v6Cmd = makeIptablesCmd(cmd, rejectHandling, IptIpV6);
+    res = IptablesRestoreController::executeCommandBoth(v4Cmd, v6Cmd,
+            cmdErrHandling == RunCmdFailureOk ? IptablesRestoreController::IptFailureOk
+                    : IptablesRestoreController::IptFailureBad);
+    if (res) {
+        LOGE("runIpxtablesCmd(): failed %s res=%d", cmd, res);
+    }
     return res;
 }
 
@@ -163,8 +196,13 @@ int BandwidthController::StrncpyAndCheck(char *buffer, const char *src, size_t b
     return buffer[buffSize - 1];
 }
 
+std::string BandwidthController::makeIptablesCmd(const char *cmd, IptRejectOp rejectHandling,
+                                                IptIpVer iptVer) {
+    return IptablesRuleSet::Rule(cmd, rejectHandling == IptRejectAdd).command(iptVer == IptIpV6);
+}
+
 int BandwidthController::runIptablesCmd(const char *cmd, IptRejectOp rejectHandling,
-                                        IptIpVer iptVer) {
+                                        IptIpVer iptVer, RunCmdErrHandling cmdErrHandling) {
     char buffer[MAX_CMD_LEN];
     const char *argv[MAX_CMD_ARGS];
     int argc = 0;
@@ -172,18 +210,20 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptRejectOp rejectHandl
     char *tmp;
     int res;
 
-    std::string fullCmd = cmd;
+    std::string fullCmd = makeIptablesCmd(cmd, rejectHandling, iptVer);
 
-    if (rejectHandling == IptRejectAdd) {
-        fullCmd += " --jump REJECT --reject-with";
-        switch (iptVer) {
-        case IptIpV4:
-            fullCmd += " icmp-net-prohibited";
-            break;
-        case IptIpV6:
-            fullCmd += " icmp6-adm-prohibited";
-            break;
+    if (useBatchCommands()) {
+        /* A single-command transaction: a pipe write to the iptables-restore worker. */
+        res = IptablesRestoreController::executeCommand(
+                iptVer == IptIpV4 ? IptablesRestoreController::IptIpV4
+                        : IptablesRestoreController::IptIpV6,
+                fullCmd,
+                cmdErrHandling == RunCmdFailureOk ? IptablesRestoreController::IptFailureOk
+                        : IptablesRestoreController::IptFailureBad);
+        if (res) {
+            LOGE("runIptablesCmd(): failed %s res=%d", fullCmd.c_str(), res);
         }
+        return res;
     }
 
     fullCmd.insert(0, " ");
@@ -216,24 +256,43 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptRejectOp rejectHandl
 }
 
 int BandwidthController::enableBandwidthControl(void) {
+    IptablesRuleSet rules;
+    std::list<IptablesRuleSet::Rule> changes;
     int res;
 
+    /* The tables are rebuilt from scratch, a good time to pick up a new backend. */
+    IptablesRestoreController::loadBackend();
+
     /* Let's pretend we started from scratch ... */
     sharedQuotaIfaces.clear();
     quotaIfaces.clear();
     naughtyAppUids.clear();
+    stagedNaughtyAppChanges.clear();
     globalAlertBytes = 0;
     globalAlertTetherCount = 0;
     sharedQuotaBytes = sharedAlertBytes = 0;
-
-
-    /* Some of the initialCommands are allowed to fail */
-    runCommands(sizeof(IPT_CLEANUP_COMMANDS) / sizeof(char*),
-            IPT_CLEANUP_COMMANDS, RunCmdFailureOk);
-    runCommands(sizeof(IPT_SETUP_COMMANDS) / sizeof(char*),
-            IPT_SETUP_COMMANDS, RunCmdFailureOk);
-    res = runCommands(sizeof(IPT_BASIC_ACCOUNTING_COMMANDS) / sizeof(char*),
-            IPT_BASIC_ACCOUNTING_COMMANDS, RunCmdFailureBad);
+    sharedThresholdPcts.clear();
+
+    res = applyCommands(rules, sizeof(IPT_SETUP_COMMANDS) / sizeof(char*),
+            IPT_SETUP_COMMANDS);
+    res |= applyCommands(rules, sizeof(IPT_BASIC_ACCOUNTING_COMMANDS) / sizeof(char*),
+            IPT_BASIC_ACCOUNTING_COMMANDS);
+
+    /* After the cleanup none of our rules is left in the kernel. */
+    committedRules.clear();
+    closeQuotaFds();
+    CounterSampler::notifyQuotasChanged();
+    IptablesRuleSet::diff(committedRules, rules, changes);
+    if (!res) {
+        res = runRuleChanges(sizeof(IPT_CLEANUP_COMMANDS) / sizeof(char*),
+                IPT_CLEANUP_COMMANDS, changes);
+    }
+    if (!res) {
+        committedRules = rules;
+        saveState();
+    }
+    /* p30dw was emptied and the chains it jumps to deleted. */
+    OEMListener::notifyTablesFlushed();
 
     setupOemIptablesHook();
 
@@ -242,48 +301,343 @@ int BandwidthController::enableBandwidthControl(void) {
 }
 
 int BandwidthController::disableBandwidthControl(void) {
+    std::list<IptablesRuleSet::Rule> changes;
+
     /* The IPT_CLEANUP_COMMANDS are allowed to fail. */
-    runCommands(sizeof(IPT_CLEANUP_COMMANDS) / sizeof(char*),
-            IPT_CLEANUP_COMMANDS, RunCmdFailureOk);
+    runRuleChanges(sizeof(IPT_CLEANUP_COMMANDS) / sizeof(char*),
+            IPT_CLEANUP_COMMANDS, changes);
+    committedRules.clear();
+    closeQuotaFds();
+    CounterSampler::notifyQuotasChanged();
+    unlink(STATE_PATH);
+    OEMListener::notifyTablesFlushed();
     setupOemIptablesHook();
     return 0;
 }
 
+int BandwidthController::readBootId(std::string &bootId) {
+    char buff[64];
+    FILE *fp;
+
+    fp = fopen(BOOT_ID_PATH, "r");
+    if (!fp) {
+        LOGE("Failed to open %s (%s)", BOOT_ID_PATH, strerror(errno));
+        return -1;
+    }
+    if (!fgets(buff, sizeof(buff), fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    buff[strcspn(buff, "\n")] = '\0';
+    bootId = buff;
+    return 0;
+}
+
+/*
+ * The state file is only valid for the current boot:
+ * bootid <id>
+ * shared <quota> <alert>
+ * sharediface <iface>
+ * sharedthreshold <pct>
+ * iquota <iface> <quota> <alert> [<pct> ...]
+ * globalalert <bytes> <tetherCount>
+ * naughtyapp <uid>
+ * followed by the committedRules.
+ */
+int BandwidthController::saveState(void) {
+    std::string tmpPath = std::string(STATE_PATH) + ".tmp";
+    std::list<std::string>::iterator ifaceIt;
+    std::list<QuotaInfo>::iterator it;
+    std::list<int>::iterator intIt;
+    std::string bootId;
+    FILE *fp;
+    int res;
+
+    if (readBootId(bootId)) {
+        return -1;
+    }
+    fp = fopen(tmpPath.c_str(), "w");
+    if (!fp) {
+        LOGE("Failed to save bandwidth state (%s)", strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "bootid %s\n", bootId.c_str());
+    fprintf(fp, "shared %lld %lld\n", sharedQuotaBytes, sharedAlertBytes);
+    for (ifaceIt = sharedQuotaIfaces.begin(); ifaceIt != sharedQuotaIfaces.end(); ifaceIt++) {
+        fprintf(fp, "sharediface %s\n", ifaceIt->c_str());
+    }
+    for (intIt = sharedThresholdPcts.begin(); intIt != sharedThresholdPcts.end(); intIt++) {
+        fprintf(fp, "sharedthreshold %d\n", *intIt);
+    }
+    for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
+        fprintf(fp, "iquota %s %lld %lld", it->ifaceName.c_str(), it->quota, it->alert);
+        for (intIt = it->thresholdPcts.begin(); intIt != it->thresholdPcts.end(); intIt++) {
+            fprintf(fp, " %d", *intIt);
+        }
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "globalalert %lld %d\n", globalAlertBytes, globalAlertTetherCount);
+    for (intIt = naughtyAppUids.begin(); intIt != naughtyAppUids.end(); intIt++) {
+        fprintf(fp, "naughtyapp %d\n", *intIt);
+    }
+    fprintf(fp, "rules\n");
+    res = committedRules.write(fp);
+    /* Without the fsync() a crash can leave an empty state after the rename. */
+    res |= fflush(fp) || fsync(fileno(fp));
+    res |= fclose(fp);
+
+    /* The old state stays until the new one is complete. */
+    if (res || rename(tmpPath.c_str(), STATE_PATH)) {
+        LOGE("Failed to save bandwidth state");
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int BandwidthController::restoreState(void) {
+    char buffer[MAX_CMD_LEN];
+    char name[MAX_IFACENAME_LEN];
+    char *token;
+    char *save;
+    long long bytes, alert;
+    int value, count;
+    std::string bootId;
+    std::list<std::string> quotaNames;
+    std::list<std::string>::iterator nameIt;
+    int res = -1;
+    FILE *fp;
+
+    fp = fopen(STATE_PATH, "r");
+    if (!fp) {
+        /* Nothing to adopt */
+        return -1;
+    }
+    if (!fgets(buffer, sizeof(buffer), fp)) {
+        buffer[0] = '\0';
+    }
+    buffer[strcspn(buffer, "\n")] = '\0';
+    if (readBootId(bootId) || strncmp(buffer, "bootid ", 7) || bootId != buffer + 7) {
+        LOGV("Bandwidth state is from an older boot");
+        fclose(fp);
+        return -1;
+    }
+
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        if (sscanf(buffer, "shared %lld %lld", &bytes, &alert) == 2) {
+            sharedQuotaBytes = bytes;
+            sharedAlertBytes = alert;
+        } else if (sscanf(buffer, "sharediface %63s", name) == 1) {
+            sharedQuotaIfaces.push_back(name);
+        } else if (sscanf(buffer, "sharedthreshold %d", &value) == 1) {
+            sharedThresholdPcts.push_back(value);
+        } else if (sscanf(buffer, "iquota %63s %lld %lld%n", name, &bytes, &alert, &count) == 3) {
+            quotaIfaces.push_back(QuotaInfo(name, bytes, alert));
+            for (token = strtok_r(buffer + count, " \n", &save); token;
+                 token = strtok_r(NULL, " \n", &save)) {
+                quotaIfaces.back().thresholdPcts.push_back(atoi(token));
+            }
+        } else if (sscanf(buffer, "globalalert %lld %d", &bytes, &value) == 2) {
+            globalAlertBytes = bytes;
+            globalAlertTetherCount = value;
+        } else if (sscanf(buffer, "naughtyapp %d", &value) == 1) {
+            naughtyAppUids.push_back(value);
+        } else if (!strcmp(buffer, "rules\n")) {
+            res = committedRules.read(fp);
+            break;
+        } else {
+            LOGE("Unexpected bandwidth state line: %s", buffer);
+            break;
+        }
+    }
+    fclose(fp);
+
+    /* The counters must still be there, untouched by anybody else. */
+    if (!res) {
+        res = verifyLiveRules(committedRules);
+    }
+    getQuotaNames(quotaNames);
+    for (nameIt = quotaNames.begin(); !res && nameIt != quotaNames.end(); nameIt++) {
+        if (getQuotaFd(nameIt->c_str()) < 0) {
+            res = -1;
+        }
+    }
+    if (res) {
+        LOGE("Bandwidth state does not match the kernel tables, resetting them");
+        return -1;
+    }
+    LOGI("Adopted the bandwidth rules of the previous netd");
+    return 0;
+}
+
+int BandwidthController::verifyLiveRules(const IptablesRuleSet &rules) {
+    static const int families[] = { AF_INET, AF_INET6 };
+    std::map<std::string, int> liveCounts;
+    std::map<std::string, std::list<std::string> > liveQuotaNames;
+
+    for (unsigned int famNum = 0; famNum < sizeof(families) / sizeof(families[0]); famNum++) {
+        liveCounts.clear();
+        liveQuotaNames.clear();
+        if (NetfilterTableReader::readChainSizes(families[famNum], "filter", liveCounts,
+                                                 liveQuotaNames)) {
+            return -1;
+        }
+        if (compareLiveRules(rules, liveCounts, liveQuotaNames)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int BandwidthController::compareLiveRules(const IptablesRuleSet &rules,
+        const std::map<std::string, int> &liveCounts,
+        const std::map<std::string, std::list<std::string> > &liveQuotaNames) {
+    std::map<std::string, int>::const_iterator liveIt;
+    std::map<std::string, std::list<std::string> >::const_iterator liveNamesIt;
+    std::list<std::string> chainNames;
+    std::list<std::string> quotaNames;
+    std::list<std::string> noNames;
+    std::list<std::string>::iterator it;
+    int liveCount;
+    int ruleCount;
+
+    rules.getChainNames(chainNames);
+    for (it = chainNames.begin(); it != chainNames.end(); it++) {
+        liveIt = liveCounts.find(*it);
+        liveCount = liveIt == liveCounts.end() ? -1 : liveIt->second;
+        ruleCount = rules.getRuleCount(*it);
+        /*
+         * Other controllers may have more rules in the shared chains,
+         * and OEMListener fills the OEM_CHAIN we only create.
+         */
+        if (rules.isShared(*it) || *it == OEM_CHAIN) {
+            if (liveCount < ruleCount) {
+                LOGE("Chain %s has %d rules instead of %d", it->c_str(), liveCount, ruleCount);
+                return -1;
+            }
+            continue;
+        }
+        if (liveCount != ruleCount) {
+            LOGE("Chain %s has %d rules instead of %d", it->c_str(), liveCount, ruleCount);
+            return -1;
+        }
+
+        /* Same count but other quotas or alerts is another ruleset. */
+        quotaNames.clear();
+        rules.getQuotaNames(*it, quotaNames);
+        liveNamesIt = liveQuotaNames.find(*it);
+        if (quotaNames != (liveNamesIt == liveQuotaNames.end() ? noNames : liveNamesIt->second)) {
+            LOGE("Chain %s has other quotas than saved", it->c_str());
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int BandwidthController::runCommands(int numCommands, const char *commands[],
                                      RunCmdErrHandling cmdErrHandling) {
     int res = 0;
     LOGV("runCommands(): %d commands", numCommands);
     for (int cmdNum = 0; cmdNum < numCommands; cmdNum++) {
-        res = runIpxtablesCmd(commands[cmdNum], IptRejectNoAdd);
+        res = runIpxtablesCmd(commands[cmdNum], IptRejectNoAdd, cmdErrHandling);
         if (res && cmdErrHandling != RunCmdFailureBad)
             return res;
     }
     return cmdErrHandling == RunCmdFailureBad ? res : 0;
 }
 
-std::string BandwidthController::makeIptablesNaughtyCmd(IptOp op, int uid) {
-    std::string res;
-    char *buff;
-    const char *opFlag;
+bool BandwidthController::useBatchCommands(void) {
+    return IptablesRestoreController::isEnabled();
+}
 
-    switch (op) {
-    case IptOpInsert:
-        opFlag = "-I";
-        break;
-    case IptOpReplace:
-        opFlag = "-R";
-        break;
-    default:
-    case IptOpDelete:
-        opFlag = "-D";
-        break;
+void BandwidthController::appendCommands(std::list<std::string> &commandList, int numCommands,
+                                         const char *commands[]) {
+    for (int cmdNum = 0; cmdNum < numCommands; cmdNum++) {
+        commandList.push_back(commands[cmdNum]);
+    }
+}
+
+int BandwidthController::applyCommands(IptablesRuleSet &rules, int numCommands,
+                                       const char *commands[]) {
+    int res = 0;
+
+    for (int cmdNum = 0; cmdNum < numCommands; cmdNum++) {
+        res |= rules.apply(commands[cmdNum], false);
+    }
+    return res;
+}
+
+int BandwidthController::runRuleChanges(int numResetCommands, const char *resetCommands[],
+                                        const std::list<IptablesRuleSet::Rule> &changes) {
+    std::list<IptablesRuleSet::Rule>::const_iterator it;
+    IptRejectOp rejectHandling;
+    int res = 0;
+
+    LOGV("runRuleChanges(): %d reset commands, %d changes", numResetCommands, changes.size());
+
+    if (useBatchCommands()) {
+        std::list<std::string> v4Commands;
+        std::list<std::string> v6Commands;
+
+        appendCommands(v4Commands, numResetCommands, resetCommands);
+        appendCommands(v6Commands, numResetCommands, resetCommands);
+        for (it = changes.begin(); it != changes.end(); it++) {
+            v4Commands.push_back(it->command(false));
+            v6Commands.push_back(it->command(true));
+        }
+        if (v4Commands.empty()) {
+            return 0;
+        }
+        return IptablesRestoreController::executeBoth(
+                IptablesRestoreController::makeRestoreRules(v4Commands),
+                IptablesRestoreController::makeRestoreRules(v6Commands));
+    }
+
+    /* The reset commands are allowed to fail */
+    runCommands(numResetCommands, resetCommands, RunCmdFailureOk);
+    for (it = changes.begin(); it != changes.end(); it++) {
+        rejectHandling = it->reject ? IptRejectAdd : IptRejectNoAdd;
+        res = runIpxtablesCmd(it->spec.c_str(), rejectHandling);
+        if (res) {
+            /* Without iptables-restore the earlier changes are already in. */
+            LOGE("Rules partially committed, \"bandwidth enable\" resyncs them");
+            break;
+        }
     }
-    asprintf(&buff, "%s penalty_box -m owner --uid-owner %d", opFlag, uid);
-    res = buff;
-    free(buff);
     return res;
 }
 
+int BandwidthController::commitRules(const IptablesRuleSet &rules) {
+    std::list<IptablesRuleSet::Rule> changes;
+    int res;
+
+    IptablesRuleSet::diff(committedRules, rules, changes);
+    res = runRuleChanges(0, NULL, changes);
+    if (res) {
+        LOGE("Failed to commit %d rule changes", changes.size());
+        return res;
+    }
+    committedRules = rules;
+    CounterSampler::notifyQuotasChanged();
+    return 0;
+}
+
+int BandwidthController::makePenaltyBox(IptablesRuleSet &rules,
+                                        const std::list<int> &appUids) {
+    std::map<int, IptablesRuleSet::Rule> uidRules;
+    std::list<int>::const_iterator it;
+    char *buff;
+
+    for (it = appUids.begin(); it != appUids.end(); it++) {
+        asprintf(&buff, "-m owner --uid-owner %d", *it);
+        uidRules.insert(std::make_pair(*it, IptablesRuleSet::Rule(buff, true)));
+        free(buff);
+    }
+    return rules.setUidTree("penalty_box", "penalty", uidRules);
+}
+
 int BandwidthController::addNaughtyApps(int numUids, char *appUids[]) {
     return maninpulateNaughtyApps(numUids, appUids, NaughtyAppOpAdd);
 }
@@ -292,48 +646,108 @@ int BandwidthController::removeNaughtyApps(int numUids, char *appUids[]) {
     return maninpulateNaughtyApps(numUids, appUids, NaughtyAppOpRemove);
 }
 
+int BandwidthController::stageAddNaughtyApps(SocketClient *client, int numUids,
+                                             char *appUids[]) {
+    return stageNaughtyApps(client, numUids, appUids, NaughtyAppOpAdd);
+}
+
+int BandwidthController::stageRemoveNaughtyApps(SocketClient *client, int numUids,
+                                                char *appUids[]) {
+    return stageNaughtyApps(client, numUids, appUids, NaughtyAppOpRemove);
+}
+
+int BandwidthController::stageNaughtyApps(SocketClient *client, int numUids,
+                                          char *appStrUids[], NaughtyAppOp appOp) {
+    std::list<NaughtyAppChange> &staged = stagedNaughtyAppChanges[client];
+
+    if (staged.size() + numUids > MAX_STAGED_NAUGHTY_APP_CHANGES) {
+        LOGE("Too many staged naughty app changes, max %u", MAX_STAGED_NAUGHTY_APP_CHANGES);
+        return -1;
+    }
+    return parseNaughtyApps(numUids, appStrUids, appOp, staged);
+}
+
+int BandwidthController::commitNaughtyApps(SocketClient *client) {
+    std::map<SocketClient *, std::list<NaughtyAppChange> >::iterator it;
+    int res;
+
+    it = stagedNaughtyAppChanges.find(client);
+    if (it == stagedNaughtyAppChanges.end()) {
+        return 0;
+    }
+    res = commitNaughtyAppChanges(it->second);
+    stagedNaughtyAppChanges.erase(it);
+    return res;
+}
+
+int BandwidthController::abortNaughtyApps(SocketClient *client) {
+    dropNaughtyApps(client);
+    return 0;
+}
+
+void BandwidthController::dropNaughtyApps(SocketClient *client) {
+    stagedNaughtyAppChanges.erase(client);
+}
+
 int BandwidthController::maninpulateNaughtyApps(int numUids, char *appStrUids[], NaughtyAppOp appOp) {
-    char cmd[MAX_CMD_LEN];
-    int uidNum;
-    const char *failLogTemplate;
-    IptOp op;
-    int appUids[numUids];
-    std::string naughtyCmd;
-
-    switch (appOp) {
-    case NaughtyAppOpAdd:
-        op = IptOpInsert;
-        failLogTemplate = "Failed to add app uid %d to penalty box.";
-        break;
-    case NaughtyAppOpRemove:
-        op = IptOpDelete;
-        failLogTemplate = "Failed to delete app uid %d from penalty box.";
-        break;
+    std::list<NaughtyAppChange> changes;
+
+    if (parseNaughtyApps(numUids, appStrUids, appOp, changes)) {
+        return -1;
     }
+    return commitNaughtyAppChanges(changes);
+}
+
+int BandwidthController::parseNaughtyApps(int numUids, char *appStrUids[], NaughtyAppOp appOp,
+                                          std::list<NaughtyAppChange> &changes) {
+    std::list<NaughtyAppChange> parsedChanges;
+    int uidNum;
+    int appUid;
 
     for (uidNum = 0; uidNum < numUids; uidNum++) {
-        appUids[uidNum] = atol(appStrUids[uidNum]);
-        if (appUids[uidNum] == 0) {
-            LOGE(failLogTemplate, appUids[uidNum]);
-            goto fail_parse;
+        appUid = atol(appStrUids[uidNum]);
+        if (appUid == 0) {
+            LOGE("Invalid app uid %s", appStrUids[uidNum]);
+            return -1;
         }
+        parsedChanges.push_back(NaughtyAppChange(appUid, appOp));
     }
+    changes.splice(changes.end(), parsedChanges);
+    return 0;
+}
 
-    for (uidNum = 0; uidNum < numUids; uidNum++) {
-        naughtyCmd = makeIptablesNaughtyCmd(op, appUids[uidNum]);
-        if (runIpxtablesCmd(naughtyCmd.c_str(), IptRejectAdd)) {
-            LOGE(failLogTemplate, appUids[uidNum]);
-            goto fail_with_uidNum;
+int BandwidthController::commitNaughtyAppChanges(const std::list<NaughtyAppChange> &changes) {
+    IptablesRuleSet rules = committedRules;
+    std::list<int> newAppUids = naughtyAppUids;
+    std::list<NaughtyAppChange>::const_iterator changeIt;
+    std::list<int>::iterator it;
+
+    for (changeIt = changes.begin(); changeIt != changes.end(); changeIt++) {
+        for (it = newAppUids.begin(); it != newAppUids.end(); it++) {
+            if (*it == changeIt->appUid)
+                break;
+        }
+        if (changeIt->appOp == NaughtyAppOpAdd) {
+            if (it == newAppUids.end()) {
+                newAppUids.push_back(changeIt->appUid);
+            }
+        } else {
+            if (it == newAppUids.end()) {
+                LOGE("Failed to delete app uid %d from penalty box.", changeIt->appUid);
+                return -1;
+            }
+            newAppUids.erase(it);
         }
     }
-    return 0;
 
-fail_with_uidNum:
-    /* Try to remove the uid that failed in any case*/
-    naughtyCmd = makeIptablesNaughtyCmd(IptOpDelete, appUids[uidNum]);
-    runIpxtablesCmd(naughtyCmd.c_str(), IptRejectAdd);
-fail_parse:
-    return -1;
+    /* All the uids go in one commit: they are either all applied or none is. */
+    if (makePenaltyBox(rules, newAppUids) || commitRules(rules)) {
+        LOGE("Failed to update %d app uids in penalty box.", changes.size());
+        return -1;
+    }
+    naughtyAppUids = newAppUids;
+    saveState();
+    return 0;
 }
 
 std::string BandwidthController::makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota) {
@@ -364,7 +778,8 @@ std::string BandwidthController::makeIptablesQuotaCmd(IptOp op, const char *cost
     return res;
 }
 
-int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
+int BandwidthController::prepCostlyIface(IptablesRuleSet &rules, const char *ifn,
+                                         QuotaType quotaType) {
     char cmd[MAX_CMD_LEN];
     int res = 0;
     int ruleInsertPos = 1;
@@ -378,16 +793,16 @@ int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
         costString += ifn;
         costCString = costString.c_str();
         snprintf(cmd, sizeof(cmd), "-N %s", costCString);
-        res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+        res |= rules.apply(cmd, false);
         snprintf(cmd, sizeof(cmd), "-A %s -j penalty_box", costCString);
-        res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+        res |= rules.apply(cmd, false);
         snprintf(cmd, sizeof(cmd), "-A %s -m owner --socket-exists", costCString);
-        res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+        res |= rules.apply(cmd, false);
         /* TODO(jpa): Figure out why iptables doesn't correctly return from this
          * chain. For now, hack the chain exit with an ACCEPT.
          */
         snprintf(cmd, sizeof(cmd), "-A %s --jump p30dw", costCString);
-        res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+        res |= rules.apply(cmd, false);
         break;
     case QuotaShared:
         costCString = "costly_shared";
@@ -399,13 +814,14 @@ int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
         ruleInsertPos = 2;
     }
     snprintf(cmd, sizeof(cmd), "-I INPUT %d -i %s --goto %s", ruleInsertPos, ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+    res |= rules.apply(cmd, false);
     snprintf(cmd, sizeof(cmd), "-I OUTPUT %d -o %s --goto %s", ruleInsertPos, ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+    res |= rules.apply(cmd, false);
     return res;
 }
 
-int BandwidthController::cleanupCostlyIface(const char *ifn, QuotaType quotaType) {
+int BandwidthController::cleanupCostlyIface(IptablesRuleSet &rules, const char *ifn,
+                                            QuotaType quotaType) {
     char cmd[MAX_CMD_LEN];
     int res = 0;
     std::string costString;
@@ -423,16 +839,16 @@ int BandwidthController::cleanupCostlyIface(const char *ifn, QuotaType quotaType
     }
 
     snprintf(cmd, sizeof(cmd), "-D INPUT -i %s --goto %s", ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+    res |= rules.apply(cmd, false);
     snprintf(cmd, sizeof(cmd), "-D OUTPUT -o %s --goto %s", ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+    res |= rules.apply(cmd, false);
 
     /* The "-N costly_shared" is created upfront, no need to handle it here. */
     if (quotaType == QuotaUnique) {
         snprintf(cmd, sizeof(cmd), "-F %s", costCString);
-        res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+        res |= rules.apply(cmd, false);
         snprintf(cmd, sizeof(cmd), "-X %s", costCString);
-        res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+        res |= rules.apply(cmd, false);
     }
     return res;
 }
@@ -446,6 +862,7 @@ int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxB
     ;
     const char *costName = "shared";
     std::list<std::string>::iterator it;
+    std::list<std::pair<std::string, int64_t> > thresholdUpdates;
 
     if (!maxBytes) {
         /* Don't talk about -1, deprecate it. */
@@ -469,17 +886,23 @@ int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxB
     }
 
     if (it == sharedQuotaIfaces.end()) {
-        res |= prepCostlyIface(ifn, QuotaShared);
+        IptablesRuleSet rules = committedRules;
+
+        res |= prepCostlyIface(rules, ifn, QuotaShared);
         if (sharedQuotaIfaces.empty()) {
             quotaCmd = makeIptablesQuotaCmd(IptOpInsert, costName, maxBytes);
-            res |= runIpxtablesCmd(quotaCmd.c_str(), IptRejectAdd);
-            if (res) {
-                LOGE("Failed set quota rule");
-                goto fail;
-            }
+            res |= rules.apply(quotaCmd, true);
+        }
+        /* On failure nothing was committed: no need to clean up. */
+        if (res || commitRules(rules)) {
+            LOGE("Failed set quota rule");
+            return -1;
+        }
+        if (sharedQuotaIfaces.empty()) {
             sharedQuotaBytes = maxBytes;
         }
         sharedQuotaIfaces.push_front(ifaceName);
+        saveState();
 
     }
 
@@ -487,21 +910,14 @@ int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxB
         res |= updateQuota(costName, maxBytes);
         if (res) {
             LOGE("Failed update quota for %s", costName);
-            goto fail;
+            return -1;
         }
         sharedQuotaBytes = maxBytes;
+        makeThresholdUpdates(costName, maxBytes, 0, sharedThresholdPcts, thresholdUpdates);
+        res |= runQuotaUpdates(thresholdUpdates);
+        saveState();
     }
-    return 0;
-
-    fail:
-    /*
-     * TODO(jpa): once we get rid of iptables in favor of rtnetlink, reparse
-     * rules in the kernel to see which ones need cleaning up.
-     * For now callers needs to choose if they want to "ndc bandwidth enable"
-     * which resets everything.
-     */
-    removeInterfaceSharedQuota(ifn);
-    return -1;
+    return res;
 }
 
 /* It will also cleanup any shared alerts */
@@ -510,6 +926,7 @@ int BandwidthController::removeInterfaceSharedQuota(const char *iface) {
     int res = 0;
     std::string ifaceName;
     std::list<std::string>::iterator it;
+    std::list<int>::iterator pctIt;
     const char *costName = "shared";
 
     if (StrncpyAndCheck(ifn, iface, sizeof(ifn))) {
@@ -527,19 +944,35 @@ int BandwidthController::removeInterfaceSharedQuota(const char *iface) {
         return -1;
     }
 
-    res |= cleanupCostlyIface(ifn, QuotaShared);
+    IptablesRuleSet rules = committedRules;
+
+    res |= cleanupCostlyIface(rules, ifn, QuotaShared);
+    if (sharedQuotaIfaces.size() == 1) {
+        /* The quota2 counter may have been updated since, match it by name. */
+        res |= rules.deleteQuotaRule("costly_shared", costName);
+        for (pctIt = sharedThresholdPcts.begin(); pctIt != sharedThresholdPcts.end(); pctIt++) {
+            res |= rules.deleteQuotaRule("costly_shared", makeThresholdName(costName, *pctIt));
+        }
+    }
+    if (res || commitRules(rules)) {
+        LOGE("Failed to remove shared quota for %s", ifn);
+        return -1;
+    }
     sharedQuotaIfaces.erase(it);
 
     if (sharedQuotaIfaces.empty()) {
-        std::string quotaCmd;
-        quotaCmd = makeIptablesQuotaCmd(IptOpDelete, costName, sharedQuotaBytes);
-        res |= runIpxtablesCmd(quotaCmd.c_str(), IptRejectAdd);
+        closeQuotaFd(costName);
+        for (pctIt = sharedThresholdPcts.begin(); pctIt != sharedThresholdPcts.end(); pctIt++) {
+            closeQuotaFd(makeThresholdName(costName, *pctIt).c_str());
+        }
+        sharedThresholdPcts.clear();
         sharedQuotaBytes = 0;
         if (sharedAlertBytes) {
             removeSharedAlert();
             sharedAlertBytes = 0;
         }
     }
+    saveState();
     return res;
 }
 
@@ -550,6 +983,7 @@ int BandwidthController::setInterfaceQuota(const char *iface, int64_t maxBytes)
     const char *costName;
     std::list<QuotaInfo>::iterator it;
     std::string quotaCmd;
+    std::list<std::pair<std::string, int64_t> > thresholdUpdates;
 
     if (!maxBytes) {
         /* Don't talk about -1, deprecate it. */
@@ -574,35 +1008,182 @@ int BandwidthController::setInterfaceQuota(const char *iface, int64_t maxBytes)
     }
 
     if (it == quotaIfaces.end()) {
-        res |= prepCostlyIface(ifn, QuotaUnique);
+        IptablesRuleSet rules = committedRules;
+
+        res |= prepCostlyIface(rules, ifn, QuotaUnique);
         quotaCmd = makeIptablesQuotaCmd(IptOpInsert, costName, maxBytes);
-        res |= runIpxtablesCmd(quotaCmd.c_str(), IptRejectAdd);
-        if (res) {
+        res |= rules.apply(quotaCmd, true);
+        /* On failure nothing was committed: no need to clean up. */
+        if (res || commitRules(rules)) {
             LOGE("Failed set quota rule");
-            goto fail;
+            return -1;
         }
 
         quotaIfaces.push_front(QuotaInfo(ifaceName, maxBytes, 0));
+        saveState();
 
     } else {
         res |= updateQuota(costName, maxBytes);
         if (res) {
             LOGE("Failed update quota for %s", iface);
-            goto fail;
+            return -1;
         }
         it->quota = maxBytes;
+        makeThresholdUpdates(costName, maxBytes, 0, it->thresholdPcts, thresholdUpdates);
+        res |= runQuotaUpdates(thresholdUpdates);
+        saveState();
+    }
+    return res;
+}
+
+int BandwidthController::setQuotas(int64_t sharedBytes, int64_t sharedAlert,
+                                   const std::list<QuotaSpec> &specs) {
+    char ifn[MAX_IFACENAME_LEN];
+    int res = 0;
+    std::string quotaCmd;
+    std::list<std::string> newSharedIfaces;
+    std::list<QuotaInfo> newQuotaIfaces;
+    std::list<std::pair<std::string, int64_t> > quotaUpdates;
+    std::list<std::pair<std::string, int64_t> >::iterator updateIt;
+    std::list<QuotaSpec>::const_iterator specIt;
+    std::list<std::string>::iterator sharedIt;
+    std::list<QuotaInfo>::iterator it;
+    IptablesRuleSet rules = committedRules;
+
+    if (sharedBytes < 0 || sharedAlert < 0) {
+        LOGE("Invalid bytes value. 1..max_int64.");
+        return -1;
+    }
+
+    newQuotaIfaces = quotaIfaces;
+    for (specIt = specs.begin(); specIt != specs.end(); specIt++) {
+        if (StrncpyAndCheck(ifn, specIt->ifaceName.c_str(), sizeof(ifn))) {
+            LOGE("Interface name longer than %d", MAX_IFACENAME_LEN);
+            return -1;
+        }
+
+        if (specIt->shared) {
+            for (sharedIt = sharedQuotaIfaces.begin(); sharedIt != sharedQuotaIfaces.end();
+                 sharedIt++) {
+                if (*sharedIt == specIt->ifaceName)
+                    break;
+            }
+            if (sharedIt != sharedQuotaIfaces.end()) {
+                continue;
+            }
+            for (sharedIt = newSharedIfaces.begin(); sharedIt != newSharedIfaces.end();
+                 sharedIt++) {
+                if (*sharedIt == specIt->ifaceName)
+                    break;
+            }
+            if (sharedIt == newSharedIfaces.end()) {
+                res |= prepCostlyIface(rules, ifn, QuotaShared);
+                newSharedIfaces.push_back(specIt->ifaceName);
+            }
+            continue;
+        }
+
+        if (specIt->quota <= 0 || specIt->alert < 0) {
+            LOGE("Invalid bytes value for %s. 1..max_int64.", ifn);
+            return -1;
+        }
+        for (it = newQuotaIfaces.begin(); it != newQuotaIfaces.end(); it++) {
+            if (it->ifaceName == specIt->ifaceName)
+                break;
+        }
+        if (it == newQuotaIfaces.end()) {
+            res |= prepCostlyIface(rules, ifn, QuotaUnique);
+            quotaCmd = makeIptablesQuotaCmd(IptOpInsert, ifn, specIt->quota);
+            res |= rules.apply(quotaCmd, true);
+            newQuotaIfaces.push_front(QuotaInfo(specIt->ifaceName, specIt->quota, 0));
+            it = newQuotaIfaces.begin();
+        } else if (it->quota != specIt->quota) {
+            quotaUpdates.push_back(std::make_pair(specIt->ifaceName, specIt->quota));
+            makeThresholdUpdates(ifn, specIt->quota, 0, it->thresholdPcts, quotaUpdates);
+        }
+
+        if (!specIt->alert) {
+            continue;
+        }
+        if (!it->alert) {
+            res |= insertCostlyAlert(rules, ifn, (specIt->ifaceName + "Alert").c_str(),
+                                     specIt->alert);
+            it->alert = specIt->alert;
+        } else if (it->alert != specIt->alert) {
+            quotaUpdates.push_back(std::make_pair(specIt->ifaceName + "Alert", specIt->alert));
+        }
+    }
+
+    /* The shared quota2 rule goes in with the 1st shared iface. */
+    if (sharedQuotaIfaces.empty() && !newSharedIfaces.empty()) {
+        if (!sharedBytes) {
+            LOGE("Need a shared quota value for the 1st shared interface");
+            return -1;
+        }
+        quotaCmd = makeIptablesQuotaCmd(IptOpInsert, "shared", sharedBytes);
+        res |= rules.apply(quotaCmd, true);
+    } else if (sharedBytes && sharedBytes != sharedQuotaBytes) {
+        if (sharedQuotaIfaces.empty()) {
+            LOGE("Need to have a shared interface to set the shared quota");
+            return -1;
+        }
+        quotaUpdates.push_back(std::make_pair(std::string("shared"), sharedBytes));
+        makeThresholdUpdates("shared", sharedBytes, 0, sharedThresholdPcts, quotaUpdates);
+    }
+
+    if (sharedAlert) {
+        if (sharedQuotaIfaces.empty() && newSharedIfaces.empty()) {
+            LOGE("Need to have a prior shared quota set to set an alert");
+            return -1;
+        }
+        if (!sharedAlertBytes) {
+            res |= insertCostlyAlert(rules, "shared", "sharedAlert", sharedAlert);
+        } else if (sharedAlertBytes != sharedAlert) {
+            quotaUpdates.push_back(std::make_pair(std::string("sharedAlert"), sharedAlert));
+        }
+    }
+
+    /* On failure nothing was committed: no need to clean up. */
+    if (res || commitRules(rules)) {
+        LOGE("Failed to set quotas for %d interfaces", specs.size());
+        return -1;
     }
-    return 0;
 
-    fail:
+    if (sharedQuotaIfaces.empty() && !newSharedIfaces.empty()) {
+        sharedQuotaBytes = sharedBytes;
+    }
+    sharedQuotaIfaces.insert(sharedQuotaIfaces.begin(), newSharedIfaces.begin(),
+                             newSharedIfaces.end());
+    if (sharedAlert && !sharedAlertBytes) {
+        sharedAlertBytes = sharedAlert;
+    }
+    quotaIfaces = newQuotaIfaces;
+
     /*
-     * TODO(jpa): once we get rid of iptables in favor of rtnetlink, reparse
-     * rules in the kernel to see which ones need cleaning up.
-     * For now callers needs to choose if they want to "ndc bandwidth enable"
-     * which resets everything.
+     * The counters that were already there only need their value written,
+     * and the state only records the values the kernel took.
      */
-    removeInterfaceSharedQuota(ifn);
-    return -1;
+    for (updateIt = quotaUpdates.begin(); updateIt != quotaUpdates.end(); updateIt++) {
+        if (updateQuota(updateIt->first.c_str(), updateIt->second)) {
+            LOGE("Failed update quota for %s", updateIt->first.c_str());
+            res = -1;
+            continue;
+        }
+        if (updateIt->first == "shared") {
+            sharedQuotaBytes = updateIt->second;
+        } else if (updateIt->first == "sharedAlert") {
+            sharedAlertBytes = updateIt->second;
+        }
+        for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
+            if (updateIt->first == it->ifaceName) {
+                it->quota = updateIt->second;
+            } else if (updateIt->first == it->ifaceName + "Alert") {
+                it->alert = updateIt->second;
+            }
+        }
+    }
+    saveState();
+    return res;
 }
 
 int BandwidthController::getInterfaceSharedQuota(int64_t *bytes) {
@@ -610,21 +1191,115 @@ int BandwidthController::getInterfaceSharedQuota(int64_t *bytes) {
 }
 
 int BandwidthController::getInterfaceQuota(const char *costName, int64_t *bytes) {
-    FILE *fp;
+    return readQuota(costName, bytes);
+}
+
+void BandwidthController::getQuotaNames(std::list<std::string> &quotaNames) {
+    std::list<QuotaInfo>::iterator it;
+    std::list<int>::iterator pctIt;
+
+    if (!sharedQuotaIfaces.empty()) {
+        quotaNames.push_back("shared");
+    }
+    if (sharedAlertBytes) {
+        quotaNames.push_back("sharedAlert");
+    }
+    for (pctIt = sharedThresholdPcts.begin(); pctIt != sharedThresholdPcts.end(); pctIt++) {
+        quotaNames.push_back(makeThresholdName("shared", *pctIt));
+    }
+    for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
+        quotaNames.push_back(it->ifaceName);
+        if (it->alert) {
+            quotaNames.push_back(it->ifaceName + "Alert");
+        }
+        for (pctIt = it->thresholdPcts.begin(); pctIt != it->thresholdPcts.end(); pctIt++) {
+            quotaNames.push_back(makeThresholdName(it->ifaceName.c_str(), *pctIt));
+        }
+    }
+    if (globalAlertBytes) {
+        quotaNames.push_back(ALERT_GLOBAL_NAME);
+    }
+}
+
+int BandwidthController::getQuotas(std::list<std::pair<std::string, int64_t> > &quotas) {
+    std::list<std::string> quotaNames;
+    std::list<std::string>::iterator nameIt;
+    int64_t bytes;
+
+    getQuotaNames(quotaNames);
+    for (nameIt = quotaNames.begin(); nameIt != quotaNames.end(); nameIt++) {
+        if (readQuota(nameIt->c_str(), &bytes)) {
+            continue;
+        }
+        quotas.push_back(std::make_pair(*nameIt, bytes));
+    }
+    return 0;
+}
+
+int BandwidthController::getQuotaFd(const char *quotaName) {
+    std::map<std::string, int>::iterator it;
     char *fname;
-    int scanRes;
+    int fd;
+
+    it = quotaFds.find(quotaName);
+    if (it != quotaFds.end()) {
+        return it->second;
+    }
 
-    asprintf(&fname, "/proc/net/xt_quota/%s", costName);
-    fp = fopen(fname, "r");
+    asprintf(&fname, "/proc/net/xt_quota/%s", quotaName);
+    fd = open(fname, O_RDONLY);
     free(fname);
-    if (!fp) {
-        LOGE("Reading quota %s failed (%s)", costName, strerror(errno));
+    if (fd < 0) {
+        LOGE("Opening quota %s failed (%s)", quotaName, strerror(errno));
         return -1;
     }
-    scanRes = fscanf(fp, "%lld", bytes);
-    LOGV("Read quota res=%d bytes=%lld", scanRes, *bytes);
-    fclose(fp);
-    return scanRes == 1 ? 0 : -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    quotaFds[quotaName] = fd;
+    return fd;
+}
+
+void BandwidthController::closeQuotaFd(const char *quotaName) {
+    std::map<std::string, int>::iterator it;
+
+    it = quotaFds.find(quotaName);
+    if (it != quotaFds.end()) {
+        close(it->second);
+        quotaFds.erase(it);
+    }
+}
+
+void BandwidthController::closeQuotaFds(void) {
+    std::map<std::string, int>::iterator it;
+
+    for (it = quotaFds.begin(); it != quotaFds.end(); it++) {
+        close(it->second);
+    }
+    quotaFds.clear();
+}
+
+int BandwidthController::readQuota(const char *quotaName, int64_t *bytes) {
+    char buff[32];
+    ssize_t len;
+    int scanRes;
+    int fd;
+
+    /* A 2nd try for when the counter was recreated after the fd was opened. */
+    for (int attempt = 0; attempt < 2; attempt++) {
+        fd = getQuotaFd(quotaName);
+        if (fd < 0) {
+            return -1;
+        }
+        len = pread(fd, buff, sizeof(buff) - 1, 0);
+        if (len > 0) {
+            buff[len] = '\0';
+            scanRes = sscanf(buff, "%lld", bytes);
+            LOGV("Read quota res=%d bytes=%lld", scanRes, *bytes);
+            return scanRes == 1 ? 0 : -1;
+        }
+        closeQuotaFd(quotaName);
+    }
+    LOGE("Reading quota %s failed (%s)", quotaName, len ? strerror(errno) : "empty");
+    return -1;
 }
 
 int BandwidthController::removeInterfaceQuota(const char *iface) {
@@ -634,6 +1309,7 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
     std::string ifaceName;
     const char *costName;
     std::list<QuotaInfo>::iterator it;
+    std::list<int>::iterator pctIt;
 
     if (StrncpyAndCheck(ifn, iface, sizeof(ifn))) {
         LOGE("Interface name longer than %d", MAX_IFACENAME_LEN);
@@ -652,12 +1328,25 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
         return -1;
     }
 
+    IptablesRuleSet rules = committedRules;
+
     /* This also removes the quota command of CostlyIface chain. */
-    res |= cleanupCostlyIface(ifn, QuotaUnique);
+    res |= cleanupCostlyIface(rules, ifn, QuotaUnique);
+    if (res || commitRules(rules)) {
+        LOGE("Failed to remove quota for %s", ifn);
+        return -1;
+    }
 
+    /* The alerts, if any, went away with the costly chain. */
+    closeQuotaFd(costName);
+    closeQuotaFd((ifaceName + "Alert").c_str());
+    for (pctIt = it->thresholdPcts.begin(); pctIt != it->thresholdPcts.end(); pctIt++) {
+        closeQuotaFd(makeThresholdName(costName, *pctIt).c_str());
+    }
     quotaIfaces.erase(it);
+    saveState();
 
-    return res;
+    return 0;
 }
 
 int BandwidthController::updateQuota(const char *quotaName, int64_t bytes) {
@@ -677,7 +1366,8 @@ int BandwidthController::updateQuota(const char *quotaName, int64_t bytes) {
     return 0;
 }
 
-int BandwidthController::runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes) {
+int BandwidthController::applyIptablesAlertCmd(IptablesRuleSet &rules, IptOp op,
+                                               const char *alertName, int64_t bytes) {
     int res = 0;
     const char *opFlag;
     const char *ifaceLimiting;
@@ -692,24 +1382,27 @@ int BandwidthController::runIptablesAlertCmd(IptOp op, const char *alertName, in
         break;
     default:
     case IptOpDelete:
-        opFlag = "-D";
-        break;
+        /* The quota2 counter may have been updated since, match it by name. */
+        res |= rules.deleteQuotaRule("INPUT", alertName);
+        res |= rules.deleteQuotaRule("OUTPUT", alertName);
+        return res;
     }
 
     ifaceLimiting = "! -i lo+";
-    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, ifaceLimiting, opFlag, "INPUT",
-        bytes, alertName, alertName);
-    res |= runIpxtablesCmd(alertQuotaCmd, IptRejectNoAdd);
+    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, opFlag, "INPUT", ifaceLimiting,
+        bytes, alertName);
+    res |= rules.apply(alertQuotaCmd, false);
     free(alertQuotaCmd);
     ifaceLimiting = "! -o lo+";
-    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, ifaceLimiting, opFlag, "OUTPUT",
-        bytes, alertName, alertName);
-    res |= runIpxtablesCmd(alertQuotaCmd, IptRejectNoAdd);
+    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, opFlag, "OUTPUT", ifaceLimiting,
+        bytes, alertName);
+    res |= rules.apply(alertQuotaCmd, false);
     free(alertQuotaCmd);
     return res;
 }
 
-int BandwidthController::runIptablesAlertFwdCmd(IptOp op, const char *alertName, int64_t bytes) {
+int BandwidthController::applyIptablesAlertFwdCmd(IptablesRuleSet &rules, IptOp op,
+                                                  const char *alertName, int64_t bytes) {
     int res = 0;
     const char *opFlag;
     const char *ifaceLimiting;
@@ -724,14 +1417,13 @@ int BandwidthController::runIptablesAlertFwdCmd(IptOp op, const char *alertName,
         break;
     default:
     case IptOpDelete:
-        opFlag = "-D";
-        break;
+        return rules.deleteQuotaRule("FORWARD", alertName);
     }
 
     ifaceLimiting = "! -i lo+";
-    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, ifaceLimiting, opFlag, "FORWARD",
-        bytes, alertName, alertName);
-    res = runIpxtablesCmd(alertQuotaCmd, IptRejectNoAdd);
+    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, opFlag, "FORWARD", ifaceLimiting,
+        bytes, alertName);
+    res = rules.apply(alertQuotaCmd, false);
     free(alertQuotaCmd);
     return res;
 }
@@ -747,18 +1439,26 @@ int BandwidthController::setGlobalAlert(int64_t bytes) {
     if (globalAlertBytes) {
         res = updateQuota(alertName, bytes);
     } else {
-        res = runIptablesAlertCmd(IptOpInsert, alertName, bytes);
+        IptablesRuleSet rules = committedRules;
+
+        res = applyIptablesAlertCmd(rules, IptOpInsert, alertName, bytes);
         if (globalAlertTetherCount) {
             LOGV("setGlobalAlert for %d tether", globalAlertTetherCount);
-            res |= runIptablesAlertFwdCmd(IptOpInsert, alertName, bytes);
+            res |= applyIptablesAlertFwdCmd(rules, IptOpInsert, alertName, bytes);
         }
+        res = res ? res : commitRules(rules);
+    }
+    if (res) {
+        return res;
     }
     globalAlertBytes = bytes;
+    saveState();
     return res;
 }
 
 int BandwidthController::setGlobalAlertInForwardChain(void) {
     const char *alertName = ALERT_GLOBAL_NAME;
+    IptablesRuleSet rules = committedRules;
     int res = 0;
 
     globalAlertTetherCount++;
@@ -770,34 +1470,45 @@ int BandwidthController::setGlobalAlertInForwardChain(void) {
      * tether, we are also done.
      */
     if (!globalAlertBytes || globalAlertTetherCount != 1) {
+        saveState();
         return 0;
     }
 
     /* We only add the rule if this was the 1st tether added. */
-    res = runIptablesAlertFwdCmd(IptOpInsert, alertName, globalAlertBytes);
+    res = applyIptablesAlertFwdCmd(rules, IptOpInsert, alertName, globalAlertBytes);
+    res = res ? res : commitRules(rules);
+    saveState();
     return res;
 }
 
 int BandwidthController::removeGlobalAlert(void) {
 
     const char *alertName = ALERT_GLOBAL_NAME;
+    IptablesRuleSet rules = committedRules;
     int res = 0;
 
     if (!globalAlertBytes) {
         LOGE("No prior alert set");
         return -1;
     }
-    res = runIptablesAlertCmd(IptOpDelete, alertName, globalAlertBytes);
+    res = applyIptablesAlertCmd(rules, IptOpDelete, alertName, globalAlertBytes);
     if (globalAlertTetherCount) {
-        res |= runIptablesAlertFwdCmd(IptOpDelete, alertName, globalAlertBytes);
+        res |= applyIptablesAlertFwdCmd(rules, IptOpDelete, alertName, globalAlertBytes);
     }
+    res = res ? res : commitRules(rules);
+    if (res) {
+        return res;
+    }
+    closeQuotaFd(alertName);
     globalAlertBytes = 0;
+    saveState();
     return res;
 }
 
 int BandwidthController::removeGlobalAlertInForwardChain(void) {
     int res = 0;
     const char *alertName = ALERT_GLOBAL_NAME;
+    IptablesRuleSet rules = committedRules;
 
     if (!globalAlertTetherCount) {
         LOGE("No prior alert set");
@@ -811,11 +1522,14 @@ int BandwidthController::removeGlobalAlertInForwardChain(void) {
      * tethers, we are also done.
      */
     if (!globalAlertBytes || globalAlertTetherCount >= 1) {
+        saveState();
         return 0;
     }
 
     /* We only detete the rule if this was the last tether removed. */
-    res = runIptablesAlertFwdCmd(IptOpDelete, alertName, globalAlertBytes);
+    res = applyIptablesAlertFwdCmd(rules, IptOpDelete, alertName, globalAlertBytes);
+    res = res ? res : commitRules(rules);
+    saveState();
     return res;
 }
 
@@ -872,8 +1586,6 @@ int BandwidthController::removeInterfaceAlert(const char *iface) {
 }
 
 int BandwidthController::setCostlyAlert(const char *costName, int64_t bytes, int64_t *alertBytes) {
-    char *alertQuotaCmd;
-    char *chainNameAndPos;
     int res = 0;
     char *alertName;
 
@@ -883,22 +1595,169 @@ int BandwidthController::setCostlyAlert(const char *costName, int64_t bytes, int
     }
     asprintf(&alertName, "%sAlert", costName);
     if (*alertBytes) {
-        res = updateQuota(alertName, *alertBytes);
+        res = updateQuota(alertName, bytes);
     } else {
-        asprintf(&chainNameAndPos, "costly_%s %d", costName, ALERT_RULE_POS_IN_COSTLY_CHAIN);
-        asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, "-I", chainNameAndPos, bytes, alertName,
-                 alertName);
-        res |= runIpxtablesCmd(alertQuotaCmd, IptRejectNoAdd);
-        free(alertQuotaCmd);
-        free(chainNameAndPos);
-    }
-    *alertBytes = bytes;
+        IptablesRuleSet rules = committedRules;
+
+        res |= insertCostlyAlert(rules, costName, alertName, bytes);
+        res = res ? res : commitRules(rules);
+    }
+    if (!res) {
+        *alertBytes = bytes;
+        saveState();
+    }
     free(alertName);
     return res;
 }
 
-int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertBytes) {
+int BandwidthController::insertCostlyAlert(IptablesRuleSet &rules, const char *costName,
+                                           const char *alertName, int64_t bytes) {
     char *alertQuotaCmd;
+    char *chainNameAndPos;
+    int res;
+
+    asprintf(&chainNameAndPos, "costly_%s %d", costName, ALERT_RULE_POS_IN_COSTLY_CHAIN);
+    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, "-I", chainNameAndPos, "", bytes,
+             alertName);
+    res = rules.apply(alertQuotaCmd, false);
+    free(alertQuotaCmd);
+    free(chainNameAndPos);
+    return res;
+}
+
+std::string BandwidthController::makeThresholdName(const char *costName, int pct) {
+    std::string res;
+    char *buff;
+
+    asprintf(&buff, "%sAlert%d", costName, pct);
+    res = buff;
+    free(buff);
+    return res;
+}
+
+void BandwidthController::makeThresholdUpdates(const char *costName, int64_t quota,
+        int64_t usedBytes, const std::list<int> &thresholdPcts,
+        std::list<std::pair<std::string, int64_t> > &updates) {
+    std::list<int>::const_iterator it;
+    int64_t bytes;
+
+    for (it = thresholdPcts.begin(); it != thresholdPcts.end(); it++) {
+        bytes = quota / 100 * *it + quota % 100 * *it / 100 - usedBytes;
+        updates.push_back(std::make_pair(makeThresholdName(costName, *it),
+                                         bytes > 0 ? bytes : 1));
+    }
+}
+
+int BandwidthController::runQuotaUpdates(
+        const std::list<std::pair<std::string, int64_t> > &updates) {
+    std::list<std::pair<std::string, int64_t> >::const_iterator it;
+    int res = 0;
+
+    for (it = updates.begin(); it != updates.end(); it++) {
+        if (updateQuota(it->first.c_str(), it->second)) {
+            LOGE("Failed update quota for %s", it->first.c_str());
+            res = -1;
+        }
+    }
+    return res;
+}
+
+int BandwidthController::setQuotaThresholds(const char *costName, int numPcts, char *pcts[]) {
+    std::list<int> newPcts;
+    std::list<int> *thresholdPcts;
+    std::list<int>::iterator it;
+    std::list<int>::iterator newIt;
+    std::list<std::pair<std::string, int64_t> > adds;
+    std::list<std::pair<std::string, int64_t> >::iterator addIt;
+    std::list<std::string> removedNames;
+    std::list<std::string>::iterator nameIt;
+    std::list<QuotaInfo>::iterator quotaIt;
+    std::string chainName = "costly_";
+    IptablesRuleSet rules = committedRules;
+    int64_t quota;
+    int64_t remaining;
+    int64_t used = 0;
+    int res = 0;
+    int pct;
+
+    if (!strcmp(costName, "shared")) {
+        if (sharedQuotaIfaces.empty()) {
+            LOGE("Need to have a prior shared quota set to set thresholds");
+            return -1;
+        }
+        quota = sharedQuotaBytes;
+        thresholdPcts = &sharedThresholdPcts;
+    } else {
+        for (quotaIt = quotaIfaces.begin(); quotaIt != quotaIfaces.end(); quotaIt++) {
+            if (quotaIt->ifaceName == costName)
+                break;
+        }
+        if (quotaIt == quotaIfaces.end()) {
+            LOGE("Need to have a prior interface quota set to set thresholds");
+            return -1;
+        }
+        quota = quotaIt->quota;
+        thresholdPcts = &quotaIt->thresholdPcts;
+    }
+    chainName += costName;
+
+    for (int pctNum = 0; pctNum < numPcts; pctNum++) {
+        pct = atoi(pcts[pctNum]);
+        if (pct < 1 || pct > 100) {
+            LOGE("Invalid threshold %s. 1..100.", pcts[pctNum]);
+            return -1;
+        }
+        newPcts.push_back(pct);
+    }
+    newPcts.sort();
+    newPcts.unique();
+
+    /* The new thresholds start from what is left of the quota, as the kept ones do. */
+    if (readQuota(costName, &remaining)) {
+        LOGE("Failed to read quota %s, sizing its thresholds from the full quota", costName);
+    } else if (remaining < quota) {
+        used = quota - remaining;
+    }
+
+    /* The thresholds kept as they are keep counting down. */
+    for (it = thresholdPcts->begin(); it != thresholdPcts->end(); it++) {
+        for (newIt = newPcts.begin(); newIt != newPcts.end(); newIt++) {
+            if (*newIt == *it)
+                break;
+        }
+        if (newIt == newPcts.end()) {
+            removedNames.push_back(makeThresholdName(costName, *it));
+            res |= rules.deleteQuotaRule(chainName, removedNames.back());
+        }
+    }
+    for (newIt = newPcts.begin(); newIt != newPcts.end(); newIt++) {
+        for (it = thresholdPcts->begin(); it != thresholdPcts->end(); it++) {
+            if (*newIt == *it)
+                break;
+        }
+        if (it == thresholdPcts->end()) {
+            std::list<int> pctList(1, *newIt);
+            makeThresholdUpdates(costName, quota, used, pctList, adds);
+        }
+    }
+    for (addIt = adds.begin(); addIt != adds.end(); addIt++) {
+        res |= insertCostlyAlert(rules, costName, addIt->first.c_str(), addIt->second);
+    }
+
+    if (res || commitRules(rules)) {
+        LOGE("Failed to set %d thresholds for %s", newPcts.size(), costName);
+        return -1;
+    }
+    for (nameIt = removedNames.begin(); nameIt != removedNames.end(); nameIt++) {
+        closeQuotaFd(nameIt->c_str());
+    }
+    *thresholdPcts = newPcts;
+    saveState();
+    return 0;
+}
+
+int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertBytes) {
+    IptablesRuleSet rules = committedRules;
     char *chainName;
     char *alertName;
     int res = 0;
@@ -906,16 +1765,21 @@ int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertB
     asprintf(&alertName, "%sAlert", costName);
     if (!*alertBytes) {
         LOGE("No prior alert set for %s alert", costName);
+        free(alertName);
         return -1;
     }
 
     asprintf(&chainName, "costly_%s", costName);
-    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, "-D", chainName, *alertBytes, alertName, alertName);
-    res |= runIpxtablesCmd(alertQuotaCmd, IptRejectNoAdd);
-    free(alertQuotaCmd);
+    /* The quota2 counter may have been updated since, match it by name. */
+    res |= rules.deleteQuotaRule(chainName, alertName);
+    res = res ? res : commitRules(rules);
     free(chainName);
 
-    *alertBytes = 0;
+    if (!res) {
+        closeQuotaFd(alertName);
+        *alertBytes = 0;
+        saveState();
+    }
     free(alertName);
     return res;
 }
@@ -964,6 +1828,64 @@ int BandwidthController::parseForwardChainStats(TetherStats &stats, FILE *fp) {
 }
 
 
+int BandwidthController::parseForwardChainStats(TetherStats &stats,
+        const std::list<NetfilterTableReader::RuleCounters> &rules) {
+    std::list<NetfilterTableReader::RuleCounters>::const_iterator it;
+
+    for (it = rules.begin(); it != rules.end(); it++) {
+        if (!it->accept) {
+            continue;
+        }
+        if ((stats.ifaceIn == it->ifaceIn) && (stats.ifaceOut == it->ifaceOut)) {
+            LOGV("iface_in=%s iface_out=%s rx_bytes=%lld rx_packets=%lld ", it->ifaceIn.c_str(),
+                 it->ifaceOut.c_str(), it->bytes, it->packets);
+            stats.rxPackets = it->packets;
+            stats.rxBytes = it->bytes;
+        } else if ((stats.ifaceOut == it->ifaceIn) && (stats.ifaceIn == it->ifaceOut)) {
+            LOGV("iface_in=%s iface_out=%s tx_bytes=%lld tx_packets=%lld ", it->ifaceOut.c_str(),
+                 it->ifaceIn.c_str(), it->bytes, it->packets);
+            stats.txPackets = it->packets;
+            stats.txBytes = it->bytes;
+        }
+    }
+    /* Failure if rx or tx was not found */
+    return (stats.rxBytes == -1 || stats.txBytes == -1) ? -1 : 0;
+}
+
+int BandwidthController::parseForwardChainStats(TetherStats &stats,
+        const std::list<NetfilterTableReader::RuleCounters> &v4Rules,
+        const std::list<NetfilterTableReader::RuleCounters> &v6Rules) {
+    TetherStats v6Stats(stats.ifaceIn, stats.ifaceOut, -1, -1, -1, -1);
+    int res;
+
+    res = parseForwardChainStats(stats, v4Rules);
+    if (parseForwardChainStats(v6Stats, v6Rules)) {
+        return res;
+    }
+    if (res) {
+        stats = v6Stats;
+        return 0;
+    }
+    stats.rxBytes += v6Stats.rxBytes;
+    stats.rxPackets += v6Stats.rxPackets;
+    stats.txBytes += v6Stats.txBytes;
+    stats.txPackets += v6Stats.txPackets;
+    return 0;
+}
+
+int BandwidthController::readForwardChains(
+        std::list<NetfilterTableReader::RuleCounters> &v4Rules,
+        std::list<NetfilterTableReader::RuleCounters> &v6Rules) {
+    if (NetfilterTableReader::readChain(AF_INET, "filter", NF_INET_FORWARD, v4Rules)) {
+        return -1;
+    }
+    /* Without ipv6 forwarding rules the ipv4 counters are all there is. */
+    if (NetfilterTableReader::readChain(AF_INET6, "filter", NF_INET_FORWARD, v6Rules)) {
+        v6Rules.clear();
+    }
+    return 0;
+}
+
 char *BandwidthController::TetherStats::getStatsLine(void) {
     char *msg;
     asprintf(&msg, "%s %s %lld %lld %lld %lld", ifaceIn.c_str(), ifaceOut.c_str(),
@@ -976,13 +1898,21 @@ int BandwidthController::getTetherStats(TetherStats &stats) {
     std::string fullCmd;
     FILE *iptOutput;
     const char *cmd;
+    std::list<NetfilterTableReader::RuleCounters> v4Rules;
+    std::list<NetfilterTableReader::RuleCounters> v6Rules;
 
     if (stats.rxBytes != -1 || stats.txBytes != -1) {
         LOGE("Unexpected input stats. Byte counts should be -1.");
         return -1;
     }
 
+    /* Read the FORWARD counters from the kernel, no iptables run needed. */
+    if (!readForwardChains(v4Rules, v6Rules)) {
+        return parseForwardChainStats(stats, v4Rules, v6Rules);
+    }
+
     /*
+     * The table read failed: fall back to listing the chain.
      * Why not use some kind of lib to talk to iptables?
      * Because the only libs are libiptc and libip6tc in iptables, and they are
      * not easy to use. They require the known iptables match modules to be
@@ -1002,3 +1932,97 @@ int BandwidthController::getTetherStats(TetherStats &stats) {
     /* Currently NatController doesn't do ipv6 tethering, so we are done. */
     return res;
 }
+
+int BandwidthController::getTetherStats(std::list<TetherStats> &statsList) {
+    std::list<NetfilterTableReader::RuleCounters> v4Rules;
+    std::list<NetfilterTableReader::RuleCounters> v6Rules;
+    std::list<NetfilterTableReader::RuleCounters> allRules;
+    std::list<NetfilterTableReader::RuleCounters>::iterator it;
+    std::list<TetherStats>::iterator statsIt;
+
+    /* A single snapshot of the counters for all the pairs. */
+    if (readForwardChains(v4Rules, v6Rules)) {
+        LOGE("Failed to read FORWARD counters");
+        return -1;
+    }
+
+    /*
+     * NatController forwards intIface -> extIface with a plain ACCEPT,
+     * the way back is an ACCEPT with "-m state".
+     */
+    allRules = v4Rules;
+    allRules.insert(allRules.end(), v6Rules.begin(), v6Rules.end());
+    for (it = allRules.begin(); it != allRules.end(); it++) {
+        if (!it->accept || it->hasMatches || it->ifaceIn.empty() || it->ifaceOut.empty()) {
+            continue;
+        }
+        for (statsIt = statsList.begin(); statsIt != statsList.end(); statsIt++) {
+            if (statsIt->ifaceIn == it->ifaceIn && statsIt->ifaceOut == it->ifaceOut)
+                break;
+        }
+        if (statsIt != statsList.end()) {
+            continue;
+        }
+
+        TetherStats stats(it->ifaceIn, it->ifaceOut, -1, -1, -1, -1);
+        if (!parseForwardChainStats(stats, v4Rules, v6Rules)) {
+            statsList.push_back(stats);
+        }
+    }
+    return 0;
+}
+
+char *BandwidthController::UidStats::getStatsLine(void) {
+    char *msg;
+    asprintf(&msg, "%d %s %lld %lld %lld %lld", uid, iface.c_str(),
+            rxBytes, rxPackets, txBytes, txPackets);
+    return msg;
+}
+
+/*
+ * Parse the uid totals out of:
+ * idx iface acct_tag_hex uid_tag_int cnt_set rx_bytes rx_packets tx_bytes tx_packets ...
+ * 2 wlan0 0x0 10022 0 7264 58 5108 62 ...
+ * 3 wlan0 0x0 10022 1 153060 136 11764 121 ...
+ * 4 wlan0 0x3e800000000 10022 0 1428 12 1024 10 ...
+ * The 0x0 tag lines hold the uid's totals, one per counter set.
+ */
+int BandwidthController::getUidStats(int uid, std::list<UidStats> &statsList) {
+    std::map<std::pair<int, std::string>, UidStats> uidStats;
+    std::map<std::pair<int, std::string>, UidStats>::iterator it;
+    char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
+    char iface[MAX_IFACENAME_LEN];
+    unsigned long long tag;
+    int64_t rxBytes, rxPackets, txBytes, txPackets;
+    int idx, lineUid, cntSet;
+    FILE *fp;
+    int res;
+
+    fp = fopen(QTAGUID_STATS_PATH, "r");
+    if (!fp) {
+        LOGE("Reading %s failed (%s)", QTAGUID_STATS_PATH, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(lineBuffer, sizeof(lineBuffer), fp)) {
+        res = sscanf(lineBuffer, "%d %63s 0x%llx %d %d %lld %lld %lld %lld", &idx, iface,
+                     &tag, &lineUid, &cntSet, &rxBytes, &rxPackets, &txBytes, &txPackets);
+        if (res != 9 || tag || (uid != -1 && lineUid != uid)) {
+            continue;
+        }
+
+        UidStats &stats = uidStats[std::make_pair(lineUid, std::string(iface))];
+        stats.uid = lineUid;
+        stats.iface = iface;
+        stats.rxBytes += rxBytes;
+        stats.rxPackets += rxPackets;
+        stats.txBytes += txBytes;
+        stats.txPackets += txPackets;
+    }
+    fclose(fp);
+
+    for (it = uidStats.begin(); it != uidStats.end(); it++) {
+        statsList.push_back(it->second);
+    }
+    return 0;
+}
@@ -17,9 +17,15 @@
 #define _BANDWIDTH_CONTROLLER_H
 
 #include <list>
+#include <map>
 #include <string>
 #include <utility>  // for pair
 
+#include "IptablesRuleSet.h"
+#include "NetfilterTableReader.h"
+
+class SocketClient;
+
 class BandwidthController {
 public:
     class TetherStats {
@@ -45,6 +51,34 @@ public:
         char *getStatsLine(void);
     };
 
+    class UidStats {
+    public:
+        UidStats(void)
+                : uid(-1), rxBytes(0), rxPackets(0),
+                    txBytes(0), txPackets(0) {};
+        int uid;
+        std::string iface;
+        int64_t rxBytes, rxPackets;
+        int64_t txBytes, txPackets;
+        /*
+         * Allocates a new string representing this:
+         * uid iface rx_bytes rx_packets tx_bytes tx_packets
+         * The caller is responsible for free()'ing the returned ptr.
+         */
+        char *getStatsLine(void);
+    };
+
+    class QuotaSpec {
+    public:
+        QuotaSpec(std::string ifn, bool s, int64_t q, int64_t a)
+                : ifaceName(ifn), shared(s), quota(q), alert(a) {};
+        std::string ifaceName;
+        /* Joins the shared quota, quota and alert are then ignored. */
+        bool shared;
+        int64_t quota;
+        int64_t alert;  /* 0 for none */
+    };
+
     BandwidthController();
     int enableBandwidthControl(void);
     int disableBandwidthControl(void);
@@ -57,9 +91,36 @@ public:
     int getInterfaceQuota(const char *iface, int64_t *bytes);
     int removeInterfaceQuota(const char *iface);
 
+    /*
+     * Sets the shared quota and alert (0 leaves them as they are) and the
+     * quota of every iface in specs in one commit, then writes the quota
+     * values of the already existing counters. Ifaces not in specs are kept.
+     */
+    int setQuotas(int64_t sharedBytes, int64_t sharedAlert, const std::list<QuotaSpec> &specs);
+
+    /*
+     * Appends the remaining bytes of every quota and alert currently set:
+     * "shared", "<iface>", "globalAlert", "sharedAlert", "<iface>Alert",
+     * and the "<costName>Alert<pct>" thresholds.
+     */
+    int getQuotas(std::list<std::pair<std::string, int64_t> > &quotas);
+
     int addNaughtyApps(int numUids, char *appUids[]);
     int removeNaughtyApps(int numUids, char *appUids[]);
 
+    /*
+     * Bulk penalty box updates, for more uids than fit in one command:
+     * the staged adds and removes are applied in order by a single
+     * commitNaughtyApps(), which either applies all of them or none.
+     * Each client stages its own changes, up to MAX_STAGED_NAUGHTY_APP_CHANGES,
+     * and dropNaughtyApps() discards them when it disconnects.
+     */
+    int stageAddNaughtyApps(SocketClient *client, int numUids, char *appUids[]);
+    int stageRemoveNaughtyApps(SocketClient *client, int numUids, char *appUids[]);
+    int commitNaughtyApps(SocketClient *client);
+    int abortNaughtyApps(SocketClient *client);
+    void dropNaughtyApps(SocketClient *client);
+
     int setGlobalAlert(int64_t bytes);
     int removeGlobalAlert(void);
     int setGlobalAlertInForwardChain(void);
@@ -71,11 +132,32 @@ public:
     int setInterfaceAlert(const char *iface, int64_t bytes);
     int removeInterfaceAlert(const char *iface);
 
+    /*
+     * Replaces the alert thresholds of the "shared" or an iface quota with
+     * the given percentages of it, each with its own quota2 counter named
+     * "<costName>Alert<pct>", e.g. "wlan0Alert80", so each one triggers its
+     * own "limit alert". No percentages removes them all.
+     */
+    int setQuotaThresholds(const char *costName, int numPcts, char *pcts[]);
+
     /*
      * stats should have ifaceIn and ifaceOut initialized.
      * Byte counts should be left to the default (-1).
      */
     int getTetherStats(TetherStats &stats);
+    /*
+     * Appends the stats of every forwarded interface pair, ipv4 and ipv6
+     * counters combined, all from the same snapshot of the FORWARD chains.
+     */
+    static int getTetherStats(std::list<TetherStats> &statsList);
+
+    /*
+     * Appends the per uid and iface totals the --socket-exists tracking
+     * rules feed into xt_qtaguid, read from the tag 0x0 lines that hold
+     * each uid's totals, with the counter sets summed.
+     * uid -1 returns all uids.
+     */
+    int getUidStats(int uid, std::list<UidStats> &statsList);
 
 protected:
     class QuotaInfo {
@@ -85,6 +167,7 @@ protected:
         std::string ifaceName;
         int64_t quota;
         int64_t alert;
+        std::list<int> thresholdPcts;  /* Sorted */
     };
 
     enum IptIpVer { IptIpV4, IptIpV6 };
@@ -94,29 +177,106 @@ protected:
     enum QuotaType { QuotaUnique, QuotaShared };
     enum RunCmdErrHandling { RunCmdFailureBad, RunCmdFailureOk };
 
+    class NaughtyAppChange {
+    public:
+        NaughtyAppChange(int uid, NaughtyAppOp op) : appUid(uid), appOp(op) {};
+        int appUid;
+        NaughtyAppOp appOp;
+    };
+
     int maninpulateNaughtyApps(int numUids, char *appStrUids[], NaughtyAppOp appOp);
+    int stageNaughtyApps(SocketClient *client, int numUids, char *appStrUids[],
+                         NaughtyAppOp appOp);
+    static int parseNaughtyApps(int numUids, char *appStrUids[], NaughtyAppOp appOp,
+                                std::list<NaughtyAppChange> &changes);
+    int commitNaughtyAppChanges(const std::list<NaughtyAppChange> &changes);
 
-    int prepCostlyIface(const char *ifn, QuotaType quotaType);
-    int cleanupCostlyIface(const char *ifn, QuotaType quotaType);
+    int prepCostlyIface(IptablesRuleSet &rules, const char *ifn, QuotaType quotaType);
+    int cleanupCostlyIface(IptablesRuleSet &rules, const char *ifn, QuotaType quotaType);
 
-    std::string makeIptablesNaughtyCmd(IptOp op, int uid);
+    /* Rebuilds the penalty_box UID tree for the given apps. */
+    static int makePenaltyBox(IptablesRuleSet &rules, const std::list<int> &appUids);
     std::string makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota);
 
-    int runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes);
-    int runIptablesAlertFwdCmd(IptOp op, const char *alertName, int64_t bytes);
+    int applyIptablesAlertCmd(IptablesRuleSet &rules, IptOp op, const char *alertName,
+                              int64_t bytes);
+    int applyIptablesAlertFwdCmd(IptablesRuleSet &rules, IptOp op, const char *alertName,
+                                 int64_t bytes);
 
     /* Runs for both ipv4 and ipv6 iptables */
     int runCommands(int numCommands, const char *commands[], RunCmdErrHandling cmdErrHandling);
+    /*
+     * Diffs rules against committedRules and runs only the changes, for both
+     * ipv4 and ipv6. With iptables-restore they are one transaction per IP
+     * version: on failure nothing changed and committedRules is kept.
+     */
+    int commitRules(const IptablesRuleSet &rules);
+    /*
+     * Runs the reset commands (allowed to fail) then the rule changes, in one
+     * iptables-restore transaction per IP version when available.
+     */
+    int runRuleChanges(int numResetCommands, const char *resetCommands[],
+                       const std::list<IptablesRuleSet::Rule> &changes);
+    static int applyCommands(IptablesRuleSet &rules, int numCommands, const char *commands[]);
+    static bool useBatchCommands(void);
+    static void appendCommands(std::list<std::string> &commandList, int numCommands,
+                               const char *commands[]);
     /* Runs for both ipv4 and ipv6 iptables, appends -j REJECT --reject-with ...  */
-    static int runIpxtablesCmd(const char *cmd, IptRejectOp rejectHandling);
-    static int runIptablesCmd(const char *cmd, IptRejectOp rejectHandling, IptIpVer iptIpVer);
+    static std::string makeIptablesCmd(const char *cmd, IptRejectOp rejectHandling,
+                                       IptIpVer iptIpVer);
+    /* A RunCmdFailureOk command skips the iptables-restore worker, see IptFailureOk. */
+    static int runIpxtablesCmd(const char *cmd, IptRejectOp rejectHandling,
+                               RunCmdErrHandling cmdErrHandling = RunCmdFailureBad);
+    static int runIptablesCmd(const char *cmd, IptRejectOp rejectHandling, IptIpVer iptIpVer,
+                              RunCmdErrHandling cmdErrHandling = RunCmdFailureBad);
 
     // Provides strncpy() + check overflow.
     static int StrncpyAndCheck(char *buffer, const char *src, size_t buffSize);
 
     int updateQuota(const char *alertName, int64_t bytes);
+    void getQuotaNames(std::list<std::string> &quotaNames);
+
+    /*
+     * The quotas, alerts, naughty apps and committedRules are saved to
+     * STATE_PATH after every change. After a netd restart, restoreState()
+     * adopts them instead of resetting the tables and their counters, if
+     * the kernel tables still match them: same boot, same rule count in
+     * each chain and all the quota2 counters still there.
+     */
+    int saveState(void);
+    int restoreState(void);
+    static int readBootId(std::string &bootId);
+    static int verifyLiveRules(const IptablesRuleSet &rules);
+    /*
+     * Compares each chain of rules with what one IP version's table holds:
+     * its rule count, and for the chains we fill, its quota2 names in order.
+     */
+    static int compareLiveRules(const IptablesRuleSet &rules,
+                                const std::map<std::string, int> &liveCounts,
+                                const std::map<std::string, std::list<std::string> > &liveQuotaNames);
+
+    /*
+     * The /proc/net/xt_quota/<name> files are kept open and read with pread().
+     * Their fds must be closed when the quota2 rule goes away.
+     */
+    int readQuota(const char *quotaName, int64_t *bytes);
+    int getQuotaFd(const char *quotaName);
+    void closeQuotaFd(const char *quotaName);
+    void closeQuotaFds(void);
 
     int setCostlyAlert(const char *costName, int64_t bytes, int64_t *alertBytes);
+    static int insertCostlyAlert(IptablesRuleSet &rules, const char *costName,
+                                 const char *alertName, int64_t bytes);
+
+    static std::string makeThresholdName(const char *costName, int pct);
+    /*
+     * Appends the counter values that start the thresholds of a quota
+     * of which usedBytes are already used, 0 for a restarted quota.
+     */
+    static void makeThresholdUpdates(const char *costName, int64_t quota, int64_t usedBytes,
+                                     const std::list<int> &thresholdPcts,
+                                     std::list<std::pair<std::string, int64_t> > &updates);
+    int runQuotaUpdates(const std::list<std::pair<std::string, int64_t> > &updates);
     int removeCostlyAlert(const char *costName, int64_t *alertBytes);
 
     /*
@@ -124,12 +284,22 @@ protected:
      * fp should be a file to the FORWARD rules of iptables.
      */
     static int parseForwardChainStats(TetherStats &stats, FILE *fp);
+    /* Same, from the FORWARD rule counters read from the kernel. */
+    static int parseForwardChainStats(TetherStats &stats,
+            const std::list<NetfilterTableReader::RuleCounters> &rules);
+    /* Sums the ipv4 and ipv6 counters, if either has the pair. */
+    static int parseForwardChainStats(TetherStats &stats,
+            const std::list<NetfilterTableReader::RuleCounters> &v4Rules,
+            const std::list<NetfilterTableReader::RuleCounters> &v6Rules);
+    static int readForwardChains(std::list<NetfilterTableReader::RuleCounters> &v4Rules,
+                                 std::list<NetfilterTableReader::RuleCounters> &v6Rules);
 
     /*------------------*/
 
     std::list<std::string> sharedQuotaIfaces;
     int64_t sharedQuotaBytes;
     int64_t sharedAlertBytes;
+    std::list<int> sharedThresholdPcts;  /* Sorted */
     int64_t globalAlertBytes;
     /*
      * This tracks the number of tethers setup.
@@ -143,6 +313,12 @@ protected:
 
     std::list<QuotaInfo> quotaIfaces;
     std::list<int /*appUid*/> naughtyAppUids;
+    std::map<SocketClient *, std::list<NaughtyAppChange> > stagedNaughtyAppChanges;
+
+    /* What the kernel holds of the chains we own, as of the last commit. */
+    IptablesRuleSet committedRules;
+
+    std::map<std::string, int /*fd*/> quotaFds;
 
 private:
     static const char *IPT_CLEANUP_COMMANDS[];
@@ -153,12 +329,18 @@ private:
     static const char ALERT_IPT_TEMPLATE[];
     static const int  ALERT_RULE_POS_IN_COSTLY_CHAIN;
     static const char ALERT_GLOBAL_NAME[];
+    static const char BOOT_ID_PATH[];
     static const char IP6TABLES_PATH[];
     static const char IPTABLES_PATH[];
     static const int  MAX_CMD_ARGS;
     static const int  MAX_CMD_LEN;
     static const int  MAX_IFACENAME_LEN;
     static const int  MAX_IPT_OUTPUT_LINE_LEN;
+    static const unsigned int MAX_STAGED_NAUGHTY_APP_CHANGES;
+    /* Created here, its rules are owned by OEMListener. */
+    static const char OEM_CHAIN[];
+    static const char QTAGUID_STATS_PATH[];
+    static const char STATE_PATH[];
 
     /*
      * When false, it will directly use system() instead of logwrap()
@@ -46,6 +46,7 @@ PppController *CommandListener::sPppCtrl = NULL;
 PanController *CommandListener::sPanCtrl = NULL;
 SoftapController *CommandListener::sSoftapCtrl = NULL;
 BandwidthController * CommandListener::sBandwidthCtrl = NULL;
+CounterSampler *CommandListener::sCounterSampler = NULL;
 ResolverController *CommandListener::sResolverCtrl = NULL;
 SecondaryTableController *CommandListener::sSecondaryTableCtrl = NULL;
 
@@ -76,10 +77,21 @@ CommandListener::CommandListener() :
         sSoftapCtrl = new SoftapController();
     if (!sBandwidthCtrl)
         sBandwidthCtrl = new BandwidthController();
+    if (!sCounterSampler)
+        sCounterSampler = new CounterSampler();
     if (!sResolverCtrl)
         sResolverCtrl = new ResolverController();
 }
 
+bool CommandListener::onDataAvailable(SocketClient *c) {
+    if (FrameworkListener::onDataAvailable(c)) {
+        return true;
+    }
+    /* The client is going away, a later one may get the same SocketClient. */
+    sBandwidthCtrl->dropNaughtyApps(c);
+    return false;
+}
+
 CommandListener::InterfaceCmd::InterfaceCmd() :
                  NetdCommand("interface") {
 }
@@ -956,6 +968,29 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
         free(msg);
         return 0;
 
+    }
+    if (!strcmp(argv[1], "getquotas") || !strcmp(argv[1], "gqs")) {
+        std::list<std::pair<std::string, int64_t> > quotas;
+        std::list<std::pair<std::string, int64_t> >::iterator it;
+        if (argc != 2) {
+            sendGenericSyntaxError(cli, "getquotas");
+            return 0;
+        }
+        int rc = sBandwidthCtrl->getQuotas(quotas);
+        if (rc) {
+            sendGenericOpFailed(cli, "Failed to get quotas");
+            return 0;
+        }
+
+        for (it = quotas.begin(); it != quotas.end(); it++) {
+            char *msg;
+            asprintf(&msg, "%s %lld", it->first.c_str(), it->second);
+            cli->sendMsg(ResponseCode::QuotaCounterListResult, msg, false);
+            free(msg);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "Quota list completed", false);
+        return 0;
+
     }
     if (!strcmp(argv[1], "getiquota") || !strcmp(argv[1], "giq")) {
         int64_t bytes;
@@ -1006,6 +1041,33 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
         sendGenericOkFail(cli, rc);
         return 0;
 
+    }
+    if (!strcmp(argv[1], "provisionquotas") || !strcmp(argv[1], "pqs")) {
+        std::list<BandwidthController::QuotaSpec> specs;
+        if (argc < 4 || (argc - 4) % 3) {
+            sendGenericSyntaxError(cli, "provisionquotas <sharedBytes> <sharedAlertBytes>"
+                                   " [<interface> <bytes>|shared <alertBytes>] ...");
+            return 0;
+        }
+
+        for (int q = 4; q < argc; q += 3) {
+            bool shared = !strcmp(argv[q + 1], "shared");
+            // the shared interfaces only have the one <sharedAlertBytes>
+            if (shared && atoll(argv[q + 2])) {
+                char *msg;
+                asprintf(&msg, "Shared interface %s takes no alert, use <sharedAlertBytes>",
+                         argv[q]);
+                cli->sendMsg(ResponseCode::CommandParameterError, msg, false);
+                free(msg);
+                return 0;
+            }
+            specs.push_back(BandwidthController::QuotaSpec(argv[q], shared,
+                    shared ? 0 : atoll(argv[q + 1]), atoll(argv[q + 2])));
+        }
+        int rc = sBandwidthCtrl->setQuotas(atoll(argv[2]), atoll(argv[3]), specs);
+        sendGenericOkFail(cli, rc);
+        return 0;
+
     }
     if (!strcmp(argv[1], "removequotas") || !strcmp(argv[1], "rqs")) {
         int rc;
@@ -1069,6 +1131,44 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
         sendGenericOkFail(cli, rc);
         return 0;
 
+    }
+    if (!strcmp(argv[1], "stagenaughtyapps") || !strcmp(argv[1], "sna")) {
+        int rc;
+        if (argc < 4) {
+            sendGenericSyntaxError(cli, "stagenaughtyapps <add|remove> <appUid> ...");
+            return 0;
+        }
+        if (!strcmp(argv[2], "add")) {
+            rc = sBandwidthCtrl->stageAddNaughtyApps(cli, argc - 3, argv + 3);
+        } else if (!strcmp(argv[2], "remove")) {
+            rc = sBandwidthCtrl->stageRemoveNaughtyApps(cli, argc - 3, argv + 3);
+        } else {
+            sendGenericSyntaxError(cli, "stagenaughtyapps <add|remove> <appUid> ...");
+            return 0;
+        }
+        sendGenericOkFail(cli, rc);
+        return 0;
+
+    }
+    if (!strcmp(argv[1], "commitnaughtyapps") || !strcmp(argv[1], "cna")) {
+        if (argc != 2) {
+            sendGenericSyntaxError(cli, "commitnaughtyapps");
+            return 0;
+        }
+        int rc = sBandwidthCtrl->commitNaughtyApps(cli);
+        sendGenericOkFail(cli, rc);
+        return 0;
+
+    }
+    if (!strcmp(argv[1], "abortnaughtyapps") || !strcmp(argv[1], "abna")) {
+        if (argc != 2) {
+            sendGenericSyntaxError(cli, "abortnaughtyapps");
+            return 0;
+        }
+        int rc = sBandwidthCtrl->abortNaughtyApps(cli);
+        sendGenericOkFail(cli, rc);
+        return 0;
+
     }
     if (!strcmp(argv[1], "setglobalalert") || !strcmp(argv[1], "sga")) {
         if (argc != 3) {
@@ -1141,6 +1241,16 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
         sendGenericOkFail(cli, rc);
         return 0;
 
+    }
+    if (!strcmp(argv[1], "setquotathresholds") || !strcmp(argv[1], "sqt")) {
+        if (argc < 3) {
+            sendGenericSyntaxError(cli, "setquotathresholds <shared|interface> [<percent> ...]");
+            return 0;
+        }
+        int rc = sBandwidthCtrl->setQuotaThresholds(argv[2], argc - 3, argv + 3);
+        sendGenericOkFail(cli, rc);
+        return 0;
+
     }
     if (!strcmp(argv[1], "removeinterfacealert") || !strcmp(argv[1], "ria")) {
         if (argc != 3) {
@@ -1154,8 +1264,25 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
     }
     if (!strcmp(argv[1], "gettetherstats") || !strcmp(argv[1], "gts")) {
         BandwidthController::TetherStats tetherStats;
+        if (argc == 2) {
+            std::list<BandwidthController::TetherStats> statsList;
+            std::list<BandwidthController::TetherStats>::iterator it;
+
+            int rc = sBandwidthCtrl->getTetherStats(statsList);
+            if (rc) {
+                sendGenericOpFailed(cli, "Failed to get tethering stats");
+                return 0;
+            }
+            for (it = statsList.begin(); it != statsList.end(); it++) {
+                char *msg = it->getStatsLine();
+                cli->sendMsg(ResponseCode::TetheringStatsListResult, msg, false);
+                free(msg);
+            }
+            cli->sendMsg(ResponseCode::CommandOkay, "Tethering stats list completed", false);
+            return 0;
+        }
         if (argc != 4) {
-            sendGenericSyntaxError(cli, "gettetherstats <interface0> <interface1>");
+            sendGenericSyntaxError(cli, "gettetherstats [<interface0> <interface1>]");
             return 0;
         }
 
@@ -1172,6 +1299,68 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
         free(msg);
         return 0;
 
+    }
+    if (!strcmp(argv[1], "uidstats") || !strcmp(argv[1], "us")) {
+        std::list<BandwidthController::UidStats> statsList;
+        std::list<BandwidthController::UidStats>::iterator it;
+        int uid = -1;
+        if (argc > 3) {
+            sendGenericSyntaxError(cli, "uidstats [<appUid>]");
+            return 0;
+        }
+        if (argc == 3) {
+            uid = atoi(argv[2]);
+        }
+
+        int rc = sBandwidthCtrl->getUidStats(uid, statsList);
+        if (rc) {
+            sendGenericOpFailed(cli, "Failed to get uid stats");
+            return 0;
+        }
+        for (it = statsList.begin(); it != statsList.end(); it++) {
+            char *msg = it->getStatsLine();
+            cli->sendMsg(ResponseCode::UidStatsListResult, msg, false);
+            free(msg);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "Uid stats list completed", false);
+        return 0;
+
+    }
+    if (!strcmp(argv[1], "setsamplerinterval") || !strcmp(argv[1], "ssi")) {
+        if (argc != 3) {
+            sendGenericSyntaxError(cli, "setsamplerinterval <intervalMs>");
+            return 0;
+        }
+        int rc = sCounterSampler->setInterval(atoi(argv[2]));
+        sendGenericOkFail(cli, rc);
+        return 0;
+
+    }
+    if (!strcmp(argv[1], "history") || !strcmp(argv[1], "hi")) {
+        std::list<CounterSampler::Sample> samples;
+        std::list<CounterSampler::Sample>::iterator it;
+        int64_t sinceMs = 0;
+        if (argc < 3 || argc > 4) {
+            sendGenericSyntaxError(cli, "history <series> [<sinceMs>]");
+            return 0;
+        }
+        if (argc == 4) {
+            sinceMs = atoll(argv[3]);
+        }
+
+        int rc = sCounterSampler->getHistory(argv[2], sinceMs, samples);
+        if (rc) {
+            sendGenericOpFailed(cli, "No history for series");
+            return 0;
+        }
+        for (it = samples.begin(); it != samples.end(); it++) {
+            char *msg = it->getSampleLine();
+            cli->sendMsg(ResponseCode::CounterHistoryListResult, msg, false);
+            free(msg);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "Counter history list completed", false);
+        return 0;
+
     }
 
     cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown bandwidth cmd", false);
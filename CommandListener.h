@@ -26,6 +26,7 @@
 #include "PanController.h"
 #include "SoftapController.h"
 #include "BandwidthController.h"
+#include "CounterSampler.h"
 #include "ResolverController.h"
 #include "SecondaryTableController.h"
 
@@ -36,6 +37,7 @@ class CommandListener : public FrameworkListener {
     static PanController *sPanCtrl;
     static SoftapController *sSoftapCtrl;
     static BandwidthController *sBandwidthCtrl;
+    static CounterSampler *sCounterSampler;
     static ResolverController *sResolverCtrl;
     static SecondaryTableController *sSecondaryTableCtrl;
 
@@ -43,6 +45,10 @@ public:
     CommandListener();
     virtual ~CommandListener() {}
 
+protected:
+    /* Drops the naughty app changes a disconnecting client left staged. */
+    virtual bool onDataAvailable(SocketClient *c);
+
 private:
 
     static int writeFile(const char *path, const char *value, int size);
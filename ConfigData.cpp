@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_TAG "ConfigData"
+#include <cutils/log.h>
+
+#include "ConfigData.h"
+
+const unsigned char ConfigData::INVALID = 0xff;
+
+void ConfigData::makeDecodeTable(unsigned char *table) {
+    static const char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+
+    memset(table, INVALID, 256);
+    for (i = 0; i < 64; i++) {
+        table[(unsigned char) alphabet[i]] = i;
+    }
+}
+
+void ConfigData::decode(const char *in, size_t len, std::string &out) {
+    unsigned char table[256];
+    unsigned int quad = 0;
+    int numSextets = 0;
+    size_t pos = 0;
+    size_t i;
+
+    makeDecodeTable(table);
+
+    /* Every 4 sextets give 3 bytes, and a last 2 or 3 give 1 or 2. */
+    out.resize(len / 4 * 3 + 2);
+    for (i = 0; i < len; i++) {
+        unsigned char sextet = table[(unsigned char) in[i]];
+        if (sextet == INVALID)
+            continue;
+        quad = (quad << 6) | sextet;
+        if (++numSextets == 4) {
+            out[pos++] = (char) (quad >> 16);
+            out[pos++] = (char) (quad >> 8);
+            out[pos++] = (char) quad;
+            quad = 0;
+            numSextets = 0;
+        }
+    }
+    if (numSextets > 1) {
+        quad <<= 6 * (4 - numSextets);
+        out[pos++] = (char) (quad >> 16);
+        if (numSextets == 3)
+            out[pos++] = (char) (quad >> 8);
+    }
+    out.resize(pos);
+}
+
+int ConfigData::read(const char *path, ConfigData &config) {
+    std::string decoded;
+    std::string *fields[] = { &config.serial, &config.brand, &config.model };
+    const char *base;
+    struct stat sb;
+    size_t start = 0;
+    size_t comma;
+    int numFields = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &sb)) {
+        LOGE("Failed to stat %s (%s)", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (sb.st_size > 0) {
+        base = (const char *) mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            LOGE("Failed to map %s (%s)", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        decode(base, sb.st_size, decoded);
+        munmap((void *) base, sb.st_size);
+    }
+    close(fd);
+
+    /* Empty fields are skipped, like strtok() used to. */
+    while (numFields < 3 && start < decoded.size()) {
+        comma = decoded.find(',', start);
+        if (comma == std::string::npos)
+            comma = decoded.size();
+        if (comma > start)
+            fields[numFields++]->assign(decoded, start, comma - start);
+        start = comma + 1;
+    }
+    if (numFields < 3) {
+        LOGE("Only %d fields in %s", numFields, path);
+    }
+    return 0;
+}
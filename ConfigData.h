@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CONFIG_DATA_H
+#define _CONFIG_DATA_H
+
+#include <stddef.h>
+
+#include <string>
+
+/*
+ * The device identity in /system/etc/configdata: "serial,brand,model"
+ * base64 encoded. Characters outside of the base64 alphabet, padding
+ * included, are skipped.
+ */
+class ConfigData {
+public:
+    std::string serial;
+    std::string brand;
+    std::string model;
+
+    /*
+     * Maps path and decodes it. Missing fields are left empty.
+     * Returns -1 if path cannot be read, 0 otherwise.
+     */
+    static int read(const char *path, ConfigData &config);
+
+    /* Decodes len chars of in into out, replacing its content. */
+    static void decode(const char *in, size_t len, std::string &out);
+
+private:
+    static const unsigned char INVALID;
+    static void makeDecodeTable(unsigned char *table);
+};
+
+#endif
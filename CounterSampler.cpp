@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// #define LOG_NDEBUG 0
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "CounterSampler"
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "BandwidthController.h"
+#include "CounterSampler.h"
+
+const size_t CounterSampler::HISTORY_DEPTH = 120;
+const char CounterSampler::INTERVAL_PROPERTY[] = "persist.netd.sampler.interval";
+
+pthread_mutex_t CounterSampler::sQuotasLock = PTHREAD_MUTEX_INITIALIZER;
+bool CounterSampler::sQuotasChanged = false;
+
+CounterSampler::CounterSampler() :
+                mThreadRunning(false), mIntervalMs(0), mQuotasScanned(false) {
+    char value[PROPERTY_VALUE_MAX];
+
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mCond, NULL);
+
+    property_get(INTERVAL_PROPERTY, value, "0");
+    setInterval(atoi(value));
+}
+
+char *CounterSampler::Sample::getSampleLine(void) {
+    std::string line;
+    char *msg;
+
+    asprintf(&msg, "%lld", timeMs);
+    line = msg;
+    free(msg);
+    for (int valNum = 0; valNum < numValues; valNum++) {
+        asprintf(&msg, " %lld", values[valNum]);
+        line += msg;
+        free(msg);
+    }
+    return strdup(line.c_str());
+}
+
+int64_t CounterSampler::getTimeMs(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int CounterSampler::setInterval(int intervalMs) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    int res = 0;
+
+    if (intervalMs < 0) {
+        LOGE("Invalid sampling interval %d", intervalMs);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mLock);
+    mIntervalMs = intervalMs;
+    if (mIntervalMs && !mThreadRunning) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, CounterSampler::threadStart, this)) {
+            LOGE("pthread_create failed (%s)", strerror(errno));
+            mIntervalMs = 0;
+            res = -1;
+        } else {
+            mThreadRunning = true;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    /* Wake the sampler so the new interval applies right away. */
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mLock);
+    return res;
+}
+
+void *CounterSampler::threadStart(void *obj) {
+    CounterSampler *sampler = reinterpret_cast<CounterSampler *>(obj);
+
+    sampler->run();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void CounterSampler::run(void) {
+    struct timeval now;
+    struct timespec deadline;
+    int64_t deadlineUs;
+
+    pthread_mutex_lock(&mLock);
+    while (mIntervalMs) {
+        pthread_mutex_unlock(&mLock);
+        sampleAll();
+        pthread_mutex_lock(&mLock);
+        if (!mIntervalMs) {
+            break;
+        }
+
+        gettimeofday(&now, NULL);
+        deadlineUs = (int64_t) now.tv_sec * 1000000 + now.tv_usec + (int64_t) mIntervalMs * 1000;
+        deadline.tv_sec = deadlineUs / 1000000;
+        deadline.tv_nsec = (deadlineUs % 1000000) * 1000;
+        pthread_cond_timedwait(&mCond, &mLock, &deadline);
+    }
+    mThreadRunning = false;
+    pthread_mutex_unlock(&mLock);
+}
+
+void CounterSampler::sampleAll(void) {
+    int64_t nowMs = getTimeMs();
+    std::set<std::string> seen;
+
+    if (sampleInterfaces(nowMs, seen)) {
+        evictSeries("iface:", seen);
+    }
+    if (sampleQuotas(nowMs, seen)) {
+        evictSeries("quota:", seen);
+    }
+    if (sampleTethers(nowMs, seen)) {
+        evictSeries("tether:", seen);
+    }
+}
+
+void CounterSampler::notifyQuotasChanged(void) {
+    pthread_mutex_lock(&sQuotasLock);
+    sQuotasChanged = true;
+    pthread_mutex_unlock(&sQuotasLock);
+}
+
+/*
+ * Parse the counters out of /proc/net/dev:
+ * Inter-|   Receive                            ...|  Transmit
+ *  face |bytes    packets errs drop fifo frame ...|bytes    packets errs ...
+ *  wlan0: 9870153   12345    0    0    0     0 ... 1234567    9876    0 ...
+ */
+bool CounterSampler::sampleInterfaces(int64_t nowMs, std::set<std::string> &seen) {
+    char buffer[512];
+    char name[32];
+    char *colon;
+    long long d;
+    Sample sample;
+    FILE *fp;
+
+    fp = fopen("/proc/net/dev", "r");
+    if (!fp) {
+        LOGE("Failed to open /proc/net/dev (%s)", strerror(errno));
+        return false;
+    }
+
+    fgets(buffer, sizeof(buffer), fp); // Header 1
+    fgets(buffer, sizeof(buffer), fp); // Header 2
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        // big rx counts run into the name ("name:1000"), split them apart
+        colon = strchr(buffer, ':');
+        if (!colon) {
+            continue;
+        }
+        *colon = ' ';
+
+        sample.timeMs = nowMs;
+        sample.numValues = 4;
+        if (sscanf(buffer, "%31s %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld", name,
+                   &sample.values[0], &sample.values[1], &d, &d, &d, &d, &d, &d,
+                   &sample.values[2], &sample.values[3]) != 11) {
+            continue;
+        }
+        seen.insert(std::string("iface:") + name);
+        record(std::string("iface:") + name, sample);
+    }
+    fclose(fp);
+    return true;
+}
+
+void CounterSampler::closeQuotaFds(void) {
+    std::map<std::string, int>::iterator it;
+
+    for (it = mQuotaFds.begin(); it != mQuotaFds.end(); it++) {
+        close(it->second);
+    }
+    mQuotaFds.clear();
+}
+
+void CounterSampler::scanQuotas(void) {
+    struct dirent *de;
+    char *fname;
+    DIR *d;
+    int fd;
+
+    closeQuotaFds();
+    mQuotasScanned = true;
+    d = opendir("/proc/net/xt_quota");
+    if (!d) {
+        /* No quota2 rule is set. */
+        return;
+    }
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        asprintf(&fname, "/proc/net/xt_quota/%s", de->d_name);
+        fd = open(fname, O_RDONLY);
+        free(fname);
+        if (fd >= 0) {
+            mQuotaFds[de->d_name] = fd;
+        }
+    }
+    closedir(d);
+}
+
+bool CounterSampler::sampleQuotas(int64_t nowMs, std::set<std::string> &seen) {
+    std::map<std::string, int>::iterator it;
+    char buff[32];
+    ssize_t len;
+    Sample sample;
+    bool changed;
+
+    pthread_mutex_lock(&sQuotasLock);
+    changed = sQuotasChanged;
+    sQuotasChanged = false;
+    pthread_mutex_unlock(&sQuotasLock);
+    if (changed || !mQuotasScanned) {
+        scanQuotas();
+    }
+
+    for (it = mQuotaFds.begin(); it != mQuotaFds.end(); ) {
+        len = pread(it->second, buff, sizeof(buff) - 1, 0);
+        sample.timeMs = nowMs;
+        sample.numValues = 1;
+        if (len <= 0) {
+            /* The counter is gone with its last rule, rescan next round. */
+            close(it->second);
+            mQuotaFds.erase(it++);
+            mQuotasScanned = false;
+            continue;
+        }
+        buff[len] = '\0';
+        if (sscanf(buff, "%lld", &sample.values[0]) == 1) {
+            seen.insert("quota:" + it->first);
+            record("quota:" + it->first, sample);
+        }
+        it++;
+    }
+    return true;
+}
+
+bool CounterSampler::sampleTethers(int64_t nowMs, std::set<std::string> &seen) {
+    std::list<BandwidthController::TetherStats> statsList;
+    std::list<BandwidthController::TetherStats>::iterator it;
+    Sample sample;
+
+    if (BandwidthController::getTetherStats(statsList)) {
+        return false;
+    }
+    for (it = statsList.begin(); it != statsList.end(); it++) {
+        sample.timeMs = nowMs;
+        sample.numValues = 4;
+        sample.values[0] = it->rxBytes;
+        sample.values[1] = it->rxPackets;
+        sample.values[2] = it->txBytes;
+        sample.values[3] = it->txPackets;
+        seen.insert("tether:" + it->ifaceIn + ":" + it->ifaceOut);
+        record("tether:" + it->ifaceIn + ":" + it->ifaceOut, sample);
+    }
+    return true;
+}
+
+void CounterSampler::record(const std::string &name, const Sample &sample) {
+    pthread_mutex_lock(&mLock);
+    Series &series = mSeries[name];
+    if (series.ring.empty()) {
+        series.ring.resize(HISTORY_DEPTH);
+    }
+    series.ring[series.next] = sample;
+    series.next = (series.next + 1) % HISTORY_DEPTH;
+    if (series.count < HISTORY_DEPTH) {
+        series.count++;
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void CounterSampler::evictSeries(const std::string &prefix, const std::set<std::string> &seen) {
+    std::map<std::string, Series>::iterator it;
+
+    pthread_mutex_lock(&mLock);
+    it = mSeries.lower_bound(prefix);
+    while (it != mSeries.end() && !it->first.compare(0, prefix.size(), prefix)) {
+        if (seen.find(it->first) == seen.end()) {
+            LOGV("Evicting series %s", it->first.c_str());
+            mSeries.erase(it++);
+        } else {
+            it++;
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+int CounterSampler::getHistory(const char *name, int64_t sinceMs, std::list<Sample> &samples) {
+    std::map<std::string, Series>::iterator it;
+    size_t slot;
+
+    pthread_mutex_lock(&mLock);
+    it = mSeries.find(name);
+    if (it == mSeries.end()) {
+        pthread_mutex_unlock(&mLock);
+        LOGE("No history for %s", name);
+        return -1;
+    }
+
+    Series &series = it->second;
+    slot = (series.next + HISTORY_DEPTH - series.count) % HISTORY_DEPTH;
+    for (size_t sampleNum = 0; sampleNum < series.count; sampleNum++) {
+        if (series.ring[slot].timeMs > sinceMs) {
+            samples.push_back(series.ring[slot]);
+        }
+        slot = (slot + 1) % HISTORY_DEPTH;
+    }
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COUNTER_SAMPLER_H
+#define _COUNTER_SAMPLER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Samples the interface, quota and tether counters at a fixed interval
+ * into one fixed-size ring buffer per counter, so clients can get rates
+ * and trends from memory instead of each polling netd.
+ * Series names:
+ *   iface:<iface>          rx_bytes rx_packets tx_bytes tx_packets
+ *   quota:<name>           remaining_bytes
+ *   tether:<ifIn>:<ifOut>  rx_bytes rx_packets tx_bytes tx_packets
+ */
+class CounterSampler {
+public:
+    class Sample {
+    public:
+        Sample(void) : timeMs(0), numValues(0) {};
+        int64_t timeMs;  /* CLOCK_MONOTONIC, like SystemClock.uptimeMillis() */
+        int numValues;
+        int64_t values[4];
+        /*
+         * Allocates a new string representing this:
+         * time_ms value ...
+         * The caller is responsible for free()'ing the returned ptr.
+         */
+        char *getSampleLine(void);
+    };
+
+    CounterSampler();
+    virtual ~CounterSampler() {}
+
+    /*
+     * Samples every intervalMs from now on, 0 stops sampling.
+     * The recorded history is kept either way.
+     */
+    int setInterval(int intervalMs);
+
+    /*
+     * Appends the samples of the series taken after sinceMs, oldest first.
+     * Returns -1 if nothing was ever recorded under that name.
+     */
+    int getHistory(const char *name, int64_t sinceMs, std::list<Sample> &samples);
+
+    /*
+     * Makes the sampler rescan /proc/net/xt_quota before its next round,
+     * for whoever adds or removes quota2 rules.
+     */
+    static void notifyQuotasChanged(void);
+
+private:
+    class Series {
+    public:
+        Series(void) : next(0), count(0) {};
+        std::vector<Sample> ring;
+        size_t next;   /* slot the next sample goes to */
+        size_t count;  /* valid samples, up to HISTORY_DEPTH */
+    };
+
+    static void *threadStart(void *obj);
+    void run(void);
+
+    /*
+     * The sampling itself runs unlocked, only the recording takes mLock.
+     * Each sampleX() adds the series it recorded to seen, and returns
+     * false if it could not read its counters at all.
+     */
+    void sampleAll(void);
+    bool sampleInterfaces(int64_t nowMs, std::set<std::string> &seen);
+    bool sampleQuotas(int64_t nowMs, std::set<std::string> &seen);
+    bool sampleTethers(int64_t nowMs, std::set<std::string> &seen);
+    void record(const std::string &name, const Sample &sample);
+    /* Drops the series named prefix... that were not seen in the last round. */
+    void evictSeries(const std::string &prefix, const std::set<std::string> &seen);
+
+    /*
+     * The quota counters are read with pread() on fds kept open in
+     * mQuotaFds, only used by the sampler thread. The directory is only
+     * scanned again when notified or when a counter went away.
+     */
+    void scanQuotas(void);
+    void closeQuotaFds(void);
+    static int64_t getTimeMs(void);
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    bool mThreadRunning;
+    int mIntervalMs;
+    std::map<std::string, Series> mSeries;
+    std::map<std::string, int> mQuotaFds;
+    bool mQuotasScanned;
+
+    static pthread_mutex_t sQuotasLock;
+    static bool sQuotasChanged;
+
+    static const size_t HISTORY_DEPTH;
+    static const char INTERVAL_PROPERTY[];
+};
+
+#endif
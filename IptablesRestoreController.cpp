@@ -0,0 +1,481 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// #define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <map>
+
+#define LOG_TAG "IptablesRestoreController"
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "IptablesRestoreController.h"
+
+const char IptablesRestoreController::IPTABLES_PATH[] = "/system/bin/iptables";
+const char IptablesRestoreController::IP6TABLES_PATH[] = "/system/bin/ip6tables";
+const char IptablesRestoreController::IPTABLES_RESTORE_PATH[] = "/system/bin/iptables-restore";
+const char IptablesRestoreController::IP6TABLES_RESTORE_PATH[] = "/system/bin/ip6tables-restore";
+const char IptablesRestoreController::PING[] = "#PING";
+const char IptablesRestoreController::RULE_BACKEND_PROPERTY[] = "persist.netd.rulebackend";
+const int  IptablesRestoreController::MAX_CMD_ARGS = 32;
+const int  IptablesRestoreController::PROBE_TIMEOUT_MS = 1000;
+const int  IptablesRestoreController::PROBE_RETRY_SECS = 60;
+const int  IptablesRestoreController::ACK_TIMEOUT_MS = 10000;
+
+IptablesRestoreController::Worker IptablesRestoreController::sWorkers[2];
+pthread_mutex_t IptablesRestoreController::sLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t IptablesRestoreController::sBackendLock = PTHREAD_MUTEX_INITIALIZER;
+bool IptablesRestoreController::sBackendLoaded = false;
+bool IptablesRestoreController::sEnabled = false;
+
+const char *IptablesRestoreController::getPath(IptIpVer iptVer) {
+    return (iptVer == IptIpV4) ? IPTABLES_RESTORE_PATH : IP6TABLES_RESTORE_PATH;
+}
+
+bool IptablesRestoreController::isEnabled(void) {
+    bool enabled;
+
+    pthread_mutex_lock(&sBackendLock);
+    if (!sBackendLoaded) {
+        pthread_mutex_unlock(&sBackendLock);
+        loadBackend();
+        pthread_mutex_lock(&sBackendLock);
+    }
+    enabled = sEnabled;
+    pthread_mutex_unlock(&sBackendLock);
+    return enabled;
+}
+
+void IptablesRestoreController::loadBackend(void) {
+    char value[PROPERTY_VALUE_MAX];
+    bool enabled;
+
+    property_get(RULE_BACKEND_PROPERTY, value, "restore");
+    enabled = !strcmp(value, "restore") && isAvailable(IptIpV4) && isAvailable(IptIpV6);
+    LOGI("Rule backend: %s", enabled ? "iptables-restore" : "iptables");
+
+    pthread_mutex_lock(&sBackendLock);
+    sEnabled = enabled;
+    sBackendLoaded = true;
+    pthread_mutex_unlock(&sBackendLock);
+}
+
+bool IptablesRestoreController::isAvailable(IptIpVer iptVer) {
+    return access(getPath(iptVer), X_OK) == 0;
+}
+
+std::string IptablesRestoreController::makeRestoreRules(const std::list<std::string> &commands) {
+    std::map<std::string, std::string> tableRules;
+    std::map<std::string, std::string>::iterator tableIt;
+    std::list<std::string>::const_iterator it;
+    std::string rules;
+
+    for (it = commands.begin(); it != commands.end(); it++) {
+        std::string table = "filter";
+        std::string rule = *it;
+
+        rule.erase(0, rule.find_first_not_of(' '));
+        if (!rule.compare(0, 3, "-t ")) {
+            size_t tableEnd = rule.find(' ', 3);
+            table = rule.substr(3, tableEnd - 3);
+            rule.erase(0, tableEnd == std::string::npos ? rule.size() : tableEnd + 1);
+        }
+        tableRules[table] += rule;
+        tableRules[table] += "\n";
+    }
+
+    for (tableIt = tableRules.begin(); tableIt != tableRules.end(); tableIt++) {
+        rules += "*" + tableIt->first + "\n";
+        rules += tableIt->second;
+        rules += "COMMIT\n";
+    }
+    return rules;
+}
+
+int IptablesRestoreController::writeAll(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+time_t IptablesRestoreController::getMonotonicSecs(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+int IptablesRestoreController::startWorker(IptIpVer iptVer) {
+    Worker &worker = sWorkers[iptVer];
+    const char *path = getPath(iptVer);
+    int inPipe[2];
+    int outPipe[2];
+    std::string ping;
+
+    /*
+     * Close-on-exec from the start: other threads fork too, and a child
+     * holding a write end would keep the pipe from ever reaching EOF.
+     * dup2() clears the flag on the child's stdin/stdout/stderr.
+     */
+    if (pipe2(inPipe, O_CLOEXEC)) {
+        LOGE("pipe2() failed (%s)", strerror(errno));
+        return -1;
+    }
+    if (pipe2(outPipe, O_CLOEXEC)) {
+        LOGE("pipe2() failed (%s)", strerror(errno));
+        close(inPipe[0]);
+        close(inPipe[1]);
+        return -1;
+    }
+
+    worker.pid = fork();
+    if (worker.pid < 0) {
+        LOGE("fork() failed (%s)", strerror(errno));
+        close(inPipe[0]);
+        close(inPipe[1]);
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return -1;
+    }
+    if (worker.pid == 0) {
+        dup2(inPipe[0], STDIN_FILENO);
+        dup2(outPipe[1], STDOUT_FILENO);
+        dup2(outPipe[1], STDERR_FILENO);
+        close(inPipe[0]);
+        close(inPipe[1]);
+        close(outPipe[0]);
+        close(outPipe[1]);
+        execl(path, path, "--noflush", (char *) NULL);
+        _exit(127);
+    }
+
+    close(inPipe[0]);
+    close(outPipe[1]);
+    worker.inFd = inPipe[1];
+    worker.outFd = outPipe[0];
+    worker.outClosed = false;
+    worker.pendingOutput.clear();
+
+    /* Only an iptables-restore that echoes "#PING" can report per transaction. */
+    ping = PING;
+    ping += "\n";
+    if (writeAll(worker.inFd, ping.data(), ping.size()) || waitForAck(iptVer, PROBE_TIMEOUT_MS)) {
+        /*
+         * On EOF an iptables-restore that ignores "#PING" as a comment
+         * exits without a word, a slow one still echoes or is still busy.
+         */
+        close(worker.inFd);
+        worker.inFd = -1;
+        if (waitForAck(iptVer, PROBE_TIMEOUT_MS) && worker.outClosed) {
+            LOGW("%s does not acknowledge transactions, forking per transaction", path);
+            worker.unsupported = true;
+        } else {
+            LOGW("%s is slow to acknowledge, retrying in %d s", path, PROBE_RETRY_SECS);
+            worker.nextProbe = getMonotonicSecs() + PROBE_RETRY_SECS;
+        }
+        stopWorker(iptVer);
+        return -1;
+    }
+    LOGV("Started %s pid=%d", path, worker.pid);
+    return 0;
+}
+
+void IptablesRestoreController::stopWorker(IptIpVer iptVer) {
+    Worker &worker = sWorkers[iptVer];
+
+    if (worker.pid <= 0)
+        return;
+
+    if (worker.inFd >= 0)
+        close(worker.inFd);
+    close(worker.outFd);
+    kill(worker.pid, SIGTERM);
+    waitpid(worker.pid, NULL, 0);
+    worker.pid = -1;
+    worker.inFd = worker.outFd = -1;
+    worker.pendingOutput.clear();
+}
+
+int IptablesRestoreController::waitForAck(IptIpVer iptVer, int timeoutMs) {
+    Worker &worker = sWorkers[iptVer];
+    const char *path = getPath(iptVer);
+    char buffer[256];
+    int res = 0;
+
+    while (true) {
+        size_t lineEnd;
+
+        while ((lineEnd = worker.pendingOutput.find('\n')) != std::string::npos) {
+            std::string line = worker.pendingOutput.substr(0, lineEnd);
+
+            worker.pendingOutput.erase(0, lineEnd + 1);
+            if (line == PING)
+                return res;
+            LOGE("%s: %s", path, line.c_str());
+            res = -1;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = worker.outFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0) {
+            LOGE("%s: no acknowledgement after %d ms", path, timeoutMs);
+            return -1;
+        }
+
+        ssize_t len = read(worker.outFd, buffer, sizeof(buffer));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            /* iptables-restore exits when a transaction fails. */
+            LOGE("%s exited", path);
+            worker.outClosed = true;
+            return -1;
+        }
+        worker.pendingOutput.append(buffer, len);
+    }
+}
+
+int IptablesRestoreController::waitForChild(const char *path, pid_t pid) {
+    int status;
+
+    if (waitpid(pid, &status, 0) == -1) {
+        LOGE("waitpid() for %s failed (%s)", path, strerror(errno));
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        LOGE("%s failed status=%d", path, status);
+        return -1;
+    }
+    return 0;
+}
+
+int IptablesRestoreController::runIptables(IptIpVer iptVer, const std::string &command) {
+    pid_t pid;
+    int res;
+
+    /* A 2012 iptables takes no lock, it must not race the transactions. */
+    pthread_mutex_lock(&sLock);
+    pid = spawnIptables(iptVer, command);
+    res = (pid > 0) ? waitForChild(iptVer == IptIpV4 ? IPTABLES_PATH : IP6TABLES_PATH, pid) : -1;
+    pthread_mutex_unlock(&sLock);
+    return res;
+}
+
+int IptablesRestoreController::runIptablesBoth(const std::string &v4Command,
+                                               const std::string &v6Command) {
+    pid_t v4Pid, v6Pid;
+    int res = 0;
+
+    pthread_mutex_lock(&sLock);
+    v4Pid = spawnIptables(IptIpV4, v4Command);
+    v6Pid = spawnIptables(IptIpV6, v6Command);
+    res |= (v4Pid > 0) ? waitForChild(IPTABLES_PATH, v4Pid) : -1;
+    res |= (v6Pid > 0) ? waitForChild(IP6TABLES_PATH, v6Pid) : -1;
+    pthread_mutex_unlock(&sLock);
+    return res;
+}
+
+pid_t IptablesRestoreController::spawnRestore(IptIpVer iptVer, const std::string &rules) {
+    const char *path = getPath(iptVer);
+    int pipeFds[2];
+    pid_t pid;
+
+    /* See startWorker(): iptables-restore must see EOF once we close our end. */
+    if (pipe2(pipeFds, O_CLOEXEC)) {
+        LOGE("pipe2() failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        LOGE("fork() failed (%s)", strerror(errno));
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(pipeFds[0], STDIN_FILENO);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        execl(path, path, "--noflush", (char *) NULL);
+        _exit(127);
+    }
+
+    close(pipeFds[0]);
+    if (writeAll(pipeFds[1], rules.data(), rules.size())) {
+        /* A truncated input has no COMMIT, iptables-restore will fail it. */
+        LOGE("Writing rules to %s failed (%s)", path, strerror(errno));
+    }
+    /* EOF tells iptables-restore there is nothing more to commit. */
+    close(pipeFds[1]);
+    return pid;
+}
+
+pid_t IptablesRestoreController::spawnIptables(IptIpVer iptVer, const std::string &command) {
+    const char *path = (iptVer == IptIpV4) ? IPTABLES_PATH : IP6TABLES_PATH;
+    std::string buffer = command;
+    const char *argv[MAX_CMD_ARGS];
+    char *next;
+    char *tmp;
+    int argc = 0;
+    pid_t pid;
+
+    argv[argc++] = path;
+    next = &buffer[0];
+    while ((tmp = strsep(&next, " "))) {
+        if (!*tmp)
+            continue;
+        argv[argc++] = tmp;
+        if (argc >= MAX_CMD_ARGS) {
+            LOGE("iptables argument overflow");
+            return -1;
+        }
+    }
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid < 0) {
+        LOGE("fork() failed (%s)", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        execv(path, (char * const *) argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+int IptablesRestoreController::beginTransaction(IptIpVer iptVer, const std::string &rules,
+                                                pid_t *pid) {
+    Worker &worker = sWorkers[iptVer];
+
+    LOGV("beginTransaction(%s):\n%s", getPath(iptVer), rules.c_str());
+
+    *pid = -1;
+    if (worker.pid <= 0 && !worker.unsupported && getMonotonicSecs() >= worker.nextProbe) {
+        startWorker(iptVer);
+    }
+    if (worker.pid > 0) {
+        std::string transaction = rules;
+
+        transaction += PING;
+        transaction += "\n";
+        if (writeAll(worker.inFd, transaction.data(), transaction.size())) {
+            LOGE("Writing rules to %s failed (%s)", getPath(iptVer), strerror(errno));
+            stopWorker(iptVer);
+            return -1;
+        }
+        return 0;
+    }
+
+    *pid = spawnRestore(iptVer, rules);
+    return *pid > 0 ? 0 : -1;
+}
+
+int IptablesRestoreController::endTransaction(IptIpVer iptVer, pid_t pid) {
+    int res;
+
+    if (pid > 0) {
+        return waitForChild(getPath(iptVer), pid);
+    }
+    res = waitForAck(iptVer, ACK_TIMEOUT_MS);
+    if (res) {
+        /* The next transaction gets a fresh iptables-restore. */
+        stopWorker(iptVer);
+    }
+    return res;
+}
+
+int IptablesRestoreController::execute(IptIpVer iptVer, const std::string &rules) {
+    pid_t pid;
+    int res;
+
+    pthread_mutex_lock(&sLock);
+    res = beginTransaction(iptVer, rules, &pid);
+    if (!res) {
+        res = endTransaction(iptVer, pid);
+    }
+    pthread_mutex_unlock(&sLock);
+    return res;
+}
+
+int IptablesRestoreController::executeBoth(const std::string &v4Rules,
+                                           const std::string &v6Rules) {
+    pid_t v4Pid, v6Pid;
+    int v4Res, v6Res;
+
+    /* The families use separate tables and locks: commit both, then collect both. */
+    pthread_mutex_lock(&sLock);
+    v4Res = beginTransaction(IptIpV4, v4Rules, &v4Pid);
+    v6Res = beginTransaction(IptIpV6, v6Rules, &v6Pid);
+    if (!v4Res) {
+        v4Res = endTransaction(IptIpV4, v4Pid);
+    }
+    if (!v6Res) {
+        v6Res = endTransaction(IptIpV6, v6Pid);
+    }
+    pthread_mutex_unlock(&sLock);
+    return v4Res | v6Res;
+}
+
+int IptablesRestoreController::executeCommand(IptIpVer iptVer, const std::string &command,
+                                              IptFailureHandling failureHandling) {
+    std::list<std::string> commands;
+
+    if (failureHandling == IptFailureOk) {
+        return runIptables(iptVer, command);
+    }
+    commands.push_back(command);
+    return execute(iptVer, makeRestoreRules(commands));
+}
+
+int IptablesRestoreController::executeCommandBoth(const std::string &v4Command,
+                                                  const std::string &v6Command,
+                                                  IptFailureHandling failureHandling) {
+    std::list<std::string> v4Commands;
+    std::list<std::string> v6Commands;
+
+    if (!isEnabled() || failureHandling == IptFailureOk) {
+        return runIptablesBoth(v4Command, v6Command);
+    }
+
+    v4Commands.push_back(v4Command);
+    v6Commands.push_back(v6Command);
+    return executeBoth(makeRestoreRules(v4Commands), makeRestoreRules(v6Commands));
+}
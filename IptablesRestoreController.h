@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_RESTORE_CONTROLLER_H
+#define _IPTABLES_RESTORE_CONTROLLER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <list>
+#include <string>
+
+class IptablesRestoreController {
+public:
+    enum IptIpVer { IptIpV4, IptIpV6 };
+    /*
+     * A command that is allowed to fail (a -D or -X of a rule that may be
+     * gone, a -N of a chain that may exist) is run with a forked iptables:
+     * a failed transaction costs the worker a restart and a new probe.
+     */
+    enum IptFailureHandling { IptFailureBad, IptFailureOk };
+
+    /*
+     * Rule backend, selected by persist.netd.rulebackend:
+     *   "restore" (default) - transactions through iptables-restore, see execute().
+     *   "exec"              - one iptables/ip6tables process per command.
+     * Returns true for "restore" if iptables-restore and ip6tables-restore are
+     * present. Callers fall back to per-command iptables otherwise.
+     * The choice is made by loadBackend(), at the first call and on each
+     * bandwidth enable, so it does not change in the middle of an operation.
+     */
+    static bool isEnabled(void);
+    static void loadBackend(void);
+
+    /*
+     * Returns true if the iptables-restore binary for the IP version
+     * is present.
+     */
+    static bool isAvailable(IptIpVer iptVer);
+
+    /*
+     * Groups iptables command lines (without the binary path) into
+     * "*table ... COMMIT" sections. A leading "-t <table>" moves the
+     * command into that table's section, the default is "filter".
+     */
+    static std::string makeRestoreRules(const std::list<std::string> &commands);
+
+    /*
+     * Feeds rules in iptables-restore format ("*table", commands, "COMMIT")
+     * to iptables-restore --noflush. Each table section is committed by the
+     * kernel in a single replace, so the ruleset is never seen half-built.
+     * Returns 0 on success.
+     *
+     * A long-lived iptables-restore is kept per IP version and each call is
+     * one transaction on its stdin, acknowledged with a "#PING" echo. If the
+     * installed iptables-restore does not echo, every call forks a new one.
+     * Safe to call from any thread.
+     */
+    static int execute(IptIpVer iptVer, const std::string &rules);
+
+    /*
+     * Commits the IPv4 and IPv6 rules concurrently: both transactions are
+     * started before either is waited for. Returns 0 if both succeeded.
+     */
+    static int executeBoth(const std::string &v4Rules, const std::string &v6Rules);
+
+    /* Runs a single iptables command line (without the binary path) as one transaction. */
+    static int executeCommand(IptIpVer iptVer, const std::string &command,
+                              IptFailureHandling failureHandling = IptFailureBad);
+
+    /*
+     * Runs the IPv4 and IPv6 variants of a command line concurrently and
+     * merges the results. Honors the rule backend: with "exec" it launches
+     * iptables and ip6tables side by side and waits for both, as it does
+     * for IptFailureOk.
+     */
+    static int executeCommandBoth(const std::string &v4Command, const std::string &v6Command,
+                                  IptFailureHandling failureHandling = IptFailureBad);
+
+private:
+    class Worker {
+    public:
+        Worker() : pid(-1), inFd(-1), outFd(-1), outClosed(false), unsupported(false),
+                   nextProbe(0) {};
+        pid_t pid;
+        int inFd;   /* iptables-restore's stdin */
+        int outFd;  /* iptables-restore's stdout and stderr */
+        bool outClosed;
+        /* The binary does not echo "#PING", never start it again. */
+        bool unsupported;
+        /* A probe timed out, no worker before this CLOCK_MONOTONIC second. */
+        time_t nextProbe;
+        std::string pendingOutput;
+    };
+
+    static const char *getPath(IptIpVer iptVer);
+    static int writeAll(int fd, const char *buf, size_t len);
+    static time_t getMonotonicSecs(void);
+
+    static int waitForChild(const char *path, pid_t pid);
+    /* Runs the commands with iptables/ip6tables, serialized with the transactions. */
+    static int runIptables(IptIpVer iptVer, const std::string &command);
+    static int runIptablesBoth(const std::string &v4Command, const std::string &v6Command);
+    /* Forks a one-shot iptables-restore fed with the rules. */
+    static pid_t spawnRestore(IptIpVer iptVer, const std::string &rules);
+    /* Forks iptables/ip6tables for the "exec" backend. */
+    static pid_t spawnIptables(IptIpVer iptVer, const std::string &command);
+
+    /*
+     * Hands the rules to the worker, or to a one-shot iptables-restore whose
+     * pid is returned in *pid. endTransaction() collects the result.
+     */
+    static int beginTransaction(IptIpVer iptVer, const std::string &rules, pid_t *pid);
+    static int endTransaction(IptIpVer iptVer, pid_t pid);
+
+    static int startWorker(IptIpVer iptVer);
+    static void stopWorker(IptIpVer iptVer);
+    /*
+     * Reads the worker's output up to the "#PING" acknowledgement.
+     * Any other output line is an error message from the transaction.
+     */
+    static int waitForAck(IptIpVer iptVer, int timeoutMs);
+
+    static Worker sWorkers[2];
+    static pthread_mutex_t sLock;
+    /* Guards sBackendLoaded and sEnabled, never held with sLock. */
+    static pthread_mutex_t sBackendLock;
+    static bool sBackendLoaded;
+    static bool sEnabled;
+
+    static const char IPTABLES_PATH[];
+    static const char IP6TABLES_PATH[];
+    static const char IPTABLES_RESTORE_PATH[];
+    static const char IP6TABLES_RESTORE_PATH[];
+    static const char PING[];
+    static const char RULE_BACKEND_PROPERTY[];
+    static const int  MAX_CMD_ARGS;
+    static const int  PROBE_TIMEOUT_MS;
+    static const int  PROBE_RETRY_SECS;
+    static const int  ACK_TIMEOUT_MS;
+};
+
+#endif
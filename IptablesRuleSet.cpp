@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// #define LOG_NDEBUG 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "IptablesRuleSet"
+#include <cutils/log.h>
+
+#include "IptablesRuleSet.h"
+
+const unsigned int IptablesRuleSet::UID_TREE_WIDTHS[] = { 4096, 256, 16 };
+const int IptablesRuleSet::UID_TREE_LEVELS = sizeof(UID_TREE_WIDTHS) / sizeof(UID_TREE_WIDTHS[0]);
+
+IptablesRuleSet::IptablesRuleSet() {
+    clear();
+}
+
+std::string IptablesRuleSet::Rule::command(bool isIpv6) const {
+    if (!reject)
+        return spec;
+    return spec + (isIpv6 ? " --jump REJECT --reject-with icmp6-adm-prohibited"
+                          : " --jump REJECT --reject-with icmp-net-prohibited");
+}
+
+void IptablesRuleSet::clear(void) {
+    chains.clear();
+    chains["INPUT"].shared = true;
+    chains["OUTPUT"].shared = true;
+    chains["FORWARD"].shared = true;
+}
+
+bool IptablesRuleSet::hasChain(const std::string &chain) const {
+    return chains.find(chain) != chains.end();
+}
+
+int IptablesRuleSet::getRuleCount(const std::string &chain) const {
+    ChainMap::const_iterator it = chains.find(chain);
+
+    return it == chains.end() ? -1 : it->second.rules.size();
+}
+
+void IptablesRuleSet::getQuotaNames(const std::string &chain,
+                                    std::list<std::string> &names) const {
+    ChainMap::const_iterator chainIt = chains.find(chain);
+    std::vector<Rule>::const_iterator it;
+    size_t namePos;
+
+    if (chainIt == chains.end()) {
+        return;
+    }
+    for (it = chainIt->second.rules.begin(); it != chainIt->second.rules.end(); it++) {
+        namePos = it->spec.rfind("--name ");
+        if (it->spec.find("-m quota2 ") != std::string::npos && namePos != std::string::npos) {
+            names.push_back(it->spec.substr(namePos + strlen("--name ")));
+        }
+    }
+}
+
+void IptablesRuleSet::getChainNames(std::list<std::string> &names) const {
+    ChainMap::const_iterator it;
+
+    for (it = chains.begin(); it != chains.end(); it++) {
+        names.push_back(it->first);
+    }
+}
+
+bool IptablesRuleSet::isShared(const std::string &chain) const {
+    ChainMap::const_iterator it = chains.find(chain);
+
+    return it != chains.end() && it->second.shared;
+}
+
+int IptablesRuleSet::write(FILE *fp) const {
+    ChainMap::const_iterator chainIt;
+    std::vector<Rule>::const_iterator ruleIt;
+
+    for (chainIt = chains.begin(); chainIt != chains.end(); chainIt++) {
+        fprintf(fp, "chain %s\n", chainIt->first.c_str());
+        for (ruleIt = chainIt->second.rules.begin(); ruleIt != chainIt->second.rules.end();
+             ruleIt++) {
+            fprintf(fp, "rule %d %s\n", ruleIt->reject, ruleIt->spec.c_str());
+        }
+    }
+    fprintf(fp, "end\n");
+    return ferror(fp) ? -1 : 0;
+}
+
+int IptablesRuleSet::read(FILE *fp) {
+    char buffer[1024];
+    Chain *chain = NULL;
+    size_t len;
+
+    clear();
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        len = strlen(buffer);
+        if (!len || buffer[len - 1] != '\n') {
+            LOGE("Rule line too long");
+            break;
+        }
+        buffer[len - 1] = '\0';
+
+        if (!strcmp(buffer, "end")) {
+            return 0;
+        }
+        if (!strncmp(buffer, "chain ", 6)) {
+            chain = &chains[buffer + 6];
+        } else if (chain && (!strncmp(buffer, "rule 0 ", 7) || !strncmp(buffer, "rule 1 ", 7))) {
+            chain->rules.push_back(Rule(buffer + 7, buffer[5] == '1'));
+        } else {
+            LOGE("Unexpected rule set line: %s", buffer);
+            break;
+        }
+    }
+    clear();
+    return -1;
+}
+
+int IptablesRuleSet::apply(const std::string &command, bool reject) {
+    std::vector<std::string> tokens;
+    std::string op;
+    std::string chainName;
+    std::string spec;
+    ChainMap::iterator chainIt;
+    std::vector<Rule>::iterator ruleIt;
+    size_t start, end;
+    size_t tokenNum = 0;
+    int pos = 0;
+
+    for (start = command.find_first_not_of(' '); start != std::string::npos;
+            start = command.find_first_not_of(' ', end)) {
+        end = command.find(' ', start);
+        tokens.push_back(command.substr(start, end - start));
+    }
+    if (tokens.empty()) {
+        LOGE("Empty command");
+        return -1;
+    }
+    op = tokens[tokenNum++];
+    if (tokenNum < tokens.size()) {
+        chainName = tokens[tokenNum++];
+    }
+    if ((op == "-I" || op == "-R") && tokenNum < tokens.size()
+            && strspn(tokens[tokenNum].c_str(), "0123456789") == tokens[tokenNum].size()) {
+        pos = atoi(tokens[tokenNum++].c_str());
+    }
+    for (; tokenNum < tokens.size(); tokenNum++) {
+        if (!spec.empty())
+            spec += " ";
+        spec += tokens[tokenNum];
+    }
+
+    LOGV("apply(%s chain=%s pos=%d spec=%s)", op.c_str(), chainName.c_str(), pos, spec.c_str());
+
+    if (op == "-N") {
+        if (chainName.empty() || hasChain(chainName)) {
+            LOGE("Cannot create chain %s", chainName.c_str());
+            return -1;
+        }
+        chains[chainName];
+        return 0;
+    }
+
+    if (chainName.empty()) {
+        if (op == "-F") {
+            for (chainIt = chains.begin(); chainIt != chains.end(); chainIt++) {
+                chainIt->second.rules.clear();
+            }
+            return 0;
+        }
+        if (op == "-X") {
+            for (chainIt = chains.begin(); chainIt != chains.end();) {
+                if (!chainIt->second.shared) {
+                    chains.erase(chainIt++);
+                } else {
+                    chainIt++;
+                }
+            }
+            return 0;
+        }
+        LOGE("Missing chain in %s", command.c_str());
+        return -1;
+    }
+
+    chainIt = chains.find(chainName);
+    if (chainIt == chains.end()) {
+        LOGE("No chain %s for %s", chainName.c_str(), command.c_str());
+        return -1;
+    }
+    std::vector<Rule> &rules = chainIt->second.rules;
+
+    if (op == "-F") {
+        rules.clear();
+    } else if (op == "-X") {
+        if (chainIt->second.shared || !rules.empty()) {
+            LOGE("Cannot delete chain %s", chainName.c_str());
+            return -1;
+        }
+        chains.erase(chainIt);
+    } else if (op == "-A") {
+        rules.push_back(Rule(spec, reject));
+    } else if (op == "-I") {
+        if (!pos)
+            pos = 1;
+        if (pos > (int) rules.size() + 1) {
+            LOGE("Index %d out of range in %s", pos, chainName.c_str());
+            return -1;
+        }
+        rules.insert(rules.begin() + pos - 1, Rule(spec, reject));
+    } else if (op == "-R") {
+        if (pos < 1 || pos > (int) rules.size()) {
+            LOGE("Index %d out of range in %s", pos, chainName.c_str());
+            return -1;
+        }
+        rules[pos - 1] = Rule(spec, reject);
+    } else if (op == "-D") {
+        for (ruleIt = rules.begin(); ruleIt != rules.end(); ruleIt++) {
+            if (*ruleIt == Rule(spec, reject))
+                break;
+        }
+        if (ruleIt == rules.end()) {
+            LOGE("No rule \"%s\" in %s", spec.c_str(), chainName.c_str());
+            return -1;
+        }
+        rules.erase(ruleIt);
+    } else {
+        LOGE("Unsupported command %s", command.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int IptablesRuleSet::deleteQuotaRule(const std::string &chain, const std::string &quotaName) {
+    ChainMap::iterator chainIt = chains.find(chain);
+    std::vector<Rule>::iterator it;
+    std::string nameOpt = "--name " + quotaName;
+    int res = -1;
+
+    if (chainIt == chains.end()) {
+        LOGE("No chain %s", chain.c_str());
+        return -1;
+    }
+    std::vector<Rule> &rules = chainIt->second.rules;
+    for (it = rules.begin(); it != rules.end();) {
+        const std::string &spec = it->spec;
+        if (spec.size() >= nameOpt.size() && spec.find("-m quota2 ") != std::string::npos
+                && !spec.compare(spec.size() - nameOpt.size(), nameOpt.size(), nameOpt)) {
+            it = rules.erase(it);
+            res = 0;
+        } else {
+            it++;
+        }
+    }
+    if (res) {
+        LOGE("No quota %s in %s", quotaName.c_str(), chain.c_str());
+    }
+    return res;
+}
+
+void IptablesRuleSet::addUidTreeLevel(const std::string &chain,
+                                      const std::string &subChainPrefix,
+                                      UidRuleIterator begin, UidRuleIterator end, int level) {
+    UidRuleIterator it;
+    UidRuleIterator groupEnd;
+    unsigned int width;
+    unsigned int lo, hi;
+    char *subChain;
+    char *spec;
+
+    if (level == UID_TREE_LEVELS) {
+        for (it = begin; it != end; it++) {
+            chains[chain].rules.push_back(it->second);
+        }
+        return;
+    }
+
+    width = UID_TREE_WIDTHS[level];
+    for (it = begin; it != end; it = groupEnd) {
+        lo = (unsigned int) it->first / width * width;
+        hi = lo + width - 1;
+        for (groupEnd = it; groupEnd != end && (unsigned int) groupEnd->first <= hi; groupEnd++)
+            ;
+
+        asprintf(&subChain, "%s_%x_%x", subChainPrefix.c_str(), lo, hi);
+        asprintf(&spec, "-m owner --uid-owner %u-%u --goto %s", lo, hi, subChain);
+        /* No reference kept across the recursion: it inserts into chains. */
+        chains[chain].rules.push_back(Rule(spec, false));
+        chains[subChain];
+        addUidTreeLevel(subChain, subChainPrefix, it, groupEnd, level + 1);
+        free(spec);
+        free(subChain);
+    }
+}
+
+int IptablesRuleSet::setUidTree(const std::string &chain, const std::string &subChainPrefix,
+                                const std::map<int, Rule> &uidRules) {
+    ChainMap::iterator chainIt = chains.find(chain);
+    std::string prefix = subChainPrefix + "_";
+
+    if (chainIt == chains.end()) {
+        LOGE("No chain %s", chain.c_str());
+        return -1;
+    }
+    chainIt->second.rules.clear();
+
+    for (chainIt = chains.begin(); chainIt != chains.end();) {
+        if (!chainIt->second.shared && chainIt->first != chain
+                && !chainIt->first.compare(0, prefix.size(), prefix)) {
+            chains.erase(chainIt++);
+        } else {
+            chainIt++;
+        }
+    }
+
+    addUidTreeLevel(chain, subChainPrefix, uidRules.begin(), uidRules.end(), 0);
+    return 0;
+}
+
+std::string IptablesRuleSet::makeCommand(const char *op, const std::string &chain, int pos,
+                                         const std::string &spec) {
+    std::string command = op;
+    char posStr[16];
+
+    command += " " + chain;
+    if (pos) {
+        snprintf(posStr, sizeof(posStr), " %d", pos);
+        command += posStr;
+    }
+    if (!spec.empty()) {
+        command += " " + spec;
+    }
+    return command;
+}
+
+void IptablesRuleSet::diffChain(const std::string &chainName, const Chain &from,
+                                const Chain &to, std::list<Rule> &commands) {
+    const std::vector<Rule> &fromRules = from.rules;
+    const std::vector<Rule> &toRules = to.rules;
+    size_t head = 0;
+    size_t fromEnd = fromRules.size();
+    size_t toEnd = toRules.size();
+    size_t numFrom, numTo, i, j;
+
+    /* Most changes touch a couple of rules: keep the LCS table small. */
+    while (head < fromEnd && head < toEnd && fromRules[head] == toRules[head]) {
+        head++;
+    }
+    while (fromEnd > head && toEnd > head && fromRules[fromEnd - 1] == toRules[toEnd - 1]) {
+        fromEnd--;
+        toEnd--;
+    }
+    numFrom = fromEnd - head;
+    numTo = toEnd - head;
+    if (!numFrom && !numTo) {
+        return;
+    }
+
+    /* lcs[i * (numTo + 1) + j]: longest common subsequence of fromRules[i..] and toRules[j..] */
+    std::vector<int> lcs((numFrom + 1) * (numTo + 1), 0);
+    for (i = numFrom; i-- > 0;) {
+        for (j = numTo; j-- > 0;) {
+            if (fromRules[head + i] == toRules[head + j]) {
+                lcs[i * (numTo + 1) + j] = lcs[(i + 1) * (numTo + 1) + j + 1] + 1;
+            } else {
+                int skipFrom = lcs[(i + 1) * (numTo + 1) + j];
+                int skipTo = lcs[i * (numTo + 1) + j + 1];
+                lcs[i * (numTo + 1) + j] = skipFrom > skipTo ? skipFrom : skipTo;
+            }
+        }
+    }
+
+    std::vector<bool> keepFrom(numFrom, false);
+    std::vector<bool> keepTo(numTo, false);
+    i = j = 0;
+    while (i < numFrom && j < numTo) {
+        if (fromRules[head + i] == toRules[head + j]) {
+            keepFrom[i++] = true;
+            keepTo[j++] = true;
+        } else if (lcs[(i + 1) * (numTo + 1) + j] >= lcs[i * (numTo + 1) + j + 1]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    /* Delete from the bottom so the positions above stay valid. */
+    for (i = numFrom; i-- > 0;) {
+        const Rule &rule = fromRules[head + i];
+        if (keepFrom[i])
+            continue;
+        if (from.shared) {
+            commands.push_back(Rule(makeCommand("-D", chainName, 0, rule.spec), rule.reject));
+        } else {
+            commands.push_back(Rule(makeCommand("-D", chainName, head + i + 1, ""), false));
+        }
+    }
+    for (j = 0; j < numTo; j++) {
+        const Rule &rule = toRules[head + j];
+        if (keepTo[j])
+            continue;
+        commands.push_back(Rule(makeCommand("-I", chainName, head + j + 1, rule.spec),
+                                rule.reject));
+    }
+}
+
+void IptablesRuleSet::diff(const IptablesRuleSet &from, const IptablesRuleSet &to,
+                           std::list<Rule> &commands) {
+    ChainMap::const_iterator it;
+    ChainMap::const_iterator fromIt;
+    std::vector<Rule>::const_iterator ruleIt;
+
+    for (it = to.chains.begin(); it != to.chains.end(); it++) {
+        if (!from.hasChain(it->first)) {
+            commands.push_back(Rule(makeCommand("-N", it->first, 0, ""), false));
+        }
+    }
+
+    /* Fill the new chains before anything jumps to them. */
+    for (it = to.chains.begin(); it != to.chains.end(); it++) {
+        if (from.hasChain(it->first))
+            continue;
+        for (ruleIt = it->second.rules.begin(); ruleIt != it->second.rules.end(); ruleIt++) {
+            commands.push_back(Rule(makeCommand("-A", it->first, 0, ruleIt->spec),
+                                    ruleIt->reject));
+        }
+    }
+
+    for (it = to.chains.begin(); it != to.chains.end(); it++) {
+        fromIt = from.chains.find(it->first);
+        if (fromIt != from.chains.end()) {
+            diffChain(it->first, fromIt->second, it->second, commands);
+        }
+    }
+
+    /* Nothing jumps to the removed chains anymore, except maybe each other. */
+    for (fromIt = from.chains.begin(); fromIt != from.chains.end(); fromIt++) {
+        if (!to.hasChain(fromIt->first) && !fromIt->second.rules.empty()) {
+            commands.push_back(Rule(makeCommand("-F", fromIt->first, 0, ""), false));
+        }
+    }
+    for (fromIt = from.chains.begin(); fromIt != from.chains.end(); fromIt++) {
+        if (!to.hasChain(fromIt->first)) {
+            commands.push_back(Rule(makeCommand("-X", fromIt->first, 0, ""), false));
+        }
+    }
+}
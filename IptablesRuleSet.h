@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_RULE_SET_H
+#define _IPTABLES_RULE_SET_H
+
+#include <stdio.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * In-memory copy of the filter table chains a controller owns.
+ * Commands are applied to the model with the same syntax as iptables, and
+ * diff() turns two models into the minimal iptables commands that take
+ * the kernel from one to the other.
+ */
+class IptablesRuleSet {
+public:
+    class Rule {
+    public:
+        Rule(std::string s, bool r) : spec(s), reject(r) {};
+        bool operator==(const Rule &other) const {
+            return reject == other.reject && spec == other.spec;
+        }
+        /* spec with the --jump REJECT ... of the IP version appended if reject is set. */
+        std::string command(bool isIpv6) const;
+        std::string spec;
+        /* The IP version specific --jump REJECT ... still needs to be appended. */
+        bool reject;
+    };
+
+    IptablesRuleSet();
+
+    /* Drops every chain but the built-in INPUT, OUTPUT and FORWARD. */
+    void clear(void);
+
+    bool hasChain(const std::string &chain) const;
+    int getRuleCount(const std::string &chain) const;
+    void getChainNames(std::list<std::string> &names) const;
+    /* Appends the --name of each quota2 rule of chain, in rule order. */
+    void getQuotaNames(const std::string &chain, std::list<std::string> &names) const;
+    /* For the built-in INPUT, OUTPUT and FORWARD, see Chain::shared. */
+    bool isShared(const std::string &chain) const;
+
+    /*
+     * Saves the model as "chain <name>" and "rule <reject> <spec>" lines
+     * ending with an "end" line, that read() loads back.
+     * Both return 0 on success.
+     */
+    int write(FILE *fp) const;
+    int read(FILE *fp);
+
+    /*
+     * Applies one iptables command line (without the binary path) to the
+     * model. Supports -N, -X, -F, -A, -I, -R and -D, with the same failure
+     * cases as iptables (unknown chain, no matching rule, bad position...).
+     * Returns 0 on success.
+     */
+    int apply(const std::string &command, bool reject);
+
+    /*
+     * Deletes the quota2 rule(s) of chain named quotaName, whatever quota
+     * they were created with. Returns 0 if at least one was found.
+     */
+    int deleteQuotaRule(const std::string &chain, const std::string &quotaName);
+
+    /*
+     * Replaces the rules of chain with a tree of sub-chains dispatching on
+     * "--uid-owner lo-hi" ranges, with the uidRules as the leaves. A packet
+     * walks one level per UID_TREE_WIDTHS entry instead of every rule.
+     * The sub-chains are named "<subChainPrefix>_<lo>_<hi>" (hex), and
+     * depend only on the UIDs, so diff() only touches the branches that
+     * changed. Returns 0 on success.
+     */
+    int setUidTree(const std::string &chain, const std::string &subChainPrefix,
+                   const std::map<int, Rule> &uidRules);
+
+    /*
+     * Appends to commands what turns from into to:
+     *  - "-N" for the new chains,
+     *  - the rules of the new chains,
+     *  - "-D" and "-I" for the rules that differ in the existing chains,
+     *  - "-F" and "-X" for the removed chains.
+     * Rules that did not move are not touched, so their counters survive.
+     */
+    static void diff(const IptablesRuleSet &from, const IptablesRuleSet &to,
+                     std::list<Rule> &commands);
+
+private:
+    class Chain {
+    public:
+        Chain() : shared(false) {};
+        /*
+         * Other controllers add rules to it too: it is never created or deleted,
+         * and its rules are deleted by spec instead of by position.
+         */
+        bool shared;
+        std::vector<Rule> rules;
+    };
+    typedef std::map<std::string, Chain> ChainMap;
+
+    static void diffChain(const std::string &chainName, const Chain &from, const Chain &to,
+                          std::list<Rule> &commands);
+
+    typedef std::map<int, Rule>::const_iterator UidRuleIterator;
+
+    void addUidTreeLevel(const std::string &chain, const std::string &subChainPrefix,
+                         UidRuleIterator begin, UidRuleIterator end, int level);
+    static std::string makeCommand(const char *op, const std::string &chain, int pos,
+                                   const std::string &spec);
+
+    ChainMap chains;
+
+    /* UID range covered by one sub-chain at each level, widest first. */
+    static const unsigned int UID_TREE_WIDTHS[];
+    static const int UID_TREE_LEVELS;
+};
+
+#endif
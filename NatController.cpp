@@ -27,6 +27,7 @@
 #define LOG_TAG "NatController"
 #include <cutils/log.h>
 
+#include "IptablesRestoreController.h"
 #include "NatController.h"
 #include "SecondaryTableController.h"
 #include "oem_iptables_hook.h"
@@ -44,7 +45,8 @@ NatController::NatController(SecondaryTableController *ctrl) {
 NatController::~NatController() {
 }
 
-int NatController::runCmd(const char *path, const char *cmd) {
+int NatController::runCmd(const char *path, const char *cmd,
+                          IptablesRestoreController::IptFailureHandling failureHandling) {
     char *buffer;
     size_t len = strnlen(cmd, 255);
     int res;
@@ -55,6 +57,11 @@ int NatController::runCmd(const char *path, const char *cmd) {
         return -1;
     }
 
+    if (!strcmp(path, IPTABLES_PATH) && IptablesRestoreController::isEnabled()) {
+        return IptablesRestoreController::executeCommand(IptablesRestoreController::IptIpV4, cmd,
+                                                         failureHandling);
+    }
+
     asprintf(&buffer, "%s %s", path, cmd);
     res = system_nosh(buffer);
     free(buffer);
@@ -185,7 +192,8 @@ int NatController::setForwardRules(bool add, const char *intIface, const char *
              "-%s FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT",
              (add ? "A" : "D"),
              extIface, intIface);
-    if (runCmd(IPTABLES_PATH, cmd) && add) {
+    if (runCmd(IPTABLES_PATH, cmd, add ? IptablesRestoreController::IptFailureBad
+                                       : IptablesRestoreController::IptFailureOk) && add) {
         return -1;
     }
 
@@ -193,31 +201,33 @@ int NatController::setForwardRules(bool add, const char *intIface, const char *
             "-%s FORWARD -i %s -o %s -m state --state INVALID -j DROP",
             (add ? "A" : "D"),
             intIface, extIface);
-    if (runCmd(IPTABLES_PATH, cmd) && add) {
+    if (runCmd(IPTABLES_PATH, cmd, add ? IptablesRestoreController::IptFailureBad
+                                       : IptablesRestoreController::IptFailureOk) && add) {
         // bail on error, but only if adding
         snprintf(cmd, sizeof(cmd),
                 "-%s FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT",
                 (!add ? "A" : "D"),
                 extIface, intIface);
-        runCmd(IPTABLES_PATH, cmd);
+        runCmd(IPTABLES_PATH, cmd, IptablesRestoreController::IptFailureOk);
         return -1;
     }
 
     snprintf(cmd, sizeof(cmd), "-%s FORWARD -i %s -o %s -j ACCEPT", (add ? "A" : "D"),
             intIface, extIface);
-    if (runCmd(IPTABLES_PATH, cmd) && add) {
+    if (runCmd(IPTABLES_PATH, cmd, add ? IptablesRestoreController::IptFailureBad
+                                       : IptablesRestoreController::IptFailureOk) && add) {
         // unwind what's been done, but don't care about success - what more could we do?
         snprintf(cmd, sizeof(cmd),
                 "-%s FORWARD -i %s -o %s -m state --state INVALID -j DROP",
                 (!add ? "A" : "D"),
                 intIface, extIface);
-        runCmd(IPTABLES_PATH, cmd);
+        runCmd(IPTABLES_PATH, cmd, IptablesRestoreController::IptFailureOk);
 
         snprintf(cmd, sizeof(cmd),
                  "-%s FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT",
                  (!add ? "A" : "D"),
                  extIface, intIface);
-        runCmd(IPTABLES_PATH, cmd);
+        runCmd(IPTABLES_PATH, cmd, IptablesRestoreController::IptFailureOk);
         return -1;
     }
     return 0;
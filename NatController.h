@@ -21,6 +21,7 @@
 
 #include <utils/List.h>
 
+#include "IptablesRestoreController.h"
 #include "SecondaryTableController.h"
 
 class NatController {
@@ -37,7 +38,10 @@ private:
     SecondaryTableController *secondaryTableCtrl;
 
     int setDefaults();
-    int runCmd(const char *path, const char *cmd);
+    /* Teardown and unwind commands run with IptFailureOk. */
+    int runCmd(const char *path, const char *cmd,
+               IptablesRestoreController::IptFailureHandling failureHandling =
+                       IptablesRestoreController::IptFailureBad);
     bool checkInterface(const char *iface);
     int setForwardRules(bool set, const char *intIface, const char *extIface);
     const char *getVersion(const char *addr);
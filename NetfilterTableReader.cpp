@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// #define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+
+#define LOG_TAG "NetfilterTableReader"
+#include <cutils/log.h>
+
+#include "NetfilterTableReader.h"
+
+bool NetfilterTableReader::isAcceptTarget(const struct xt_entry_target *target) {
+    return !strcmp(target->u.user.name, XT_STANDARD_TARGET)
+            && ((const struct xt_standard_target *) target)->verdict == -NF_ACCEPT - 1;
+}
+
+unsigned int NetfilterTableReader::decodeEntry(const struct ipt_entry *entry,
+                                               RuleCounters &counters) {
+    const struct xt_entry_target *target =
+            (const struct xt_entry_target *) ((const char *) entry + entry->target_offset);
+
+    if (!(entry->ip.invflags & IPT_INV_VIA_IN)) {
+        counters.ifaceIn = entry->ip.iniface;
+    }
+    if (!(entry->ip.invflags & IPT_INV_VIA_OUT)) {
+        counters.ifaceOut = entry->ip.outiface;
+    }
+    counters.accept = !entry->ip.proto && !entry->ip.smsk.s_addr && !entry->ip.dmsk.s_addr
+            && isAcceptTarget(target);
+    counters.hasMatches = entry->target_offset > sizeof(*entry);
+    counters.packets = entry->counters.pcnt;
+    counters.bytes = entry->counters.bcnt;
+    return entry->next_offset;
+}
+
+unsigned int NetfilterTableReader::decodeEntry(const struct ip6t_entry *entry,
+                                               RuleCounters &counters) {
+    static const struct in6_addr anyMask = IN6ADDR_ANY_INIT;
+    const struct xt_entry_target *target =
+            (const struct xt_entry_target *) ((const char *) entry + entry->target_offset);
+
+    if (!(entry->ipv6.invflags & IP6T_INV_VIA_IN)) {
+        counters.ifaceIn = entry->ipv6.iniface;
+    }
+    if (!(entry->ipv6.invflags & IP6T_INV_VIA_OUT)) {
+        counters.ifaceOut = entry->ipv6.outiface;
+    }
+    counters.accept = !entry->ipv6.proto
+            && !memcmp(&entry->ipv6.smsk, &anyMask, sizeof(anyMask))
+            && !memcmp(&entry->ipv6.dmsk, &anyMask, sizeof(anyMask))
+            && isAcceptTarget(target);
+    counters.hasMatches = entry->target_offset > sizeof(*entry);
+    counters.packets = entry->counters.pcnt;
+    counters.bytes = entry->counters.bcnt;
+    return entry->next_offset;
+}
+
+struct ipt_get_entries *NetfilterTableReader::getEntries(int family, const char *table,
+                                                        struct ipt_getinfo &info) {
+    struct ipt_get_entries *entries;
+    int level = (family == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP;
+    int getInfo = (family == AF_INET6) ? IP6T_SO_GET_INFO : IPT_SO_GET_INFO;
+    int getEntries = (family == AF_INET6) ? IP6T_SO_GET_ENTRIES : IPT_SO_GET_ENTRIES;
+    socklen_t len;
+    int sock;
+
+    if (strlen(table) >= sizeof(info.name)) {
+        LOGE("Invalid table %s", table);
+        return NULL;
+    }
+
+    sock = socket(family, SOCK_RAW, IPPROTO_RAW);
+    if (sock < 0) {
+        LOGE("socket() failed (%s)", strerror(errno));
+        return NULL;
+    }
+
+    memset(&info, 0, sizeof(info));
+    strcpy(info.name, table);
+    len = sizeof(info);
+    if (getsockopt(sock, level, getInfo, &info, &len)) {
+        LOGE("Getting %s table info failed (%s)", table, strerror(errno));
+        close(sock);
+        return NULL;
+    }
+
+    len = sizeof(*entries) + info.size;
+    entries = (struct ipt_get_entries *) malloc(len);
+    if (!entries) {
+        close(sock);
+        return NULL;
+    }
+    memset(entries, 0, sizeof(*entries));
+    strcpy(entries->name, table);
+    entries->size = info.size;
+    if (getsockopt(sock, level, getEntries, entries, &len)) {
+        /* EAGAIN: the table was replaced between the two calls. */
+        LOGE("Getting %s table entries failed (%s)", table, strerror(errno));
+        free(entries);
+        entries = NULL;
+    }
+    close(sock);
+    return entries;
+}
+
+int NetfilterTableReader::readChain(int family, const char *table, unsigned int hook,
+                                    std::list<RuleCounters> &rules) {
+    struct ipt_getinfo info;
+    struct ipt_get_entries *entries;
+    unsigned int offset;
+    unsigned int nextOffset;
+    int res = -1;
+
+    if (hook >= NF_INET_NUMHOOKS) {
+        LOGE("Invalid chain %s/%u", table, hook);
+        return -1;
+    }
+
+    entries = getEntries(family, table, info);
+    if (!entries) {
+        return -1;
+    }
+    if (!(info.valid_hooks & (1 << hook))) {
+        LOGE("Table %s has no chain for hook %u", table, hook);
+        goto out;
+    }
+
+    /* A built-in chain runs from its hook entry up to its policy rule. */
+    for (offset = info.hook_entry[hook]; offset < info.underflow[hook]; offset += nextOffset) {
+        const char *entry = (const char *) entries->entrytable + offset;
+        RuleCounters counters;
+
+        if (family == AF_INET6) {
+            nextOffset = decodeEntry((const struct ip6t_entry *) entry, counters);
+        } else {
+            nextOffset = decodeEntry((const struct ipt_entry *) entry, counters);
+        }
+        if (!nextOffset || offset + nextOffset > info.size) {
+            LOGE("Corrupt %s table entry at %u", table, offset);
+            goto out;
+        }
+        LOGV("%s/%u@%u in=%s out=%s accept=%d pkts=%lld bytes=%lld", table, hook, offset,
+             counters.ifaceIn.c_str(), counters.ifaceOut.c_str(), counters.accept,
+             counters.packets, counters.bytes);
+        rules.push_back(counters);
+    }
+    res = 0;
+
+out:
+    free(entries);
+    return res;
+}
+
+unsigned int NetfilterTableReader::getEntryTarget(int family, const char *entry,
+                                                  const struct xt_entry_target **target) {
+    if (family == AF_INET6) {
+        const struct ip6t_entry *entry6 = (const struct ip6t_entry *) entry;
+        *target = (const struct xt_entry_target *) (entry + entry6->target_offset);
+        return entry6->next_offset;
+    }
+    const struct ipt_entry *entry4 = (const struct ipt_entry *) entry;
+    *target = (const struct xt_entry_target *) (entry + entry4->target_offset);
+    return entry4->next_offset;
+}
+
+void NetfilterTableReader::getEntryQuotaNames(int family, const char *entry,
+                                              const struct xt_entry_target *target,
+                                              std::list<std::string> &names) {
+    /* xt_quota_mtinfo2 starts with its char name[XT_QUOTA_COUNTER_NAME_LENGTH]. */
+    static const size_t QUOTA2_NAME_LEN = 15;
+    const char *match = entry + ((family == AF_INET6) ? sizeof(struct ip6t_entry)
+                                                      : sizeof(struct ipt_entry));
+    const struct xt_entry_match *m;
+
+    for (; match < (const char *) target; match += m->u.match_size) {
+        m = (const struct xt_entry_match *) match;
+        if (m->u.match_size < sizeof(*m)) {
+            return;
+        }
+        if (!strcmp(m->u.user.name, "quota2")
+                && m->u.match_size >= sizeof(*m) + QUOTA2_NAME_LEN) {
+            names.push_back(std::string((const char *) m->data,
+                                        strnlen((const char *) m->data, QUOTA2_NAME_LEN)));
+        }
+    }
+}
+
+int NetfilterTableReader::readChainSizes(int family, const char *table,
+                                         std::map<std::string, int> &ruleCounts) {
+    std::map<std::string, std::list<std::string> > quotaNames;
+
+    return readChainSizes(family, table, ruleCounts, quotaNames);
+}
+
+int NetfilterTableReader::readChainSizes(int family, const char *table,
+                                         std::map<std::string, int> &ruleCounts,
+                                         std::map<std::string, std::list<std::string> > &quotaNames) {
+    static const char *hookNames[NF_INET_NUMHOOKS] = {
+        "PREROUTING", "INPUT", "FORWARD", "OUTPUT", "POSTROUTING"
+    };
+    const struct xt_entry_target *target;
+    struct ipt_getinfo info;
+    struct ipt_get_entries *entries;
+    std::map<std::string, int>::iterator it;
+    std::string chainName;
+    unsigned int offset;
+    unsigned int nextOffset;
+    unsigned int hook;
+    int res = -1;
+
+    entries = getEntries(family, table, info);
+    if (!entries) {
+        return -1;
+    }
+
+    /*
+     * Chains are laid out one after the other: a built-in one starts at its
+     * hook entry, a user one with an ERROR target entry holding its name.
+     * Both end with one more entry, the policy or the RETURN.
+     */
+    for (offset = 0; offset < info.size; offset += nextOffset) {
+        const char *entry = (const char *) entries->entrytable + offset;
+
+        nextOffset = getEntryTarget(family, entry, &target);
+        if (!nextOffset || offset + nextOffset > info.size) {
+            LOGE("Corrupt %s table entry at %u", table, offset);
+            goto out;
+        }
+        for (hook = 0; hook < NF_INET_NUMHOOKS; hook++) {
+            if ((info.valid_hooks & (1 << hook)) && info.hook_entry[hook] == offset)
+                break;
+        }
+        if (hook < NF_INET_NUMHOOKS) {
+            chainName = hookNames[hook];
+        } else if (!strcmp(target->u.user.name, XT_ERROR_TARGET)) {
+            /* The last one only marks the end of the table. */
+            chainName = (const char *) target->data;
+            continue;
+        }
+        ruleCounts[chainName]++;
+        getEntryQuotaNames(family, entry, target, quotaNames[chainName]);
+    }
+    ruleCounts.erase(XT_ERROR_TARGET);
+    quotaNames.erase(XT_ERROR_TARGET);
+    for (it = ruleCounts.begin(); it != ruleCounts.end(); it++) {
+        it->second--;
+    }
+    res = 0;
+
+out:
+    free(entries);
+    return res;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NETFILTER_TABLE_READER_H
+#define _NETFILTER_TABLE_READER_H
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+struct ipt_entry;
+struct ipt_getinfo;
+struct ipt_get_entries;
+struct ip6t_entry;
+struct xt_entry_target;
+
+/*
+ * Reads rule counters straight from the kernel's ipv4 and ipv6 tables with
+ * getsockopt(IPT_SO_GET_ENTRIES / IP6T_SO_GET_ENTRIES), without running
+ * iptables.
+ */
+class NetfilterTableReader {
+public:
+    class RuleCounters {
+    public:
+        RuleCounters(void) : accept(false), hasMatches(false), packets(0), bytes(0) {};
+        std::string ifaceIn;   /* "" if the rule matches any input iface */
+        std::string ifaceOut;  /* "" if the rule matches any output iface */
+        /* Plain "-j ACCEPT" rule on all protocols and addresses, any matches. */
+        bool accept;
+        bool hasMatches;       /* has -m matches, e.g. "-m state" */
+        int64_t packets;
+        int64_t bytes;
+    };
+
+    /*
+     * Appends the counters of the rules of a built-in chain (NF_INET_* hook)
+     * of the AF_INET or AF_INET6 table, in rule order. Needs CAP_NET_ADMIN.
+     * Returns 0 on success.
+     */
+    static int readChain(int family, const char *table, unsigned int hook,
+                         std::list<RuleCounters> &rules);
+
+    /*
+     * Gets the number of rules of every chain of the table, built-in
+     * (by the iptables name, e.g. "INPUT") and user defined alike.
+     * Returns 0 on success.
+     */
+    static int readChainSizes(int family, const char *table,
+                              std::map<std::string, int> &ruleCounts);
+    /*
+     * Same, and also appends to quotaNames[chain] the counter name of each
+     * quota2 match of the chain, in rule order.
+     */
+    static int readChainSizes(int family, const char *table,
+                              std::map<std::string, int> &ruleCounts,
+                              std::map<std::string, std::list<std::string> > &quotaNames);
+
+private:
+    /*
+     * Fetches the whole table into a malloc()'ed buffer the caller frees,
+     * ip6t_getinfo/ip6t_get_entries have the same layout as the ipv4 ones.
+     */
+    static struct ipt_get_entries *getEntries(int family, const char *table,
+                                              struct ipt_getinfo &info);
+    /* Returns the entry's next_offset. */
+    static unsigned int getEntryTarget(int family, const char *entry,
+                                       const struct xt_entry_target **target);
+    /* Appends the names of the entry's quota2 matches. */
+    static void getEntryQuotaNames(int family, const char *entry,
+                                   const struct xt_entry_target *target,
+                                   std::list<std::string> &names);
+
+    /* Both return the entry's next_offset. */
+    static unsigned int decodeEntry(const struct ipt_entry *entry, RuleCounters &counters);
+    static unsigned int decodeEntry(const struct ip6t_entry *entry, RuleCounters &counters);
+    static bool isAcceptTarget(const struct xt_entry_target *target);
+};
+
+#endif
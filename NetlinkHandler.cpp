@@ -26,6 +26,7 @@
 #include <sysutils/NetlinkEvent.h>
 #include "NetlinkHandler.h"
 #include "NetlinkManager.h"
+#include "OEMListener.h"
 #include "ResponseCode.h"
 
 NetlinkHandler::NetlinkHandler(NetlinkManager *nm, int listenerSocket,
@@ -72,6 +73,7 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
         const char *alertName = evt->findParam("ALERT_NAME");
         const char *iface = evt->findParam("INTERFACE");
         notifyQuotaLimitReached(alertName, iface);
+        OEMListener::notifyQuotaEvent(alertName);
     }
 
 }
@@ -22,15 +22,16 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <cstdlib>
+#include <sys/inotify.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <cstdio>
 #include <fstream>
 #include <resolv.h>
 #include <unistd.h>
 #include <sys/time.h>
-#include <curl/curl.h>
 #include <zlib.h>
 #include <set>
 #include <map>
@@ -44,96 +45,28 @@
 
 extern "C" int system_nosh ( const char *command );
 
+#include "ConfigData.h"
+#include "CounterSampler.h"
+#include "IptablesRestoreController.h"
+#include "NetfilterTableReader.h"
 #include "OEMListener.h"
+#include "SyncClient.h"
 
 extern "C"
 {
-    static const char cd64[]="|$$$}rstuvwxyz{$$$$$$$>?@ABCDEFGHIJKLMNOPQRSTUVW$$$$$$XYZ[\\]^_`abcdefghijklmnopq";
-
-    static char *cfgoutbuffer = NULL;
-    static void decodeblock ( unsigned char *in, unsigned char *out )
-    {
-        out[ 0 ] = ( unsigned char ) ( in[0] << 2 | in[1] >> 4 );
-        out[ 1 ] = ( unsigned char ) ( in[1] << 4 | in[2] >> 2 );
-        out[ 2 ] = ( unsigned char ) ( ( ( in[2] << 6 ) & 0xc0 ) | in[3] );
-    }
-
-    static int decode ( FILE *infile )
-    {
-        int retcode = 0;
-        unsigned char in[4];
-        unsigned char out[3];
-        int v;
-        int i, len;
-
-        *in = ( unsigned char ) 0;
-        *out = ( unsigned char ) 0;
-        while ( feof ( infile ) == 0 )
-        {
-            for ( len = 0, i = 0; i < 4 && feof ( infile ) == 0; i++ )
-            {
-                v = 0;
-                while ( feof ( infile ) == 0 && v == 0 )
-                {
-                    v = getc ( infile );
-                    if ( v != EOF )
-                    {
-                        v = ( ( v < 43 || v > 122 ) ? 0 : ( int ) cd64[ v - 43 ] );
-                        if ( v != 0 )
-                        {
-                            v = ( ( v == ( int ) '$' ) ? 0 : v - 61 );
-                        }
-                    }
-                }
-                if ( feof ( infile ) == 0 )
-                {
-                    len++;
-                    if ( v != 0 )
-                    {
-                        in[ i ] = ( unsigned char ) ( v - 1 );
-                    }
-                }
-                else
-                {
-                    in[i] = ( unsigned char ) 0;
-                }
-            }
-            if ( len > 0 )
-            {
-                decodeblock ( in, out );
-                for ( i = 0; i < len - 1; i++ )
-                {
-                    char * tmpout = NULL;
-                    if ( cfgoutbuffer != NULL )
-                    {
-                        asprintf ( &tmpout, "%s", cfgoutbuffer );
-                        free ( cfgoutbuffer );
-                        cfgoutbuffer = NULL;
-
-                        asprintf ( &cfgoutbuffer, "%s%c", tmpout, out[i] );
-                        free ( tmpout );
-                        tmpout = NULL;
-                    }
-                    else
-                    {
-                        asprintf ( &cfgoutbuffer, "%c", out[i] );
-                    }
-                }
-            }
-        }
-
-        return ( retcode );
-    }
-
-    struct MemoryStruct
-    {
-        char *memory;
-        size_t size;
-    };
-
     pthread_mutex_t count_mutex     = PTHREAD_MUTEX_INITIALIZER;
     pthread_cond_t  condition_var   = PTHREAD_COND_INITIALIZER;
 
+    // orders the qtareg writes, taken before count_mutex
+    pthread_mutex_t qtareg_mutex    = PTHREAD_MUTEX_INITIALIZER;
+
+    // wakes CountFunction() early, quota_event is set on a p30_<gid> nflog alert,
+    // tables_flushed when BandwidthController flushed the p30 chains
+    pthread_mutex_t sample_mutex    = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t  sample_cond     = PTHREAD_COND_INITIALIZER;
+    static bool quota_event = false;
+    static bool tables_flushed = false;
+
 
     void* pthread_forward ( void* obj )
     {
@@ -151,33 +84,32 @@ extern "C"
         return 0;
     }
 
-    size_t WriteMemoryCallback ( void *contents, size_t size, size_t nmemb, void *userp )
+    void* pthread_forward_pckg ( void* obj )
     {
-        size_t realsize = size * nmemb;
-        struct MemoryStruct *mem = ( struct MemoryStruct * ) userp;
-
-        mem->memory = ( char* ) realloc ( mem->memory, mem->size + realsize + 1 );
-        if ( mem->memory == NULL )
-        {
-            /* out of memory! */
-            LOGE ( " ## ## %s , not enough memory (realloc returned NULL)", __func__ );
-            return 0;
-        }
-
-        memcpy ( & ( mem->memory[mem->size] ), contents, realsize );
-        mem->size += realsize;
-        mem->memory[mem->size] = 0;
-
-        return realsize;
+        OEMListener* oemObj = reinterpret_cast<OEMListener*> ( obj );
+        oemObj->PckgWatchFunction();
+        pthread_exit ( NULL );
+        return 0;
     }
 }
 
 const char OEMListener::INTERFACE[] = "ppp0";
 const char OEMListener::IPTABLES_PATH[] = "/system/bin/iptables";
 const char OEMListener::IP6TABLES_PATH[] = "/system/bin/ip6tables";
-
-
-OEMListener::OEMListener() :stopFuncs ( false ), prvUzlibdStr ( "" )
+const char OEMListener::QTAREG_PATH[] = "/data/system/qtareg";
+const char OEMListener::CONFIGDATA_PATH[] = "/system/etc/configdata";
+const char OEMListener::SYNC_URL[] = "https://support.datawind-s.com/datausage/dataconfig.jsp";
+const char OEMListener::SYNC_ETAG_PATH[] = "/data/system/qtareg.etag";
+const char OEMListener::PCKGLST_DIR[] = "/data/system";
+const char OEMListener::PCKGLST_NAME[] = "packages.list";
+const int OEMListener::PCKGLST_SETTLE_MS = 1000;
+const int OEMListener::PCKGLST_POLL_MS = 5000;
+const int OEMListener::COUNT_MIN_DELAY_MS = 5000;
+const int OEMListener::COUNT_DELAY_MS = 120000;
+const int OEMListener::COUNT_IDLE_DELAY_MS = 900000;
+
+
+OEMListener::OEMListener() :stopFuncs ( false ), mNoRestrict ( false ), mRulesReady ( false ), mRulesStale ( false ), mQtaJournal ( QTAREG_PATH )
 {
     int srvrRet;
     if ( ( srvrRet = pthread_create ( &mSrvrThread, NULL, pthread_forward, this ) ) )
@@ -191,70 +123,12 @@ OEMListener::OEMListener() :stopFuncs ( false ), prvUzlibdStr ( "" )
         LOGE ( " ## ## OEMListener ctor: Thread creation failed: %d", srvrRet );
         return;
     }
-}
-
-int OEMListener::defStr ( std::string srcStr, FILE *dest )
-{
-    int ret, flush;
-    unsigned have;
-    z_stream strm;
-    unsigned char in[1024];
-    unsigned char out[1024];
-
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit ( &strm, Z_BEST_COMPRESSION );
-    if ( ret != Z_OK )
-        return ret;
-
-    uInt rstOfStr = srcStr.size();
-    char * srcStrPtr = const_cast<char*> ( srcStr.data() );
-    /* compress until end of file */
-    do
-    {
-        strm.avail_in = rstOfStr > 1024 ? 1024: rstOfStr;
-        memcpy ( in, srcStrPtr, strm.avail_in );
-        srcStrPtr += strm.avail_in;
-        rstOfStr -= strm.avail_in;
-
-        flush = ( strm.avail_in == 0 ) ? Z_FINISH : Z_NO_FLUSH;
-        strm.next_in = in;
-
-        /* run deflate() on input until output buffer not full, finish
-         *          compression if all of source has been read in */
-        do
-        {
-            strm.avail_out = 1024;
-            strm.next_out = out;
-            ret = deflate ( &strm, flush ); /* no bad return value */
-            if ( ret == Z_STREAM_ERROR ) /* state not clobbered */
-            {
-                LOGE ( " ## ## %s , state clobbered Z_STREAM_ERROR" , __func__ );
-                return Z_STREAM_ERROR;
-            }
-            have = 1024 - strm.avail_out;
-            if ( fwrite ( out, 1, have, dest ) != have || ferror ( dest ) )
-            {
-                ( void ) deflateEnd ( &strm );
-                return Z_ERRNO;
-            }
-        }
-        while ( strm.avail_out == 0 );
 
-        /* done when last data in file processed */
-    }
-    while ( flush != Z_FINISH );
-    if ( ret != Z_STREAM_END )
+    if ( ( srvrRet = pthread_create ( &mPckgThread, NULL, pthread_forward_pckg, this ) ) )
     {
-        LOGE ( " ## ## %s , state clobbered Z_STREAM_END" , __func__ );
-        return Z_STREAM_END;
+        LOGE ( " ## ## OEMListener ctor: Thread creation failed: %d", srvrRet );
+        return;
     }
-
-    /* clean up and return */
-    ( void ) deflateEnd ( &strm );
-    return Z_OK;
 }
 
 std::string OEMListener::DeflateString ( const std::string& str )
@@ -303,24 +177,271 @@ std::string OEMListener::DeflateString ( const std::string& str )
     return outstring;
 }
 
+int OEMListener::singleIpCmd ( bool isIpv6, std::string cmd )
+{
+    if ( IptablesRestoreController::isEnabled() )
+    {
+        return IptablesRestoreController::executeCommand ( isIpv6 ? IptablesRestoreController::IptIpV6 : IptablesRestoreController::IptIpV4, cmd );
+    }
+
+    std::string fullCmd;
+    fullCmd.append ( isIpv6 ? IP6TABLES_PATH : IPTABLES_PATH );
+    fullCmd.append ( cmd );
+    return system_nosh ( fullCmd.c_str() );
+}
+
 int OEMListener::commonIpCmd ( std:: string cmd )
 {
-    int reslt;
-    std::string fullCmd4, fullCmd6;
+    // iptables w ip6tables ma3an
+    return IptablesRestoreController::executeCommandBoth ( cmd, cmd );
+}
 
-    fullCmd4.clear();
-    fullCmd4.append ( IPTABLES_PATH );
-    fullCmd4.append ( cmd );
-    reslt = system_nosh ( fullCmd4.c_str() );
+int OEMListener::renderRules ( IptablesRuleSet& rules, std::map<unsigned int, unsigned long long>& grpQtas,
+                               const std::map<unsigned int, unsigned long long>& fromGrpQtas )
+{
+    int reslt = 0;
+    char *tmpStro = NULL;
+
+    // p30dw is created by BandwidthController, we only own its rules
+    rules.clear();
+    reslt |= rules.apply ( "-N p30dw", false );
+
+    reslt |= rules.apply ( "-N p30_1000", false );
+    reslt |= rules.apply ( "-A p30_1000 -m quota2 ! --quota 102400 --name p30_1000", true );
+    reslt |= rules.apply ( "-A p30_1000 --jump ACCEPT", false );
+
+    if ( mNoRestrict )
+    {
+        reslt |= rules.apply ( "-A p30dw --jump ACCEPT", false );
+        return reslt;
+    }
+
+    // the last registered package of a shared uid wins, like the old -I p30dw 1
+    std::list<unsigned int> uids;
+    std::map<unsigned int, unsigned int> uidGids;
+    regPckgObjReg.getUids ( uids );
+    for ( std::list<unsigned int>::iterator it = uids.begin(); it != uids.end(); ++it )
+    {
+        const PckgObj *pckg = regPckgObjReg.findUid ( *it );
+        if ( *it == 0 || pckg->gid == 0 || pckg->gid == 1000 )
+            continue;
+        uidGids[*it] = pckg->gid;
+
+        if ( grpQtas.find ( pckg->gid ) != grpQtas.end() )
+            continue;
+
+        // a live group keeps its rule, the sampled clq lags its counter
+        std::map<unsigned int, unsigned long long>::const_iterator fromIt = fromGrpQtas.find ( pckg->gid );
+        if ( fromIt != fromGrpQtas.end() && mNewQtaGids.find ( pckg->gid ) == mNewQtaGids.end() )
+            grpQtas[pckg->gid] = fromIt->second;
+        // the group quota is the one of the package whose uid names the group
+        else
+            grpQtas[pckg->gid] = ( regPckgObjReg.findGroupOwner ( pckg->gid )->clq<<10 );
+    }
+
+    for ( std::map<unsigned int, unsigned long long>::iterator it = grpQtas.begin(); it != grpQtas.end(); ++it )
+    {
+        asprintf ( &tmpStro, "-N p30_%u", it->first );
+        reslt |= rules.apply ( tmpStro, false );
+        free ( tmpStro );
+
+        asprintf ( &tmpStro, "-A p30_%u -m quota2 ! --quota %llu --name p30_%u", it->first, it->second, it->first );
+        reslt |= rules.apply ( tmpStro, true );
+        free ( tmpStro );
+
+        asprintf ( &tmpStro, "-A p30_%u --jump ACCEPT", it->first );
+        reslt |= rules.apply ( tmpStro, false );
+        free ( tmpStro );
+    }
+    tmpStro = NULL;
+
+    std::map<int, IptablesRuleSet::Rule> uidRules;
+    for ( std::map<unsigned int, unsigned int>::iterator it = uidGids.begin(); it != uidGids.end(); ++it )
+    {
+        asprintf ( &tmpStro, "-m owner --uid-owner %u --jump p30_%u", it->first, it->second );
+        uidRules.insert ( std::make_pair ( ( int ) it->first, IptablesRuleSet::Rule ( tmpStro, false ) ) );
+        free ( tmpStro );
+        tmpStro = NULL;
+    }
+
+    for ( std::set<unsigned int>::iterator it = mSysUidSet.begin(); it != mSysUidSet.end(); ++it )
+    {
+        asprintf ( &tmpStro, "-m owner --uid-owner %u --jump p30_1000", *it );
+        uidRules.insert ( std::make_pair ( ( int ) *it, IptablesRuleSet::Rule ( tmpStro, false ) ) );
+        free ( tmpStro );
+        tmpStro = NULL;
+    }
+
+    // p30uid dispatches on --uid-owner ranges, unknown uids come back to p30dw
+    reslt |= rules.apply ( "-N p30uid", false );
+    reslt |= rules.setUidTree ( "p30uid", "p30uid", uidRules );
+    reslt |= rules.apply ( "-A p30dw --jump p30uid", false );
+
+    reslt |= rules.apply ( "-A p30dw -p udp --sport 53 -j ACCEPT", false );
+    reslt |= rules.apply ( "-A p30dw -p udp --dport 53 -j ACCEPT", false );
+    reslt |= rules.apply ( "-A p30dw", true );
+
+    return reslt;
+}
+
+int OEMListener::getRstCmds ( int family, std::list<std::string>& rstCmds )
+{
+    std::map<std::string, int> chainSizes;
+
+    if ( NetfilterTableReader::readChainSizes ( family, "filter", chainSizes ) )
+    {
+        LOGE ( " ## ## %s , failed to read the filter table" , __func__ );
+        return -1;
+    }
+
+    rstCmds.push_back ( "-F p30dw" );
+    for ( std::map<std::string, int>::iterator it = chainSizes.begin(); it != chainSizes.end(); ++it )
+    {
+        if ( it->first.compare ( 0, 3, "p30" ) == 0 && it->first != "p30dw" )
+            rstCmds.push_back ( "-F " + it->first );
+    }
+    for ( std::map<std::string, int>::iterator it = chainSizes.begin(); it != chainSizes.end(); ++it )
+    {
+        if ( it->first.compare ( 0, 3, "p30" ) == 0 && it->first != "p30dw" )
+            rstCmds.push_back ( "-X " + it->first );
+    }
+
+    return 0;
+}
+
+int OEMListener::runRuleChanges ( std::list<std::string>& v4Cmds, std::list<std::string>& v6Cmds,
+                                  const std::list<IptablesRuleSet::Rule>& changes )
+{
+    int reslt = 0;
+
+    if ( IptablesRestoreController::isEnabled() )
+    {
+        for ( std::list<IptablesRuleSet::Rule>::const_iterator it = changes.begin(); it != changes.end(); ++it )
+        {
+            v4Cmds.push_back ( it->command ( false ) );
+            v6Cmds.push_back ( it->command ( true ) );
+        }
+
+        if ( v4Cmds.empty() && v6Cmds.empty() )
+            return 0;
+
+        return IptablesRestoreController::executeBoth ( IptablesRestoreController::makeRestoreRules ( v4Cmds ),
+                IptablesRestoreController::makeRestoreRules ( v6Cmds ) );
+    }
+
+    // without iptables-restore the reset commands are allowed to fail
+    for ( std::list<std::string>::iterator it = v4Cmds.begin(); it != v4Cmds.end(); ++it )
+        singleIpCmd ( false, " " + *it );
+    for ( std::list<std::string>::iterator it = v6Cmds.begin(); it != v6Cmds.end(); ++it )
+        singleIpCmd ( true, " " + *it );
+
+    for ( std::list<IptablesRuleSet::Rule>::const_iterator it = changes.begin(); it != changes.end(); ++it )
+    {
+        reslt = IptablesRestoreController::executeCommandBoth ( it->command ( false ), it->command ( true ) );
+        if ( reslt )
+        {
+            LOGE ( " ## ## %s , failed %s, rules partially committed" , __func__, it->spec.c_str() );
+            break;
+        }
+    }
+
+    return reslt;
+}
+
+int OEMListener::setGrpQuota ( unsigned int gid, unsigned long long bytes )
+{
+    FILE *fp = NULL;
+    char *fname = NULL;
+    int reslt = 0;
 
-    fullCmd6.clear();
-    fullCmd6.append ( IP6TABLES_PATH );
-    fullCmd6.append ( cmd );
-    reslt = system_nosh ( fullCmd6.c_str() );
+    asprintf ( &fname, "/proc/net/xt_quota/p30_%u", gid );
+    fp = fopen ( fname, "w" );
+    if ( fname )
+        free ( fname );
+    fname = NULL;
+
+    if ( fp == NULL )
+    {
+        LOGE ( " ## ## %s , no quota p30_%u err=%s", __func__, gid, strerror ( errno ) );
+        return -1;
+    }
+
+    if ( fprintf ( fp, "%llu\n", bytes ) < 0 )
+        reslt = -1;
+    if ( fclose ( fp ) != 0 )
+        reslt = -1;
 
     return reslt;
 }
 
+int OEMListener::applyRules ( bool reset )
+{
+    IptablesRuleSet rules;
+    IptablesRuleSet fromRules;
+    std::map<unsigned int, unsigned long long> grpQtas;
+    std::map<unsigned int, unsigned long long> fromGrpQtas;
+    std::list<IptablesRuleSet::Rule> changes;
+    std::list<std::string> v4Cmds, v6Cmds;
+    int reslt = 0;
+
+    if ( mRulesStale )
+        reset = true;
+
+    if ( reset )
+    {
+        reslt |= getRstCmds ( AF_INET, v4Cmds );
+        reslt |= getRstCmds ( AF_INET6, v6Cmds );
+        if ( reslt != 0 )
+        {
+            mRulesStale = true;
+            return reslt;
+        }
+        fromRules.apply ( "-N p30dw", false );
+    }
+    else
+    {
+        fromRules = committedRules;
+        fromGrpQtas = committedGrpQtas;
+    }
+
+    reslt = renderRules ( rules, grpQtas, fromGrpQtas );
+    if ( reslt != 0 )
+    {
+        LOGE ( " ## ## %s , failed to render the p30 rules" , __func__ );
+        return reslt;
+    }
+
+    IptablesRuleSet::diff ( fromRules, rules, changes );
+    LOGD ( " -- -- %s , %d rule changes", __func__, ( int ) changes.size() );
+
+    reslt = runRuleChanges ( v4Cmds, v6Cmds, changes );
+    if ( reslt != 0 )
+    {
+        LOGE ( " ## ## %s , failed to commit %d rule changes" , __func__, ( int ) changes.size() );
+        // the kernel no longer holds committedRules, rebuild the p30 chains from scratch
+        mRulesStale = true;
+        if ( !reset )
+            return applyRules ( true );
+        return reslt;
+    }
+    mRulesStale = false;
+    committedRules = rules;
+    committedGrpQtas = grpQtas;
+    mNewQtaGids.clear();
+    CounterSampler::notifyQuotasChanged();
+
+    // a counter that outlived its rule in the transaction keeps its old value,
+    // only the new groups and the quotas the server changed are restarted
+    for ( std::map<unsigned int, unsigned long long>::iterator it = grpQtas.begin(); it != grpQtas.end(); ++it )
+    {
+        std::map<unsigned int, unsigned long long>::iterator fromIt = fromGrpQtas.find ( it->first );
+        if ( reset || fromIt == fromGrpQtas.end() || fromIt->second != it->second )
+            setGrpQuota ( it->first, it->second );
+    }
+
+    return 0;
+}
+
 int OEMListener::infStr ( FILE *source, std::string& rtrnStr )
 {
     int ret;
@@ -386,125 +507,538 @@ int OEMListener::infStr ( FILE *source, std::string& rtrnStr )
 }
 
 
-void OEMListener::CountFunction()
+int OEMListener::readOldQtaReg ( std::list<PckgObj>& pckgLst )
 {
-    pthread_mutex_lock ( &count_mutex );
-    pthread_cond_wait ( &condition_var, &count_mutex );
-    usleep ( 50000000 );
-    pthread_mutex_unlock ( &count_mutex );
-
-
-    while ( !stopFuncs )
+    FILE * pQtaRegFile;
+    pQtaRegFile = fopen ( QTAREG_PATH , "rb" );
+    if ( pQtaRegFile == NULL )
+        return -1;
+
+    // "package uid gid clq," records deflated by older builds
+    std::string tmpDestStro;
+    int ret = infStr ( pQtaRegFile, tmpDestStro );
+    fclose ( pQtaRegFile );
+    if ( ret != Z_OK )
     {
-        std::string tmpUzlibdStr;
-        pthread_mutex_lock ( &count_mutex );
+        LOGE ( " ## ## %s , zlib error", __func__ );
+        return -1;
+    }
 
-        for ( std::list<PckgObj>::iterator it = regPckgObjLst.begin(); it != regPckgObjLst.end(); ++it )
+    size_t foundn = tmpDestStro.find ( "," );
+    while ( foundn != std::string::npos )
+    {
+        std::string line;
+        line.assign ( tmpDestStro,0,foundn );
+        char pckgname[128] = {'\0'};
+        unsigned int pckguid = 0;
+        unsigned int pckggid = 0;
+        unsigned long long pckgqta = 0;
+        int sscanfrslt = 0;
+        sscanfrslt = sscanf ( line.c_str(),"%127s %u %u %llu", pckgname, &pckguid, &pckggid, &pckgqta );
+        if ( sscanfrslt == 4 )
         {
-            // have prv quota
-            FILE *fp = NULL;
-            char *fname = NULL;
-            int rslt = 0;
-
-            asprintf ( &fname, "/proc/net/xt_quota/p30_%u", it->gid );
-            fp = fopen ( fname, "r" );
-            if ( fname )
-                free ( fname );
-            fname = NULL;
+            pckgLst.push_back ( PckgObj ( pckgname, pckguid, pckggid, pckgqta ) );
+        }
 
-            if ( fp != NULL )
-            {
-                unsigned long long tmpClq = 0;
-                rslt = fscanf ( fp, "%llu", &tmpClq );
-                fclose ( fp );
+        line.assign ( tmpDestStro, foundn +1 , tmpDestStro.size() - line.size() - 1 );
+        tmpDestStro.assign ( line );
+        foundn = tmpDestStro.find ( "," );
+    }
 
-                it->clq = ( tmpClq>>10 );
+    return 0;
+}
 
-                char * tmpStr = NULL;
-                asprintf ( &tmpStr,"%s %u %u %llu,", it->package.c_str(), it->uid, it->gid, it->clq );
-                tmpUzlibdStr.append ( tmpStr );
-                if ( tmpStr )
-                    free ( tmpStr );
-                tmpStr = NULL;
+int OEMListener::applyPolicyDelta ( const PolicyDelta& delta )
+{
+    if ( delta.action == PolicyDelta::NO_RESTRICT )
+    {
+        regPckgObjReg.clear();
+        mNoRestrict = true;
+        return applyRules ( false );
+    }
 
-            }
-            else
-            {
-                char * tmpStr = NULL;
-                asprintf ( &tmpStr,"%s %u %u %llu,", it->package.c_str(), it->uid, it->gid, it->clq );
-                tmpUzlibdStr.append ( tmpStr );
-                if ( tmpStr )
-                    free ( tmpStr );
-                tmpStr = NULL;
-            }
+    if ( delta.action == PolicyDelta::NEW )
+    {
+        /// remove previous data
+        for ( PckgRegistry::const_iterator it = regPckgObjReg.begin(); it != regPckgObjReg.end(); ++it )
+        {
+            LOGD ( " -- -- -- %s:%d -- package:%s, uid:%u, gid:%u, clq:%llu", __func__, __LINE__, it->package.c_str(), it->uid, it->gid, it->clq );
         }
+        regPckgObjReg.clear();
+        mNoRestrict = false;
+    }
 
-        pthread_mutex_unlock ( &count_mutex );
+    for ( std::list<PolicyDelta::Group>::const_iterator grpIt = delta.groups.begin(); grpIt != delta.groups.end(); ++grpIt )
+    {
+        if ( delta.action == PolicyDelta::REMOVE )
+        {
+            for ( std::vector<StrSpan>::const_iterator it = grpIt->packages.begin(); it != grpIt->packages.end(); ++it )
+                regPckgObjReg.remove ( it->str() );
+            continue;
+        }
 
-        if ( ( !tmpUzlibdStr.empty() ) && ( prvUzlibdStr.compare ( tmpUzlibdStr ) !=  0 ) )
+        // the group is named by the uid of its last installed package
+        std::list<PckgObj> pckgGrpLst;
+        unsigned int groupid = 0;
+        for ( std::vector<StrSpan>::const_iterator it = grpIt->packages.begin(); it != grpIt->packages.end(); ++it )
         {
-            prvUzlibdStr.assign ( tmpUzlibdStr );
-            FILE * pQtaRegFile;
-            pQtaRegFile = fopen ( "/data/system/qtareg" , "wb" );
-            if ( pQtaRegFile != NULL )
+            PckgObj tmpPckgObj ( it->str(), 0, 0, grpIt->clq );
+            const PckgObj *instPckg = mPckgObjReg.find ( tmpPckgObj.package );
+            if ( instPckg != NULL )
             {
-                int ret = defStr ( tmpUzlibdStr, pQtaRegFile );
-                if ( ret != Z_OK )
-                    LOGE ( " ## ## %s , zlib error", __func__ );
-                fclose ( pQtaRegFile );
+                tmpPckgObj.uid = instPckg->uid;
+                groupid = instPckg->uid;
             }
+            pckgGrpLst.push_back ( tmpPckgObj );
         }
 
-        usleep ( 120000000 );
+        // the server (re)set the quota of this group
+        if ( groupid != 0 )
+            mNewQtaGids.insert ( groupid );
+
+        for ( std::list<PckgObj>::iterator it = pckgGrpLst.begin(); it != pckgGrpLst.end(); ++it )
+        {
+            it->gid = groupid;
+            LOGD ( " -- -- -- %s:%d -- package:%s, uid:%u, gid:%u, clq:%llu", __func__, __LINE__, it->package.c_str(), it->uid, it->gid, it->clq );
+            regPckgObjReg.add ( *it );
+        }
     }
 
+    return applyRules ( false );
 }
 
-std::string OEMListener::urlEncode ( std::string regstr )
+int OEMListener::readPckgLst ( PckgRegistry& pckgs, std::set<unsigned int>& sysUids )
 {
-    std::string tmpStr;
-    for ( std::string::iterator it=regstr.begin(); it!=regstr.end(); ++it )
+    std::string path ( PCKGLST_DIR );
+    path.append ( "/" );
+    path.append ( PCKGLST_NAME );
+
+    FILE * pPckglstFile;
+    pPckglstFile = fopen ( path.c_str() , "r" );
+    if ( pPckglstFile == NULL )
+        return -1;
+
+    char tmpline[512];
+    bool found_andrdgst = false;
+    bool found_infogst = false;
+    while ( fgets ( tmpline, sizeof ( tmpline ), pPckglstFile ) )
     {
-        if ( mRsrvdUrl.find ( *it ) != mRsrvdUrl.end() )
+        char pckgname[128] = {'\0'};
+        unsigned int pckguid = 0;
+        int sscanfrslt = 0;
+        sscanfrslt = sscanf ( tmpline,"%127s %u", pckgname, &pckguid );
+        if ( sscanfrslt != 2 )
+            continue;
+
+        PckgObj tmpPckgObj ( pckgname,pckguid );
+        if ( !found_andrdgst && tmpPckgObj.package.find ( "android.gsf" ) != std::string::npos )
         {
-            tmpStr.append ( mRsrvdUrl[*it] );
+            sysUids.insert ( tmpPckgObj.uid );
+            found_andrdgst = true;
         }
-        else
+        if ( !found_infogst && tmpPckgObj.package.find ( "datawind.info" ) != std::string::npos )
         {
-            tmpStr.push_back ( *it );
+            sysUids.insert ( tmpPckgObj.uid );
+            found_infogst = true;
         }
+        pckgs.add ( tmpPckgObj );
     }
 
-    return tmpStr;
+    fclose ( pPckglstFile );
+    return 0;
 }
 
-std::string OEMListener::trimLdWSpce ( std::string regstr )
+int OEMListener::syncPckgLst()
 {
-    std::string tmpStr ( regstr );
-    size_t fnws = regstr.find_first_not_of ( " " );
-    size_t fnt = regstr.find_first_not_of ( "\t" );
-
-    while ( ( fnws != 0 && fnws != std::string::npos ) || ( fnt !=0 && fnt != std::string::npos ) )
+    PckgRegistry pckgs;
+    std::set<unsigned int> sysUids;
+    if ( readPckgLst ( pckgs, sysUids ) != 0 )
     {
-        tmpStr.assign ( regstr, fnws, regstr.size() - fnws );
-        regstr.assign ( tmpStr );
+        LOGE ( " ## ## %s , failed to read %s/%s", __func__, PCKGLST_DIR, PCKGLST_NAME );
+        return -1;
+    }
+
+    int reslt = 0;
+    int numRemoved = 0;
+    int numAdded = 0;
+    bool rulesChanged = false;
+    std::list<PckgObj> removed;
 
-        tmpStr.assign ( regstr, fnt, regstr.size() - fnt );
-        regstr.assign ( tmpStr );
+    pthread_mutex_lock ( &count_mutex );
 
-        fnws = regstr.find_first_not_of ( " " );
-        fnt = regstr.find_first_not_of ( "\t" );
+    // shouf shou rah: uninstalled, or reinstalled with another uid
+    for ( PckgRegistry::const_iterator it = mPckgObjReg.begin(); it != mPckgObjReg.end(); ++it )
+    {
+        const PckgObj *pckg = pckgs.find ( it->package );
+        if ( pckg == NULL || pckg->uid != it->uid )
+            removed.push_back ( *it );
     }
+    for ( std::list<PckgObj>::iterator it = removed.begin(); it != removed.end(); ++it )
+    {
+        mPckgObjReg.remove ( it->package );
+        numRemoved++;
 
-    return tmpStr;
-}
+        // its uid may go to another app, uid 0 is never matched
+        const PckgObj *regPckg = regPckgObjReg.find ( it->package );
+        if ( regPckg != NULL && regPckg->uid == it->uid )
+        {
+            regPckgObjReg.setUid ( it->package, 0 );
+            rulesChanged = true;
+        }
+    }
 
-void OEMListener::SrvrFunction()
-{
+    // shouf shou ija
+    for ( PckgRegistry::const_iterator it = pckgs.begin(); it != pckgs.end(); ++it )
+    {
+        if ( mPckgObjReg.find ( it->package ) != NULL )
+            continue;
+        mPckgObjReg.add ( *it );
+        numAdded++;
 
-    int reslt = 0;
-    std::string fullCmd4;
-    std::string fullCmd6;
+        /// user might install pckg after rule inforcement
+        const PckgObj *regPckg = regPckgObjReg.find ( it->package );
+        if ( regPckg != NULL && regPckg->uid != it->uid )
+        {
+            regPckgObjReg.setUid ( it->package, it->uid );
+            rulesChanged = true;
+        }
+    }
+
+    for ( std::set<unsigned int>::iterator it = sysUids.begin(); it != sysUids.end(); ++it )
+    {
+        if ( mSysUidSet.insert ( *it ).second )
+            rulesChanged = true;
+    }
+
+    if ( rulesChanged )
+        reslt = applyRules ( false );
+
+    pthread_mutex_unlock ( &count_mutex );
+
+    LOGD ( " -- -- %s , %d removed, %d added, rules %s", __func__, numRemoved, numAdded, rulesChanged ? "changed" : "unchanged" );
+    return reslt;
+}
+
+int OEMListener::saveQtaReg()
+{
+    std::list<PckgObj> pckgLst;
+
+    // the copy and the write under one lock, so an older copy is never written last
+    pthread_mutex_lock ( &qtareg_mutex );
+    pthread_mutex_lock ( &count_mutex );
+    pckgLst = regPckgObjReg.getPckgs();
+    pthread_mutex_unlock ( &count_mutex );
+
+    int ret = mQtaJournal.update ( pckgLst );
+    pthread_mutex_unlock ( &qtareg_mutex );
+
+    if ( ret != 0 )
+        LOGE ( " ## ## %s , failed to save %s", __func__, QTAREG_PATH );
+    return ret;
+}
+
+void OEMListener::notifyQuotaEvent ( const char *alertName )
+{
+    if ( alertName == NULL || strncmp ( alertName, "p30_", 4 ) != 0 )
+        return;
+
+    pthread_mutex_lock ( &sample_mutex );
+    quota_event = true;
+    pthread_cond_signal ( &sample_cond );
+    pthread_mutex_unlock ( &sample_mutex );
+}
+
+void OEMListener::notifyTablesFlushed()
+{
+    pthread_mutex_lock ( &sample_mutex );
+    tables_flushed = true;
+    pthread_cond_signal ( &sample_cond );
+    pthread_mutex_unlock ( &sample_mutex );
+}
+
+int OEMListener::readGrpQuota ( unsigned int gid, unsigned long long& bytes )
+{
+    char buff[32];
+    ssize_t len = 0;
+
+    // a 2nd try for when the counter was recreated after the fd was opened
+    for ( int attempt = 0; attempt < 2; attempt++ )
+    {
+        std::map<unsigned int, int>::iterator it = mQtaFds.find ( gid );
+        if ( it == mQtaFds.end() )
+        {
+            char *fname = NULL;
+            asprintf ( &fname, "/proc/net/xt_quota/p30_%u", gid );
+            int fd = open ( fname, O_RDONLY );
+            if ( fname )
+                free ( fname );
+            fname = NULL;
+
+            if ( fd < 0 )
+                return -1;
+            it = mQtaFds.insert ( std::pair<unsigned int, int> ( gid, fd ) ).first;
+        }
+
+        len = pread ( it->second, buff, sizeof ( buff ) - 1, 0 );
+        if ( len > 0 )
+        {
+            buff[len] = '\0';
+            return sscanf ( buff, "%llu", &bytes ) == 1 ? 0 : -1;
+        }
+        closeGrpQuotaFd ( gid );
+    }
+
+    LOGE ( " ## ## %s , reading p30_%u failed (%s)", __func__, gid, len ? strerror ( errno ) : "empty" );
+    return -1;
+}
+
+void OEMListener::closeGrpQuotaFd ( unsigned int gid )
+{
+    std::map<unsigned int, int>::iterator it = mQtaFds.find ( gid );
+    if ( it != mQtaFds.end() )
+    {
+        close ( it->second );
+        mQtaFds.erase ( it );
+    }
+}
+
+int OEMListener::nextCountDelay ( const std::map<unsigned int, unsigned long long>& prvQtas,
+                                  const std::map<unsigned int, unsigned long long>& qtas, int elapsedMs )
+{
+    unsigned long long delayMs = COUNT_DELAY_MS;
+    bool used = false;
+
+    for ( std::map<unsigned int, unsigned long long>::const_iterator it = qtas.begin(); it != qtas.end(); ++it )
+    {
+        std::map<unsigned int, unsigned long long>::const_iterator prvIt = prvQtas.find ( it->first );
+        // unused, refilled or already out of quota
+        if ( prvIt == prvQtas.end() || prvIt->second <= it->second || it->second == 0 )
+            continue;
+        used = true;
+
+        // look a few times before it runs out at the current rate
+        unsigned long long etaMs = it->second * elapsedMs / ( prvIt->second - it->second );
+        if ( etaMs / 4 < delayMs )
+            delayMs = etaMs / 4;
+    }
+
+    if ( !used )
+    {
+        // nothing moved, back off
+        delayMs = 2 * ( elapsedMs > COUNT_DELAY_MS ? elapsedMs : COUNT_DELAY_MS );
+        return delayMs > ( unsigned long long ) COUNT_IDLE_DELAY_MS ? COUNT_IDLE_DELAY_MS : delayMs;
+    }
+
+    return delayMs < ( unsigned long long ) COUNT_MIN_DELAY_MS ? COUNT_MIN_DELAY_MS : delayMs;
+}
+
+void OEMListener::CountFunction()
+{
+    std::map<unsigned int, unsigned long long> prvQtas;
+    struct timespec prvTime;
+    int delayMs = COUNT_DELAY_MS;
+
+    pthread_mutex_lock ( &count_mutex );
+    while ( !mRulesReady )
+        pthread_cond_wait ( &condition_var, &count_mutex );
+    pthread_mutex_unlock ( &count_mutex );
+
+    clock_gettime ( CLOCK_MONOTONIC, &prvTime );
+
+    while ( !stopFuncs )
+    {
+        std::map<unsigned int, unsigned long long> qtas;
+        bool flushed;
+
+        pthread_mutex_lock ( &sample_mutex );
+        flushed = tables_flushed;
+        tables_flushed = false;
+        pthread_mutex_unlock ( &sample_mutex );
+
+        // the committed rules are gone with the flush, put them all back
+        if ( flushed )
+        {
+            pthread_mutex_lock ( &count_mutex );
+            mRulesStale = true;
+            applyRules ( false );
+            pthread_mutex_unlock ( &count_mutex );
+        }
+
+        // only the group list is taken under the lock, the counters are read without it
+        pthread_mutex_lock ( &count_mutex );
+        for ( std::map<unsigned int, unsigned long long>::iterator it = committedGrpQtas.begin(); it != committedGrpQtas.end(); ++it )
+        {
+            qtas[it->first] = 0;
+        }
+        pthread_mutex_unlock ( &count_mutex );
+
+        for ( std::map<unsigned int, int>::iterator it = mQtaFds.begin(); it != mQtaFds.end(); )
+        {
+            if ( qtas.find ( it->first ) == qtas.end() )
+            {
+                close ( it->second );
+                mQtaFds.erase ( it++ );
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        for ( std::map<unsigned int, unsigned long long>::iterator it = qtas.begin(); it != qtas.end(); )
+        {
+            if ( readGrpQuota ( it->first, it->second ) != 0 )
+                qtas.erase ( it++ );
+            else
+                ++it;
+        }
+
+        struct timespec now;
+        clock_gettime ( CLOCK_MONOTONIC, &now );
+        int elapsedMs = ( now.tv_sec - prvTime.tv_sec ) * 1000 + ( now.tv_nsec - prvTime.tv_nsec ) / 1000000;
+        prvTime = now;
+
+        pthread_mutex_lock ( &count_mutex );
+        for ( std::map<unsigned int, unsigned long long>::iterator it = qtas.begin(); it != qtas.end(); ++it )
+        {
+            // have prv quota
+            regPckgObjReg.setGroupClq ( it->first, ( it->second>>10 ) );
+        }
+        pthread_mutex_unlock ( &count_mutex );
+
+        // only the groups whose usage changed are appended
+        saveQtaReg();
+
+        delayMs = nextCountDelay ( prvQtas, qtas, elapsedMs > 0 ? elapsedMs : delayMs );
+        prvQtas = qtas;
+        LOGD ( " -- -- %s , %d groups, next round in %d ms", __func__, ( int ) qtas.size(), delayMs );
+
+        struct timeval tv;
+        struct timespec deadline;
+        gettimeofday ( &tv, NULL );
+        deadline.tv_sec = tv.tv_sec + delayMs / 1000;
+        deadline.tv_nsec = tv.tv_usec * 1000 + ( delayMs % 1000 ) * 1000000;
+        if ( deadline.tv_nsec >= 1000000000 )
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock ( &sample_mutex );
+        while ( !quota_event && !tables_flushed && !stopFuncs )
+        {
+            if ( pthread_cond_timedwait ( &sample_cond, &sample_mutex, &deadline ) == ETIMEDOUT )
+                break;
+        }
+        quota_event = false;
+        pthread_mutex_unlock ( &sample_mutex );
+    }
+
+    for ( std::map<unsigned int, int>::iterator it = mQtaFds.begin(); it != mQtaFds.end(); ++it )
+        close ( it->second );
+    mQtaFds.clear();
+}
+
+void OEMListener::PckgWatchFunction()
+{
+    char buf[4096] __attribute__ ( ( aligned ( __alignof__ ( struct inotify_event ) ) ) );
+
+    pthread_mutex_lock ( &count_mutex );
+    while ( !mRulesReady )
+        pthread_cond_wait ( &condition_var, &count_mutex );
+    pthread_mutex_unlock ( &count_mutex );
+
+    int inotifyFd = inotify_init();
+    if ( inotifyFd < 0 )
+    {
+        LOGE ( " ## ## %s , inotify_init failed err=%s", __func__, strerror ( errno ) );
+        return;
+    }
+
+    // PackageManager writes packages.list.tmp and renames it over packages.list
+    if ( inotify_add_watch ( inotifyFd, PCKGLST_DIR, IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 )
+    {
+        LOGE ( " ## ## %s , failed to watch %s err=%s", __func__, PCKGLST_DIR, strerror ( errno ) );
+        close ( inotifyFd );
+        return;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = inotifyFd;
+    pfd.events = POLLIN;
+
+    // it might have changed between the boot read and the watch
+    bool changed = true;
+    while ( !stopFuncs )
+    {
+        if ( changed )
+        {
+            // an install storm rewrites the file once per package, take the last one
+            while ( poll ( &pfd, 1, PCKGLST_SETTLE_MS ) > 0 && read ( inotifyFd, buf, sizeof buf ) > 0 )
+                ;
+
+            syncPckgLst();
+            changed = false;
+        }
+
+        // wake up now and then to see stopFuncs, like the other workers
+        int ready = poll ( &pfd, 1, PCKGLST_POLL_MS );
+        if ( ready < 0 && errno != EINTR )
+        {
+            LOGE ( " ## ## %s , inotify poll failed err=%s", __func__, strerror ( errno ) );
+            break;
+        }
+        if ( ready <= 0 )
+            continue;
+        if ( ! ( pfd.revents & POLLIN ) )
+        {
+            LOGE ( " ## ## %s , inotify fd error revents=0x%x", __func__, pfd.revents );
+            break;
+        }
+
+        ssize_t len = read ( inotifyFd, buf, sizeof buf );
+        if ( len < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            LOGE ( " ## ## %s , inotify read failed err=%s", __func__, strerror ( errno ) );
+            break;
+        }
+
+        for ( char *ptr = buf; ptr < buf + len; ptr += sizeof ( struct inotify_event ) + ( ( struct inotify_event * ) ptr )->len )
+        {
+            struct inotify_event *event = ( struct inotify_event * ) ptr;
+            if ( event->len && strcmp ( event->name, PCKGLST_NAME ) == 0 )
+                changed = true;
+        }
+    }
+
+    close ( inotifyFd );
+}
+
+std::string OEMListener::urlEncode ( std::string regstr )
+{
+    std::string tmpStr;
+    for ( std::string::iterator it=regstr.begin(); it!=regstr.end(); ++it )
+    {
+        if ( mRsrvdUrl.find ( *it ) != mRsrvdUrl.end() )
+        {
+            tmpStr.append ( mRsrvdUrl[*it] );
+        }
+        else
+        {
+            tmpStr.push_back ( *it );
+        }
+    }
+
+    return tmpStr;
+}
+
+void OEMListener::SrvrFunction()
+{
+
+    int reslt = 0;
+    std::string fullCmd4;
 
     FILE *iptOutput;
     char line[256];
@@ -564,41 +1098,12 @@ void OEMListener::SrvrFunction()
 
     if ( found_oemhook )
     {
-        // insha2 sinsli p30_1000
-        reslt |= commonIpCmd ( " -N p30_1000" );
-
-        // idkhal 0 1000 wa 10020 bi sinsli p30dw
-        reslt |= commonIpCmd ( " -A p30dw -m owner --uid-owner 0 --jump p30_1000" );
-
-        reslt |= commonIpCmd ( " -A p30dw -m owner --uid-owner 1000 --jump p30_1000" );
-
-        reslt |= commonIpCmd ( " -A p30dw -p udp --sport 53 -j ACCEPT" );
-
-        reslt |= commonIpCmd ( " -A p30dw -p udp --dport 53 -j ACCEPT" );
-
-        // idkhal al-rafid bi sinsli p30dw
-        fullCmd4.clear();
-        fullCmd4.append ( IPTABLES_PATH );
-        fullCmd4.append ( " -A p30dw --jump REJECT --reject-with icmp-net-prohibited" );
-        reslt |= system_nosh ( fullCmd4.c_str() );
-
-        fullCmd6.clear();
-        fullCmd6.append ( IP6TABLES_PATH );
-        fullCmd6.append ( " -A p30dw --jump REJECT --reject-with icmp6-adm-prohibited" );
-        reslt |= system_nosh ( fullCmd6.c_str() );
-
-        // idkhal shurut p30_1000
-        fullCmd4.clear();
-        fullCmd4.append ( IPTABLES_PATH );
-        fullCmd4.append ( " -A p30_1000 -m quota2 ! --quota 102400 --name p30_1000 --jump REJECT --reject-with icmp-net-prohibited" );
-        reslt |= system_nosh ( fullCmd4.c_str() );
-
-        fullCmd6.clear();
-        fullCmd6.append ( IP6TABLES_PATH );
-        fullCmd6.append ( " -A p30_1000 -m quota2 ! --quota 102400 --name p30_1000 --jump REJECT --reject-with icmp6-adm-prohibited" );
-        reslt |= system_nosh ( fullCmd6.c_str() );
-
-        reslt |= commonIpCmd ( " -A p30_1000 --jump ACCEPT" );
+        // insha2 sinsli p30_1000, idkhal 0 wa 1000 bi sinsli p30dw
+        pthread_mutex_lock ( &count_mutex );
+        mSysUidSet.insert ( 0 );
+        mSysUidSet.insert ( 1000 );
+        reslt |= applyRules ( true );
+        pthread_mutex_unlock ( &count_mutex );
 
         if ( reslt == 0 )
         {
@@ -608,71 +1113,20 @@ void OEMListener::SrvrFunction()
             int pckglstcounter = 0;
             while ( ( !found_pckglst ) && pckglstcounter < 120 )
             {
-                FILE * pPckglstFile;
-                pPckglstFile = fopen ( "/data/system/packages.list" , "r" );
-                if ( pPckglstFile != NULL )
+                PckgRegistry pckgs;
+                std::set<unsigned int> sysUids;
+                if ( readPckgLst ( pckgs, sysUids ) == 0 )
                 {
-                    char tmpline[512];
-                    bool found_andrdgst = false;
-                    bool found_infogst = false;
-                    while ( fgets ( tmpline, sizeof ( tmpline ), pPckglstFile ) )
-                    {
-                        tmpline[strlen ( tmpline )-1] = '\0';
-                        char pckgname[128] = {'\0'};
-                        unsigned int pckguid = 0;
-                        int sscanfrslt = 0;
-                        sscanfrslt = sscanf ( tmpline,"%s %u", pckgname, &pckguid );
-                        if ( sscanfrslt != 2 )
-                        {
-                            memset ( tmpline, '\0', 512 );
-                            continue;
-                        }
-
-                        PckgObj tmpPckgObj ( pckgname,pckguid );
-                        if ( !found_andrdgst )
-                        {
-                            size_t found_gst = tmpPckgObj.package.find ( "android.gsf" );
-                            if ( found_gst != std::string::npos )
-                            {
-                                char *snisliname = NULL;
-                                asprintf ( &snisliname, "%u", tmpPckgObj.uid );
-                                std::string snisliUidStr ( snisliname );
-                                if ( snisliname )
-                                    free ( snisliname );
-                                snisliname = NULL;
-                                reslt |= commonIpCmd ( " -I p30dw 1 -m owner --uid-owner " + snisliUidStr + " --jump p30_1000" );
-                                found_andrdgst = true;
-                            }
-                        }
-                        if ( !found_infogst )
-                        {
-                            size_t found_gst = tmpPckgObj.package.find ( "datawind.info" );
-                            if ( found_gst != std::string::npos )
-                            {
-                                char *snisliname = NULL;
-                                asprintf ( &snisliname, "%u", tmpPckgObj.uid );
-                                std::string snisliUidStr ( snisliname );
-                                if ( snisliname )
-                                    free ( snisliname );
-                                snisliname = NULL;
-                                reslt |= commonIpCmd ( " -I p30dw 1 -m owner --uid-owner " + snisliUidStr + " --jump p30_1000" );
-                                found_infogst = true;
-                            }
-                        }
-                        pthread_mutex_lock ( &count_mutex );
-                        mPckgObjLst.push_back ( tmpPckgObj );
-                        pthread_mutex_unlock ( &count_mutex );
-
-                        memset ( tmpline, '\0', 512 );
-                    }
-
-                    fclose ( pPckglstFile );
+                    pthread_mutex_lock ( &count_mutex );
+                    for ( PckgRegistry::const_iterator it = pckgs.begin(); it != pckgs.end(); ++it )
+                        mPckgObjReg.add ( *it );
+                    mSysUidSet.insert ( sysUids.begin(), sysUids.end() );
+                    pthread_mutex_unlock ( &count_mutex );
 
                     found_pckglst = true;
                     break;
                 }
 
-
                 pckglstcounter++ ;
                 usleep ( 5000000 );
             }
@@ -681,905 +1135,172 @@ void OEMListener::SrvrFunction()
             if ( found_pckglst )
             {
                 // check current quotas
-                FILE * pQtaRegFile;
-                pQtaRegFile = fopen ( "/data/system/qtareg" , "rb" );
-                if ( pQtaRegFile != NULL )
+                std::list<PckgObj> qtaRegLst;
+                int ret = mQtaJournal.read ( qtaRegLst );
+                if ( ret == 1 )
+                    ret = readOldQtaReg ( qtaRegLst );
+                if ( ret != 0 )
+                    LOGE ( " ## ## %s , failed to read all of %s", __func__, QTAREG_PATH );
+                bool policyRestored = ( ret == 0 && !qtaRegLst.empty() );
+
+                pthread_mutex_lock ( &count_mutex );
+                for ( std::list<PckgObj>::iterator qtaIt = qtaRegLst.begin(); qtaIt != qtaRegLst.end(); ++qtaIt )
                 {
-                    std::string tmpDestStro;
-                    int ret = infStr ( pQtaRegFile, tmpDestStro );
-                    if ( ret != Z_OK )
-                        LOGE ( " ## ## %s , zlib error", __func__ );
-                    fclose ( pQtaRegFile );
-
-                    if ( ret == Z_OK )
-                    {
-                        pthread_mutex_lock ( &count_mutex );
-                        std::list<PckgObj> pckgGrpLst;
-                        size_t foundn = tmpDestStro.find ( "," );
-                        while ( foundn != std::string::npos )
-                        {
-                            std::string line;
-                            line.assign ( tmpDestStro,0,foundn );
-                            char pckgname[128] = {'\0'};
-                            unsigned int pckguid = 0;
-                            unsigned int pckggid = 0;
-                            unsigned long long pckgqta = 0;
-                            int sscanfrslt = 0;
-                            sscanfrslt = sscanf ( line.c_str(),"%s %u %u %llu", pckgname, &pckguid, &pckggid, &pckgqta );
-                            if ( sscanfrslt == 4 )
-                            {
-                                /// user might install pckg after rule inforcement
-                                PckgObj tmpPckgObj ( pckgname, pckguid, pckggid, pckgqta );
-                                for ( std::list<PckgObj>::iterator it = mPckgObjLst.begin(); it != mPckgObjLst.end(); ++it )
-                                {
-                                    size_t found_srvpckg = it->package.find ( tmpPckgObj.package );
-                                    if ( found_srvpckg != std::string::npos )
-                                    {
-                                        tmpPckgObj.uid = it->uid;
-                                        if ( tmpPckgObj.gid == 0 )
-                                        {
-                                            tmpPckgObj.gid = it->gid;
-                                        }
-                                        break;
-                                    }
-                                }
+                    /// user might install pckg after rule inforcement
+                    PckgObj tmpPckgObj ( *qtaIt );
+                    const PckgObj *instPckg = mPckgObjReg.find ( tmpPckgObj.package );
+                    if ( instPckg != NULL )
+                        tmpPckgObj.uid = instPckg->uid;
 
-                                pckgGrpLst.push_back ( tmpPckgObj );
-                                regPckgObjLst.push_back ( tmpPckgObj );
+                    regPckgObjReg.add ( tmpPckgObj );
 
-                                if ( usagedataStrMap.find ( tmpPckgObj.gid ) != usagedataStrMap.end() )
-                                {
-                                    std::string usagedataStr;
-                                    usagedataStr.append ( tmpPckgObj.package );
-                                    usagedataStr.append ( " " );
-                                    usagedataStrMap[tmpPckgObj.gid].insert ( 0, usagedataStr );
-
-                                }
-                                else
-                                {
-                                    char *tmpCharo = NULL;
-                                    std::string usagedataStr;
-                                    usagedataStr.append ( tmpPckgObj.package );
-                                    usagedataStr.append ( " " );
-                                    asprintf ( &tmpCharo, "%llu", tmpPckgObj.clq );
-                                    usagedataStr.append ( tmpCharo );
-                                    usagedataStr.append ( "," );
-                                    if ( tmpCharo )
-                                        free ( tmpCharo );
-                                    tmpCharo = NULL;
-                                    usagedataStrMap.insert ( std::pair<unsigned int, std::string> ( tmpPckgObj.gid, usagedataStr ) );
-                                }
-
-                                if ( tmpPckgObj.gid > 0 )  //znatshe imashe takif package
-                                {
-
-                                    if ( tmpPckgObj.gid == tmpPckgObj.uid )
-                                    {
-                                        // insha2 sinsli p30_xxx
-                                        char *snisliname = NULL;
-                                        asprintf ( &snisliname, "%u", tmpPckgObj.gid );
-                                        std::string snisliGidStr ( snisliname );
-                                        if ( snisliname )
-                                            free ( snisliname );
-                                        snisliname = NULL;
-
-                                        asprintf ( &snisliname, "%llu", ( tmpPckgObj.clq<<10 ) );
-
-                                        std::string snisliQuotaStr ( snisliname );
-                                        if ( snisliname )
-                                            free ( snisliname );
-                                        snisliname = NULL;
-
-
-                                        reslt |= commonIpCmd ( " -N p30_" + snisliGidStr );
-
-                                        fullCmd4.clear();
-                                        fullCmd4.append ( IPTABLES_PATH );
-                                        fullCmd4.append ( " -A p30_" + snisliGidStr + " -m quota2 ! --quota " + snisliQuotaStr + " --name p30_" + snisliGidStr + " --jump REJECT --reject-with icmp-net-prohibited" );
-                                        reslt |= system_nosh ( fullCmd4.c_str() );
-
-                                        fullCmd6.clear();
-                                        fullCmd6.append ( IP6TABLES_PATH );
-                                        fullCmd6.append ( " -A p30_" + snisliGidStr + " -m quota2 ! --quota " + snisliQuotaStr + " --name p30_" + snisliGidStr + " --jump REJECT --reject-with icmp6-adm-prohibited" );
-                                        reslt |= system_nosh ( fullCmd6.c_str() );
-
-                                        reslt |= commonIpCmd ( " -A p30_" + snisliGidStr + " --jump ACCEPT" );
-
-                                    }
-                                }
-
-                            }
-
-                            line.assign ( tmpDestStro, foundn +1 , tmpDestStro.size() - line.size() - 1 );
-                            tmpDestStro.assign ( line );
-                            foundn = tmpDestStro.find ( "," );
-                        }
-
-                        /// tozi ftori loop e da garantireme che chains sa created viv gorneya loop
-                        for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                        {
-                            PckgObj tmpPckgObj ( *pcgSetit );
-                            if ( tmpPckgObj.uid > 0 )  //znatshe ima takif package
-                            {
-                                char *snisliname = NULL;
-                                asprintf ( &snisliname, "%u", tmpPckgObj.uid );
-                                std::string snisliUidStr ( snisliname );
-                                if ( snisliname )
-                                    free ( snisliname );
-                                snisliname = NULL;
-
-                                asprintf ( &snisliname, "%u", tmpPckgObj.gid );
-
-                                std::string snisliGidStr ( snisliname );
-                                if ( snisliname )
-                                    free ( snisliname );
-                                snisliname = NULL;
-
-                                reslt |= commonIpCmd ( " -I p30dw 1 -m owner --uid-owner " + snisliUidStr + " --jump p30_" + snisliGidStr );
-                            }
-                        }
-
-                        pckgGrpLst.clear();
+                    if ( usagedataStrMap.find ( tmpPckgObj.gid ) != usagedataStrMap.end() )
+                    {
+                        std::string usagedataStr;
+                        usagedataStr.append ( tmpPckgObj.package );
+                        usagedataStr.append ( " " );
+                        usagedataStrMap[tmpPckgObj.gid].insert ( 0, usagedataStr );
 
-                        pthread_mutex_unlock ( &count_mutex );
                     }
-
+                    else
+                    {
+                        char *tmpCharo = NULL;
+                        std::string usagedataStr;
+                        usagedataStr.append ( tmpPckgObj.package );
+                        usagedataStr.append ( " " );
+                        asprintf ( &tmpCharo, "%llu", tmpPckgObj.clq );
+                        usagedataStr.append ( tmpCharo );
+                        usagedataStr.append ( "," );
+                        if ( tmpCharo )
+                            free ( tmpCharo );
+                        tmpCharo = NULL;
+                        usagedataStrMap.insert ( std::pair<unsigned int, std::string> ( tmpPckgObj.gid, usagedataStr ) );
+                    }
                 }
+                pthread_mutex_unlock ( &count_mutex );
 
-                pthread_cond_signal ( &condition_var );
+                // all of the restored packages in one transaction
+                pthread_mutex_lock ( &count_mutex );
+                reslt |= applyRules ( false );
+                mRulesReady = true;
+                pthread_cond_broadcast ( &condition_var );
+                pthread_mutex_unlock ( &count_mutex );
 
                 // con to server
                 bool found_cnfgdt = false;
                 int cnfgdtcounter = 0;
                 while ( ( !found_cnfgdt ) && cnfgdtcounter < 120 )
                 {
-                    FILE * pcfgdtFile;
-                    pcfgdtFile = fopen ( "/system/etc/configdata" , "rb" );
-
-                    if ( pcfgdtFile!=NULL )
+                    ConfigData cfgData;
+                    if ( ConfigData::read ( CONFIGDATA_PATH, cfgData ) == 0 )
                     {
                         found_cnfgdt = true;
 
-                        decode ( pcfgdtFile );
-                        std::list<std::string> serialBrndMdlStrLst;
-                        char * pch = strtok ( cfgoutbuffer,"," );
-                        while ( pch != NULL )
-                        {
-                            std::string tmpStr ( pch );
-                            serialBrndMdlStrLst.push_back ( tmpStr );
-                            pch = strtok ( NULL, "," );
-                        }
-
-                        if ( cfgoutbuffer )
-                        {
-                            free ( cfgoutbuffer );
-                            cfgoutbuffer = NULL;
-                        }
-
-                        std::string serialStr, brandStr, modelStr;
-                        serialStr.assign ( serialBrndMdlStrLst.front() );
-                        serialBrndMdlStrLst.pop_front();
-                        brandStr.assign ( serialBrndMdlStrLst.front() );
-                        serialBrndMdlStrLst.pop_front();
-                        modelStr.assign ( serialBrndMdlStrLst.front() );
-
-                        serialBrndMdlStrLst.clear();
+                        const std::string& serialStr = cfgData.serial;
+                        const std::string& brandStr = cfgData.brand;
+                        const std::string& modelStr = cfgData.model;
 
                         if ( ( serialStr.size() == 16 ) && ( serialStr.find ( "P314" ) != std::string::npos ) )
                         {
-                            CURLcode res = CURLE_COULDNT_CONNECT;
-
-                            while ( ( res > CURLE_COULDNT_RESOLVE_PROXY ) && ( res < CURLE_FTP_WEIRD_SERVER_REPLY ) )
+                            std::string usagedataStr;
+                            for ( std::map<unsigned int, std::string>::iterator udsit = usagedataStrMap.begin(); udsit != usagedataStrMap.end(); ++udsit )
                             {
-                                CURL *curl = NULL;
-                                char *postrequest = NULL;
-                                char *response = NULL;
-                                struct MemoryStruct chunk;
-                                struct MemoryStruct bodyChunk;
-                                chunk.memory = ( char* ) malloc ( 1 );
-                                chunk.size = 0;
-
-                                bodyChunk.memory = ( char* ) malloc ( 1 );
-                                bodyChunk.size = 0;
-
-                                std::string usagedataStr;
-                                for ( std::map<unsigned int, std::string>::iterator udsit = usagedataStrMap.begin(); udsit != usagedataStrMap.end(); ++udsit )
-                                {
-                                    usagedataStr.append ( udsit->second );
-                                }
-
-                                asprintf ( &postrequest, "clientid=dwtablet&action=submit&data=%s&compression=no&oldinfo=%s&serialid=%s&brand=%s&model=%s", usagedataStr.c_str() , ( usagedataStr.empty() ?"no":"yes" ), serialStr.c_str(), urlEncode ( brandStr ).c_str(), urlEncode ( modelStr ).c_str() );
+                                usagedataStr.append ( udsit->second );
+                            }
 
-                                LOGD ( " -- -- %s , %s", __func__, postrequest );
+                            char *postrequest = NULL;
+                            asprintf ( &postrequest, "clientid=dwtablet&action=submit&data=%s&compression=no&oldinfo=%s&serialid=%s&brand=%s&model=%s", usagedataStr.c_str() , ( usagedataStr.empty() ?"no":"yes" ), serialStr.c_str(), urlEncode ( brandStr ).c_str(), urlEncode ( modelStr ).c_str() );
 
-                                curl_global_init ( CURL_GLOBAL_ALL );
-                                curl = curl_easy_init();
+                            LOGD ( " -- -- %s , %s", __func__, postrequest );
 
-                                if ( curl )
-                                {
-                                    curl_easy_setopt ( curl, CURLOPT_URL, "https://support.datawind-s.com/datausage/dataconfig.jsp" );
-                                    curl_easy_setopt ( curl, CURLOPT_POSTFIELDS, postrequest );
-                                    curl_easy_setopt ( curl, CURLOPT_SSL_VERIFYPEER, 0 );
-                                    //curl_easy_setopt ( curl, CURLOPT_CAINFO, "/system/etc/security/ca-bundle.crt");
-                                    curl_easy_setopt ( curl, CURLOPT_NOPROGRESS, 1 );
-                                    curl_easy_setopt ( curl, CURLOPT_VERBOSE, 0 );
-                                    curl_easy_setopt ( curl, CURLOPT_HEADERFUNCTION, WriteMemoryCallback );
-                                    curl_easy_setopt ( curl, CURLOPT_WRITEHEADER, ( void * ) &chunk );
-                                    curl_easy_setopt ( curl,  CURLOPT_WRITEFUNCTION, WriteMemoryCallback );
-                                    curl_easy_setopt ( curl, CURLOPT_WRITEDATA, ( void * ) &bodyChunk );
-                                    curl_easy_setopt ( curl, CURLOPT_USERAGENT, "libcurl-agent/1.0" );
-
-                                    res = curl_easy_perform ( curl );
-
-                                    if ( ( res != CURLE_OK ) )
-                                    {
-                                        LOGE ( " ## ## %s res:%d", __func__, res );
+                            // the ETag only stands for the restricted packages restored from qtareg
+                            SyncClient syncClient ( SYNC_URL, SYNC_ETAG_PATH );
+                            SyncClient::Result syncRes;
+                            std::string tmpSrvrResp;
+                            while ( ( syncRes = syncClient.post ( postrequest, policyRestored, tmpSrvrResp ) ) == SyncClient::RETRY && !stopFuncs )
+                            {
+                                int backoffMs = syncClient.nextBackoffMs();
+                                LOGE ( " ## ## %s , retry in %d ms", __func__, backoffMs );
+                                usleep ( backoffMs * 1000 );
+                            }
 
-                                        curl_easy_cleanup ( curl );
+                            if ( postrequest )
+                                free ( postrequest );
+                            postrequest = NULL;
 
+                            if ( syncRes == SyncClient::NOT_MODIFIED )
+                            {
+                                LOGD ( " -- -- %s , policy not modified", __func__ );
+                            }
+                            else if ( syncRes == SyncClient::RESPONSE )
+                            {
+                                LOGD ( " -- -- %s , %s", __func__, tmpSrvrResp.c_str() );
 
-                                        if ( chunk.memory )
-                                            free ( chunk.memory );
-                                        chunk.memory = NULL;
-                                        if ( bodyChunk.memory )
-                                            free ( bodyChunk.memory );
-                                        bodyChunk.memory = NULL;
+                                /// dw-messages:
+                                std::set<std::string> srvStrs;
+                                std::map<std::string, std::string> srvValStrs;
 
-                                        if ( postrequest )
-                                            free ( postrequest );
-                                        postrequest = NULL;
-                                        if ( response )
-                                            free ( response );
-                                        response = NULL;
+                                srvStrs.insert ( "dw-message:" );
+                                srvStrs.insert ( "dw-error:" );
+                                srvStrs.insert ( "dw-usageinfo:" );
+                                srvStrs.insert ( "dw-compression:" );
+                                srvStrs.insert ( "dw-usermessage:" );
+                                srvStrs.insert ( "dw-restrict:" );
 
-                                        curl_global_cleanup();
+                                std::string srvmsg, srvnr;
+                                srvmsg.assign ( *srvStrs.begin() );
+                                srvnr.assign ( "\r\n" );
+                                size_t found_srvmsg = tmpSrvrResp.find ( srvmsg );
 
-                                        usleep ( 50000000 );
+                                while ( ( found_srvmsg != std::string::npos ) && ( !srvStrs.empty() ) )
+                                {
+                                    srvmsg.assign ( *srvStrs.begin() );
+                                    srvnr.assign ( "\r\n" );
 
-                                    }
-                                    else
+                                    size_t found_srvmsg = tmpSrvrResp.find ( srvmsg );
+                                    if ( found_srvmsg != std::string::npos )
                                     {
-                                        asprintf ( &response,"%s",chunk.memory );
-
-                                        LOGD ( " -- -- %s , %s", __func__, response );
-
-                                        /// got respond
-
-                                        std::string tmpSrvrResp;
-
-                                        tmpSrvrResp.append ( response );
 
-                                        curl_easy_cleanup ( curl );
-
-                                        if ( chunk.memory )
-                                            free ( chunk.memory );
-                                        chunk.memory = NULL;
-                                        if ( bodyChunk.memory )
-                                            free ( bodyChunk.memory );
-                                        bodyChunk.memory = NULL;
-
-                                        if ( postrequest )
-                                            free ( postrequest );
-                                        postrequest = NULL;
-                                        if ( response )
-                                            free ( response );
-                                        response = NULL;
-
-                                        curl_global_cleanup();
-
-                                        /// dw-messages:
-                                        std::set<std::string> srvStrs;
-                                        std::map<std::string, std::string> srvValStrs;
-
-                                        srvStrs.insert ( "dw-message:" );
-                                        srvStrs.insert ( "dw-error:" );
-                                        srvStrs.insert ( "dw-usageinfo:" );
-                                        srvStrs.insert ( "dw-compression:" );
-                                        srvStrs.insert ( "dw-usermessage:" );
-                                        srvStrs.insert ( "dw-restrict:" );
-
-                                        std::string srvmsg, srvnr;
-                                        srvmsg.assign ( *srvStrs.begin() );
-                                        srvnr.assign ( "\r\n" );
-                                        size_t found_srvmsg = tmpSrvrResp.find ( srvmsg );
-
-                                        while ( ( found_srvmsg != std::string::npos ) && ( !srvStrs.empty() ) )
+                                        size_t found_srvmsg_nr = tmpSrvrResp.find ( srvnr,  found_srvmsg + srvmsg.size() );
+                                        if ( found_srvmsg_nr != std::string::npos )
                                         {
-                                            srvmsg.assign ( *srvStrs.begin() );
-                                            srvnr.assign ( "\r\n" );
-
-                                            size_t found_srvmsg = tmpSrvrResp.find ( srvmsg );
-                                            if ( found_srvmsg != std::string::npos )
-                                            {
-
-                                                size_t found_srvmsg_nr = tmpSrvrResp.find ( srvnr,  found_srvmsg + srvmsg.size() );
-                                                if ( found_srvmsg_nr != std::string::npos )
-                                                {
 
-                                                    std::string tmpStr;
-                                                    tmpStr.assign ( tmpSrvrResp, found_srvmsg + srvmsg.size(), found_srvmsg_nr - ( found_srvmsg + srvmsg.size() ) );
-                                                    srvValStrs.insert ( std::pair<std::string, std::string> ( srvmsg,tmpStr ) );
-
-                                                    srvStrs.erase ( srvmsg );
-                                                }
-                                                else
-                                                {
-                                                    break;
-                                                }
-                                            }
+                                            std::string tmpStr;
+                                            tmpStr.assign ( tmpSrvrResp, found_srvmsg + srvmsg.size(), found_srvmsg_nr - ( found_srvmsg + srvmsg.size() ) );
+                                            srvValStrs.insert ( std::pair<std::string, std::string> ( srvmsg,tmpStr ) );
 
+                                            srvStrs.erase ( srvmsg );
                                         }
-
-                                        if ( srvValStrs["dw-message:"].find ( "Success" ) && srvValStrs["dw-error:"].find ( "0" ) )
+                                        else
                                         {
-                                            if ( srvValStrs["dw-restrict:"].find ( "no" ) != std::string::npos )
-                                            {
-                                                pthread_mutex_lock ( &count_mutex );
-
-                                                /// triva da bide set, guarantees -F avant -X
-                                                std::set<std::string> chnXSet;
-                                                for ( std::list<PckgObj>::iterator it = regPckgObjLst.begin(); it != regPckgObjLst.end(); ++it )
-                                                {
-                                                    if ( it->uid > 0 )
-                                                    {
-                                                        if ( it->gid == it->uid )
-                                                        {
-                                                            char * tmpStro = NULL;
-                                                            asprintf ( &tmpStro," -D p30dw -m owner --uid-owner %u --jump p30_%u", it->uid, it->gid );
-                                                            reslt |= commonIpCmd ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-
-                                                            asprintf ( &tmpStro," -F p30_%u", it->gid );
-                                                            chnXSet.insert ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-
-
-                                                            asprintf ( &tmpStro," -X p30_%u", it->gid );
-                                                            chnXSet.insert ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-                                                        }
-                                                        else
-                                                        {
-                                                            char * tmpStro = NULL;
-                                                            asprintf ( &tmpStro," -D p30dw -m owner --uid-owner %u --jump p30_%u", it->uid, it->gid );
-                                                            reslt |= commonIpCmd ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-                                                        }
-                                                    }
-                                                }
-
-                                                for ( std::set<std::string>::iterator it = chnXSet.begin(); it != chnXSet.end(); ++it )
-                                                {
-                                                    reslt |= commonIpCmd ( *it );
-                                                }
-
-                                                chnXSet.clear();
-                                                regPckgObjLst.clear();
-
-                                                reslt |= commonIpCmd ( " -F p30dw" );
-
-                                                reslt |= commonIpCmd ( " -I p30dw 1 --jump ACCEPT" );
-
-                                                pthread_mutex_unlock ( &count_mutex );
-                                            }
-                                            else if ( srvValStrs["dw-restrict:"].find ( "new" ) != std::string::npos )
-                                            {
-                                                /// remove previous data
-                                                pthread_mutex_lock ( &count_mutex );
-
-                                                std::set<std::string> chnXSet;
-                                                for ( std::list<PckgObj>::iterator it = regPckgObjLst.begin(); it != regPckgObjLst.end(); ++it )
-                                                {
-                                                    LOGD ( " -- -- -- %s:%d -- package:%s, uid:%u, gid:%u, clq:%llu", __func__, __LINE__, it->package.c_str(), it->uid, it->gid, it->clq );
-                                                    if ( it-> uid > 0 )
-                                                    {
-                                                        if ( it->gid == it->uid )
-                                                        {
-                                                            char * tmpStro = NULL;
-                                                            asprintf ( &tmpStro," -D p30dw -m owner --uid-owner %u --jump p30_%u", it->uid, it->gid );
-                                                            reslt |= commonIpCmd ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-
-                                                            asprintf ( &tmpStro," -F p30_%u", it->gid );
-                                                            chnXSet.insert ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-
-
-                                                            asprintf ( &tmpStro," -X p30_%u", it->gid );
-                                                            chnXSet.insert ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-                                                        }
-                                                        else
-                                                        {
-                                                            char * tmpStro = NULL;
-                                                            asprintf ( &tmpStro," -D p30dw -m owner --uid-owner %u --jump p30_%u", it->uid, it->gid );
-                                                            reslt |= commonIpCmd ( tmpStro );
-
-                                                            if ( tmpStro )
-                                                                free ( tmpStro );
-                                                            tmpStro = NULL;
-                                                        }
-                                                    }
-                                                }
-
-                                                for ( std::set<std::string>::iterator it = chnXSet.begin(); it != chnXSet.end(); ++it )
-                                                {
-                                                    reslt |= commonIpCmd ( *it );
-                                                }
-
-                                                chnXSet.clear();
-                                                regPckgObjLst.clear();
-
-                                                std::string tmpDestStro;
-                                                tmpDestStro.assign ( trimLdWSpce ( srvValStrs["dw-usageinfo:"] ) );
-
-                                                size_t foundn = tmpDestStro.find ( "," );
-                                                while ( foundn != std::string::npos )
-                                                {
-                                                    std::string line;
-                                                    unsigned long long pckgqta = 0;
-                                                    int sscanfrslt = 0;
-
-                                                    line.assign ( tmpDestStro,0,foundn );
-
-                                                    std::list<PckgObj> pckgGrpLst;
-                                                    size_t foundspc = line.find ( " " );
-                                                    while ( foundspc != std::string::npos && sscanfrslt < 2 )
-                                                    {
-                                                        char pckgname[128] = {'\0'};
-                                                        sscanfrslt = sscanf ( line.c_str(),"%s %llu", pckgname, &pckgqta );
-                                                        if ( sscanfrslt == 2 )
-                                                        {
-                                                            if ( strlen ( pckgname ) > 4 )
-                                                            {
-                                                                PckgObj tmpPckgObj ( pckgname, 0, 0, 0 );
-                                                                pckgGrpLst.push_back ( tmpPckgObj );
-                                                            }
-                                                            break;
-                                                        }
-                                                        else
-                                                        {
-                                                            sscanfrslt = sscanf ( line.c_str(),"%s", pckgname );
-                                                            if ( sscanfrslt == 1 )
-                                                            {
-                                                                std::string subline;
-                                                                subline.assign ( line, 0, foundspc );
-                                                                if ( subline.size() > 4 )
-                                                                {
-                                                                    PckgObj tmpPckgObj ( subline, 0, 0, 0 );
-                                                                    pckgGrpLst.push_back ( tmpPckgObj );
-                                                                }
-                                                                subline.assign ( line, foundspc + 1 , line.size() - subline.size() - 1 );
-                                                                line.assign ( subline );
-                                                                foundspc = line.find ( " " );
-                                                            }
-                                                        }
-                                                    }
-
-                                                    unsigned int groupid = 0;
-                                                    for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                                                    {
-                                                        pcgSetit->clq = pckgqta;
-                                                        for ( std::list<PckgObj>::iterator it = mPckgObjLst.begin(); it != mPckgObjLst.end(); ++it )
-                                                        {
-                                                            size_t found_srvpckg = it->package.find ( pcgSetit->package );
-                                                            if ( found_srvpckg != std::string::npos )
-                                                            {
-                                                                pcgSetit->uid = it->uid;
-                                                                groupid = it->uid;
-                                                                break;
-                                                            }
-                                                        }
-                                                    }
-
-                                                    for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                                                    {
-                                                        pcgSetit->gid = groupid;
-                                                        PckgObj tmpPckgObj ( *pcgSetit );
-                                                        LOGD ( " -- -- -- %s:%d -- package:%s, uid:%u, gid:%u, clq:%llu", __func__, __LINE__, tmpPckgObj.package.c_str(), tmpPckgObj.uid, tmpPckgObj.gid, tmpPckgObj.clq );
-                                                        regPckgObjLst.push_back ( tmpPckgObj );
-
-                                                        if ( tmpPckgObj.uid > 0 )  //znatshe ima takif package
-                                                        {
-
-                                                            if ( tmpPckgObj.gid == tmpPckgObj.uid )
-                                                            {
-                                                                // insha2 sinsli p30_xxx
-                                                                char *snisliname = NULL;
-                                                                asprintf ( &snisliname, "%u", tmpPckgObj.gid );
-                                                                std::string snisliGidStr ( snisliname );
-                                                                if ( snisliname )
-                                                                    free ( snisliname );
-                                                                snisliname = NULL;
-
-                                                                asprintf ( &snisliname, "%llu", ( tmpPckgObj.clq<<10 ) );
-
-                                                                std::string snisliQuotaStr ( snisliname );
-                                                                if ( snisliname )
-                                                                    free ( snisliname );
-                                                                snisliname = NULL;
-
-
-                                                                reslt |= commonIpCmd ( " -N p30_" + snisliGidStr );
-
-                                                                fullCmd4.clear();
-                                                                fullCmd4.append ( IPTABLES_PATH );
-                                                                fullCmd4.append ( " -A p30_" + snisliGidStr + " -m quota2 ! --quota " + snisliQuotaStr + " --name p30_" + snisliGidStr + " --jump REJECT --reject-with icmp-net-prohibited" );
-                                                                reslt |= system_nosh ( fullCmd4.c_str() );
-
-                                                                fullCmd6.clear();
-                                                                fullCmd6.append ( IP6TABLES_PATH );
-                                                                fullCmd6.append ( " -A p30_" + snisliGidStr + " -m quota2 ! --quota " + snisliQuotaStr + " --name p30_" + snisliGidStr + " --jump REJECT --reject-with icmp6-adm-prohibited" );
-                                                                reslt |= system_nosh ( fullCmd6.c_str() );
-
-                                                                reslt |= commonIpCmd ( " -A p30_" + snisliGidStr + " --jump ACCEPT" );
-
-                                                            }
-                                                        }
-                                                    }
-
-
-                                                    /// tozi ftori loop e da garantireme che chains sa created viv gorneya loop
-                                                    for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                                                    {
-                                                        PckgObj tmpPckgObj ( *pcgSetit );
-                                                        if ( tmpPckgObj.uid > 0 )  //znatshe ima takif package
-                                                        {
-                                                            char *snisliname = NULL;
-                                                            asprintf ( &snisliname, "%u", tmpPckgObj.uid );
-                                                            std::string snisliUidStr ( snisliname );
-                                                            if ( snisliname )
-                                                                free ( snisliname );
-                                                            snisliname = NULL;
-
-                                                            asprintf ( &snisliname, "%u", tmpPckgObj.gid );
-
-                                                            std::string snisliGidStr ( snisliname );
-                                                            if ( snisliname )
-                                                                free ( snisliname );
-                                                            snisliname = NULL;
-
-                                                            reslt |= commonIpCmd ( " -I p30dw 1 -m owner --uid-owner " + snisliUidStr + " --jump p30_" + snisliGidStr );
-                                                        }
-                                                    }
-
-                                                    pckgGrpLst.clear();
-
-
-                                                    line.assign ( tmpDestStro, foundn +1 , tmpDestStro.size() - line.size() - 1 );
-                                                    tmpDestStro.assign ( line );
-                                                    foundn = tmpDestStro.find ( "," );
-                                                }
-
-                                                pthread_mutex_unlock ( &count_mutex );
-                                            }
-                                            else if ( srvValStrs["dw-restrict:"].find ( "add" ) != std::string::npos )
-                                            {
-                                                pthread_mutex_lock ( &count_mutex );
-
-                                                std::string tmpDestStro;
-                                                tmpDestStro.assign ( trimLdWSpce ( srvValStrs["dw-usageinfo:"] ) );
-
-                                                size_t foundn = tmpDestStro.find ( "," );
-                                                while ( foundn != std::string::npos )
-                                                {
-                                                    std::string line;
-                                                    unsigned long long pckgqta = 0;
-                                                    int sscanfrslt = 0;
-
-                                                    line.assign ( tmpDestStro,0,foundn );
-
-                                                    std::list<PckgObj> pckgGrpLst;
-                                                    size_t foundspc = line.find ( " " );
-                                                    while ( foundspc != std::string::npos && sscanfrslt < 2 )
-                                                    {
-                                                        char pckgname[128] = {'\0'};
-                                                        sscanfrslt = sscanf ( line.c_str(),"%s %llu", pckgname, &pckgqta );
-                                                        if ( sscanfrslt == 2 )
-                                                        {
-                                                            if ( strlen ( pckgname ) > 4 )
-                                                            {
-                                                                PckgObj tmpPckgObj ( pckgname, 0, 0, 0 );
-                                                                pckgGrpLst.push_back ( tmpPckgObj );
-                                                            }
-                                                            break;
-                                                        }
-                                                        else
-                                                        {
-                                                            sscanfrslt = sscanf ( line.c_str(),"%s", pckgname );
-                                                            if ( sscanfrslt == 1 )
-                                                            {
-                                                                std::string subline;
-                                                                subline.assign ( line, 0, foundspc );
-                                                                if ( subline.size() > 4 )
-                                                                {
-                                                                    PckgObj tmpPckgObj ( subline, 0, 0, 0 );
-                                                                    pckgGrpLst.push_back ( tmpPckgObj );
-                                                                }
-                                                                subline.assign ( line, foundspc + 1 , line.size() - subline.size() - 1 );
-                                                                line.assign ( subline );
-                                                                foundspc = line.find ( " " );
-                                                            }
-                                                        }
-                                                    }
-
-                                                    unsigned int groupid = 0;
-                                                    for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                                                    {
-                                                        pcgSetit->clq = pckgqta;
-                                                        for ( std::list<PckgObj>::iterator it = mPckgObjLst.begin(); it != mPckgObjLst.end(); ++it )
-                                                        {
-                                                            size_t found_srvpckg = it->package.find ( pcgSetit->package );
-                                                            if ( found_srvpckg != std::string::npos )
-                                                            {
-                                                                pcgSetit->uid = it->uid;
-                                                                groupid = it->uid;
-                                                                break;
-                                                            }
-                                                        }
-                                                    }
-
-                                                    for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                                                    {
-                                                        pcgSetit->gid = groupid;
-                                                        PckgObj tmpPckgObj ( *pcgSetit );
-                                                        regPckgObjLst.push_back ( tmpPckgObj );
-
-                                                        if ( tmpPckgObj.uid > 0 )  //znatshe ima takif package
-                                                        {
-
-                                                            if ( tmpPckgObj.gid == tmpPckgObj.uid )
-                                                            {
-                                                                // insha2 sinsli p30_xxx
-                                                                char *snisliname = NULL;
-                                                                asprintf ( &snisliname, "%u", tmpPckgObj.gid );
-                                                                std::string snisliGidStr ( snisliname );
-                                                                if ( snisliname )
-                                                                    free ( snisliname );
-                                                                snisliname = NULL;
-
-                                                                asprintf ( &snisliname, "%llu", ( tmpPckgObj.clq<<10 ) );
-
-                                                                std::string snisliQuotaStr ( snisliname );
-                                                                if ( snisliname )
-                                                                    free ( snisliname );
-                                                                snisliname = NULL;
-
-
-                                                                reslt |= commonIpCmd ( " -N p30_" + snisliGidStr );
-
-                                                                fullCmd4.clear();
-                                                                fullCmd4.append ( IPTABLES_PATH );
-                                                                fullCmd4.append ( " -A p30_" + snisliGidStr + " -m quota2 ! --quota " + snisliQuotaStr + " --name p30_" + snisliGidStr + " --jump REJECT --reject-with icmp-net-prohibited" );
-                                                                reslt |= system_nosh ( fullCmd4.c_str() );
-
-                                                                fullCmd6.clear();
-                                                                fullCmd6.append ( IP6TABLES_PATH );
-                                                                fullCmd6.append ( " -A p30_" + snisliGidStr + " -m quota2 ! --quota " + snisliQuotaStr + " --name p30_" + snisliGidStr + " --jump REJECT --reject-with icmp6-adm-prohibited" );
-                                                                reslt |= system_nosh ( fullCmd6.c_str() );
-
-                                                                reslt |= commonIpCmd ( " -A p30_" + snisliGidStr + " --jump ACCEPT" );
-
-                                                            }
-                                                        }
-                                                    }
-
-
-                                                    /// tozi ftori loop e da garantireme che chains sa created viv gorneya loop
-                                                    for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                                                    {
-                                                        PckgObj tmpPckgObj ( *pcgSetit );
-                                                        if ( tmpPckgObj.uid > 0 )  //znatshe ima takif package
-                                                        {
-                                                            char *snisliname = NULL;
-                                                            asprintf ( &snisliname, "%u", tmpPckgObj.uid );
-                                                            std::string snisliUidStr ( snisliname );
-                                                            if ( snisliname )
-                                                                free ( snisliname );
-                                                            snisliname = NULL;
-
-                                                            asprintf ( &snisliname, "%u", tmpPckgObj.gid );
-
-                                                            std::string snisliGidStr ( snisliname );
-                                                            if ( snisliname )
-                                                                free ( snisliname );
-                                                            snisliname = NULL;
-
-                                                            reslt |= commonIpCmd ( " -I p30dw 1 -m owner --uid-owner " + snisliUidStr + " --jump p30_" + snisliGidStr );
-                                                        }
-                                                    }
-
-                                                    pckgGrpLst.clear();
-
-
-                                                    line.assign ( tmpDestStro, foundn +1 , tmpDestStro.size() - line.size() - 1 );
-                                                    tmpDestStro.assign ( line );
-                                                    foundn = tmpDestStro.find ( "," );
-                                                }
-
-                                                pthread_mutex_unlock ( &count_mutex );
-                                            }
-                                            else if ( srvValStrs["dw-restrict:"].find ( "rem" ) != std::string::npos )
-                                            {
-                                                pthread_mutex_lock ( &count_mutex );
-
-                                                std::string tmpDestStro;
-                                                tmpDestStro.assign ( trimLdWSpce ( srvValStrs["dw-usageinfo:"] ) );
-
-                                                size_t foundn = tmpDestStro.find ( "," );
-                                                while ( foundn != std::string::npos )
-                                                {
-                                                    std::string line;
-                                                    unsigned long long pckgqta = 0;
-                                                    int sscanfrslt = 0;
-                                                    unsigned int groupid = 0;
-                                                    line.assign ( tmpDestStro,0,foundn );
-
-                                                    std::list<PckgObj> pckgGrpLst;
-                                                    size_t foundspc = line.find ( " " );
-                                                    while ( foundspc != std::string::npos && sscanfrslt < 2 )
-                                                    {
-                                                        char pckgname[128] = {'\0'};
-                                                        sscanfrslt = sscanf ( line.c_str(),"%s %llu", pckgname, &pckgqta );
-                                                        if ( sscanfrslt == 2 )
-                                                        {
-                                                            PckgObj tmpPckgObj ( pckgname, 0, 0, 0 );
-                                                            pckgGrpLst.push_back ( tmpPckgObj );
-                                                            break;
-                                                        }
-                                                        else
-                                                        {
-                                                            sscanfrslt = sscanf ( line.c_str(),"%s", pckgname );
-                                                            if ( sscanfrslt == 1 )
-                                                            {
-                                                                std::string subline;
-                                                                subline.assign ( line, 0, foundspc );
-                                                                PckgObj tmpPckgObj ( subline, 0, 0, 0 );
-                                                                pckgGrpLst.push_back ( tmpPckgObj );
-                                                                subline.assign ( line, foundspc + 1 , line.size() - subline.size() - 1 );
-                                                                line.assign ( subline );
-                                                                foundspc = line.find ( " " );
-                                                            }
-                                                        }
-                                                    }
-
-                                                    std::set<std::string> chnXSet; // guarantee -F before -X
-                                                    for ( std::list<PckgObj>::iterator pcgSetit = pckgGrpLst.begin(); pcgSetit != pckgGrpLst.end(); ++pcgSetit )
-                                                    {
-                                                        for ( std::list<PckgObj>::iterator it = regPckgObjLst.begin(); it != regPckgObjLst.end(); ++it )
-                                                        {
-                                                            size_t found_srvpckg = it->package.find ( pcgSetit->package );
-                                                            if ( found_srvpckg != std::string::npos )
-                                                            {
-                                                                if ( it->uid > 0 )
-                                                                {
-                                                                    if ( it->gid == it->uid )
-                                                                    {
-                                                                        groupid = it->gid;
-
-                                                                        char * tmpStro = NULL;
-                                                                        asprintf ( &tmpStro," -D p30dw -m owner --uid-owner %u --jump p30_%u", it->uid, it->gid );
-                                                                        reslt |= commonIpCmd ( tmpStro );
-
-                                                                        if ( tmpStro )
-                                                                            free ( tmpStro );
-                                                                        tmpStro = NULL;
-
-                                                                        asprintf ( &tmpStro," -F p30_%u", it->gid );
-                                                                        chnXSet.insert ( tmpStro );
-
-                                                                        if ( tmpStro )
-                                                                            free ( tmpStro );
-                                                                        tmpStro = NULL;
-
-                                                                        asprintf ( &tmpStro," -X p30_%u", it->gid );
-                                                                        chnXSet.insert ( tmpStro );
-
-                                                                        if ( tmpStro )
-                                                                            free ( tmpStro );
-                                                                        tmpStro = NULL;
-                                                                    }
-                                                                    else
-                                                                    {
-                                                                        char * tmpStro = NULL;
-                                                                        asprintf ( &tmpStro," -D p30dw -m owner --uid-owner %u --jump p30_%u", it->uid, it->gid );
-                                                                        reslt |= commonIpCmd ( tmpStro );
-
-                                                                        if ( tmpStro )
-                                                                            free ( tmpStro );
-                                                                        tmpStro = NULL;
-                                                                    }
-                                                                }
-
-                                                                regPckgObjLst.erase ( it );
-                                                                break;
-                                                            }
-                                                        }
-
-                                                    }
-
-                                                    bool grpUsd = false;
-                                                    for ( std::list<PckgObj>::iterator it = regPckgObjLst.begin(); it != regPckgObjLst.end(); ++it )
-                                                    {
-                                                        if ( it->gid == groupid )
-                                                        {
-                                                            grpUsd = true;
-                                                            break;
-                                                        }
-
-                                                    }
-
-                                                    if ( !grpUsd &&  groupid != 0 )
-                                                    {
-                                                        for ( std::set<std::string>::iterator it = chnXSet.begin(); it != chnXSet.end(); ++it )
-                                                        {
-                                                            reslt |= commonIpCmd ( *it );
-                                                        }
-                                                    }
-
-                                                    chnXSet.clear();
-
-                                                    pckgGrpLst.clear();
-
-
-                                                    line.assign ( tmpDestStro, foundn + 1 , tmpDestStro.size() - line.size() - 1 );
-                                                    tmpDestStro.assign ( line );
-                                                    foundn = tmpDestStro.find ( "," );
-                                                }
-
-                                                pthread_mutex_unlock ( &count_mutex );
-                                            }
-
+                                            break;
                                         }
-
                                     }
 
                                 }
-                                else
+
+                                if ( srvValStrs["dw-message:"].find ( "Success" ) && srvValStrs["dw-error:"].find ( "0" ) )
                                 {
-                                    LOGE ( " ## ## %s , curl_easy_init failed " , __func__ );
-
-                                    if ( chunk.memory )
-                                        free ( chunk.memory );
-                                    chunk.memory = NULL;
-                                    if ( bodyChunk.memory )
-                                        free ( bodyChunk.memory );
-                                    bodyChunk.memory = NULL;
-
-                                    if ( postrequest )
-                                        free ( postrequest );
-                                    postrequest = NULL;
-                                    if ( response )
-                                        free ( response );
-                                    response = NULL;
-
-                                    curl_global_cleanup();
+                                    PolicyDelta delta;
+                                    if ( PolicyDelta::parse ( srvValStrs["dw-restrict:"], srvValStrs["dw-usageinfo:"], delta ) == 0 )
+                                    {
+                                        pthread_mutex_lock ( &count_mutex );
+                                        int ret = applyPolicyDelta ( delta );
+                                        pthread_mutex_unlock ( &count_mutex );
+                                        reslt |= ret;
+
+                                        // a 304 is only trusted once qtareg has the policy
+                                        if ( ret == 0 && saveQtaReg() == 0 )
+                                            syncClient.commitETag();
+                                    }
                                 }
                             }
                         }
                     }
 
+                    if ( found_cnfgdt )
+                        break;
+
                     cnfgdtcounter++ ;
                     usleep ( 50000000 );
                 }
@@ -20,34 +20,15 @@
 #include <string>
 #include <list>
 #include<map>
+#include <set>
 #include <pthread.h>
 #include <sysutils/FrameworkListener.h>
 
+#include "IptablesRuleSet.h"
 #include "NetdCommand.h"
-
-class PckgObj
-{
-public:
-    PckgObj ( std::string pckgname = "", unsigned int puid = 0, unsigned int guid = 0, unsigned long long qta = 0 ) :package ( pckgname ),uid ( puid ), gid ( guid ) ,clq ( qta ) {}
-    ~PckgObj() {}
-    PckgObj ( const PckgObj& cctor ) :package ( cctor.package ),uid ( cctor.uid ), gid ( cctor.gid ), clq ( cctor.clq ) {}
-    PckgObj& operator= ( const PckgObj& assign_opt )
-    {
-        if ( this == &assign_opt )
-            return *this;
-        package = assign_opt.package;
-        uid = assign_opt.uid;
-        gid = assign_opt.gid;
-        clq = assign_opt.clq;
-        return *this;
-    }
-
-    std::string package;
-    unsigned int uid;
-    unsigned int gid;
-    unsigned long long clq;
-};
-
+#include "PckgRegistry.h"
+#include "PolicyDelta.h"
+#include "QuotaJournal.h"
 
 class OEMListener
 {
@@ -56,28 +37,107 @@ public:
     virtual ~OEMListener()
     {
         stopFuncs = true;
-        mPckgObjLst.clear();
-        regPckgObjLst.clear();
+        mPckgObjReg.clear();
+        regPckgObjReg.clear();
     }
     void SrvrFunction();
     void CountFunction();
+    void PckgWatchFunction();
     void wait_for_SrvrExit();
+    int singleIpCmd ( bool isIpv6, std::string cmd );
     int commonIpCmd ( std:: string cmd );
     int infStr ( FILE *source, std::string& rtrnStr );
-    int defStr ( std::string srcStr, FILE *dest );
     std::string DeflateString ( const std::string& str );
     std::string urlEncode ( std::string regstr );
-    std::string trimLdWSpce ( std::string regstr );
+    /* Makes CountFunction() read the counters now, for a p30_<gid> quota2 alert. */
+    static void notifyQuotaEvent ( const char *alertName );
+    /* Makes CountFunction() rebuild the p30 chains, after BandwidthController flushed them. */
+    static void notifyTablesFlushed();
 private:
+    /*
+     * The p30dw and p30_<gid> chains are rendered from regPckgObjReg into
+     * a model. p30dw jumps to p30uid, a tree of --uid-owner range
+     * sub-chains (see IptablesRuleSet::setUidTree()) whose leaves jump
+     * to the p30_<gid> of each uid, so a packet walks a few rules instead
+     * of one per registered package, and applyRules() commits only the difference with the last
+     * committed model, in one iptables-restore transaction per IP version.
+     * With reset, the p30 chains left in the kernel by a previous netd are
+     * flushed in the same transaction. Call with count_mutex held.
+     * A commit that fails leaves mRulesStale set, and the rules are
+     * rebuilt with reset until one succeeds.
+     */
+    int applyRules ( bool reset );
+    /*
+     * The groups already in fromGrpQtas keep their quota, unless in
+     * mNewQtaGids, so a render does not restart the live counters.
+     */
+    int renderRules ( IptablesRuleSet& rules, std::map<unsigned int, unsigned long long>& grpQtas,
+                      const std::map<unsigned int, unsigned long long>& fromGrpQtas );
+    int getRstCmds ( int family, std::list<std::string>& rstCmds );
+    int runRuleChanges ( std::list<std::string>& v4Cmds, std::list<std::string>& v6Cmds,
+                         const std::list<IptablesRuleSet::Rule>& changes );
+    /* Restarts the p30_<gid> quota2 counter at bytes. */
+    int setGrpQuota ( unsigned int gid, unsigned long long bytes );
+
+    /*
+     * CountFunction() reads each p30_<gid> counter once per round with
+     * pread() on an fd kept open in mQtaFds, only used by its thread.
+     * nextCountDelay() picks the time to the next round from the drain
+     * rate: shorter as a quota runs out, longer while nothing is used.
+     */
+    int readGrpQuota ( unsigned int gid, unsigned long long& bytes );
+    void closeGrpQuotaFd ( unsigned int gid );
+    int nextCountDelay ( const std::map<unsigned int, unsigned long long>& prvQtas,
+                         const std::map<unsigned int, unsigned long long>& qtas, int elapsedMs );
+
+    /* Applies a dw-restrict change to regPckgObjReg and the rules. Call with count_mutex held. */
+    int applyPolicyDelta ( const PolicyDelta& delta );
+
+    /*
+     * PckgWatchFunction() watches packages.list with inotify and
+     * syncPckgLst() applies the packages installed or removed since the
+     * last read to mPckgObjReg, and their uids to the registered
+     * packages, so applyRules() only commits the rules of those uids.
+     */
+    int readPckgLst ( PckgRegistry& pckgs, std::set<unsigned int>& sysUids );
+    int syncPckgLst();
+
+    /* Writes regPckgObjReg to qtareg. Call without count_mutex held. */
+    int saveQtaReg();
+
+    /* Reads a qtareg in the deflated text format of older builds. */
+    int readOldQtaReg ( std::list<PckgObj>& pckgLst );
+
     bool stopFuncs;
-    std::string prvUzlibdStr;
+    bool mNoRestrict;
+    bool mRulesReady;
+    bool mRulesStale;
     static const char INTERFACE[];
     static const char IPTABLES_PATH[];
     static const char IP6TABLES_PATH[];
-    pthread_t mSrvrThread, mCountThread;
-    std::list<PckgObj> mPckgObjLst;
-    std::list<PckgObj> regPckgObjLst;
+    static const char QTAREG_PATH[];
+    static const char CONFIGDATA_PATH[];
+    static const char SYNC_URL[];
+    static const char SYNC_ETAG_PATH[];
+    static const char PCKGLST_DIR[];
+    static const char PCKGLST_NAME[];
+    static const int PCKGLST_SETTLE_MS;
+    static const int PCKGLST_POLL_MS;
+    static const int COUNT_MIN_DELAY_MS;
+    static const int COUNT_DELAY_MS;
+    static const int COUNT_IDLE_DELAY_MS;
+    pthread_t mSrvrThread, mCountThread, mPckgThread;
+    PckgRegistry mPckgObjReg;
+    PckgRegistry regPckgObjReg;
     std::map<char, std::string> mRsrvdUrl;
+    /* UIDs that always go through p30_1000 */
+    std::set<unsigned int> mSysUidSet;
+    IptablesRuleSet committedRules;
+    std::map<unsigned int, unsigned long long> committedGrpQtas;
+    /* Groups whose quota the server set since the last applyRules() */
+    std::set<unsigned int> mNewQtaGids;
+    std::map<unsigned int, int> mQtaFds;
+    QuotaJournal mQtaJournal;
 };
 
 #endif
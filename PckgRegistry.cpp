@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PckgRegistry.h"
+
+void PckgRegistry::addToIndex(IdIndex &index, unsigned int id, PckgIterator pckgIt) {
+    index[id].push_back(pckgIt);
+}
+
+void PckgRegistry::removeFromIndex(IdIndex &index, unsigned int id, PckgIterator pckgIt) {
+    IdIndex::iterator indexIt = index.find(id);
+    std::list<PckgIterator>::iterator it;
+
+    if (indexIt == index.end())
+        return;
+    for (it = indexIt->second.begin(); it != indexIt->second.end(); it++) {
+        if (*it == pckgIt) {
+            indexIt->second.erase(it);
+            break;
+        }
+    }
+    if (indexIt->second.empty()) {
+        index.erase(indexIt);
+    }
+}
+
+void PckgRegistry::add(const PckgObj &pckg) {
+    PckgIterator pckgIt;
+
+    remove(pckg.package);
+    pckgIt = mPckgs.insert(mPckgs.end(), pckg);
+    mByName[pckg.package] = pckgIt;
+    addToIndex(mByUid, pckg.uid, pckgIt);
+    addToIndex(mByGid, pckg.gid, pckgIt);
+}
+
+bool PckgRegistry::remove(const std::string &package) {
+    std::map<std::string, PckgIterator>::iterator nameIt = mByName.find(package);
+    PckgIterator pckgIt;
+
+    if (nameIt == mByName.end())
+        return false;
+    pckgIt = nameIt->second;
+    removeFromIndex(mByUid, pckgIt->uid, pckgIt);
+    removeFromIndex(mByGid, pckgIt->gid, pckgIt);
+    mByName.erase(nameIt);
+    mPckgs.erase(pckgIt);
+    return true;
+}
+
+bool PckgRegistry::setUid(const std::string &package, unsigned int uid) {
+    std::map<std::string, PckgIterator>::iterator nameIt = mByName.find(package);
+    PckgIterator pckgIt;
+
+    if (nameIt == mByName.end())
+        return false;
+    pckgIt = nameIt->second;
+    removeFromIndex(mByUid, pckgIt->uid, pckgIt);
+    pckgIt->uid = uid;
+    addToIndex(mByUid, uid, pckgIt);
+    return true;
+}
+
+void PckgRegistry::clear(void) {
+    mByName.clear();
+    mByUid.clear();
+    mByGid.clear();
+    mPckgs.clear();
+}
+
+const PckgObj *PckgRegistry::find(const std::string &package) const {
+    std::map<std::string, PckgIterator>::const_iterator it = mByName.find(package);
+
+    return it == mByName.end() ? NULL : &*it->second;
+}
+
+const PckgObj *PckgRegistry::findUid(unsigned int uid) const {
+    IdIndex::const_iterator it = mByUid.find(uid);
+
+    return it == mByUid.end() ? NULL : &*it->second.back();
+}
+
+const PckgObj *PckgRegistry::findGroupOwner(unsigned int gid) const {
+    IdIndex::const_iterator it = mByGid.find(gid);
+    std::list<PckgIterator>::const_iterator memberIt;
+
+    if (it == mByGid.end())
+        return NULL;
+    for (memberIt = it->second.begin(); memberIt != it->second.end(); memberIt++) {
+        if ((*memberIt)->uid == gid)
+            return &**memberIt;
+    }
+    return &*it->second.front();
+}
+
+void PckgRegistry::getUids(std::list<unsigned int> &uids) const {
+    IdIndex::const_iterator it;
+
+    for (it = mByUid.begin(); it != mByUid.end(); it++) {
+        uids.push_back(it->first);
+    }
+}
+
+void PckgRegistry::getGroupIds(std::list<unsigned int> &gids) const {
+    IdIndex::const_iterator it;
+
+    for (it = mByGid.begin(); it != mByGid.end(); it++) {
+        gids.push_back(it->first);
+    }
+}
+
+void PckgRegistry::setGroupClq(unsigned int gid, unsigned long long clq) {
+    IdIndex::iterator it = mByGid.find(gid);
+    std::list<PckgIterator>::iterator memberIt;
+
+    if (it == mByGid.end())
+        return;
+    for (memberIt = it->second.begin(); memberIt != it->second.end(); memberIt++) {
+        (*memberIt)->clq = clq;
+    }
+}
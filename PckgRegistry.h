@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PCKG_REGISTRY_H
+#define _PCKG_REGISTRY_H
+
+#include <list>
+#include <map>
+#include <string>
+
+class PckgObj
+{
+public:
+    PckgObj ( std::string pckgname = "", unsigned int puid = 0, unsigned int guid = 0, unsigned long long qta = 0 ) :package ( pckgname ),uid ( puid ), gid ( guid ) ,clq ( qta ) {}
+    ~PckgObj() {}
+    PckgObj ( const PckgObj& cctor ) :package ( cctor.package ),uid ( cctor.uid ), gid ( cctor.gid ), clq ( cctor.clq ) {}
+    PckgObj& operator= ( const PckgObj& assign_opt )
+    {
+        if ( this == &assign_opt )
+            return *this;
+        package = assign_opt.package;
+        uid = assign_opt.uid;
+        gid = assign_opt.gid;
+        clq = assign_opt.clq;
+        return *this;
+    }
+
+    std::string package;
+    unsigned int uid;
+    unsigned int gid;
+    unsigned long long clq;
+};
+
+/*
+ * Packages in registration order, indexed by exact package name, by uid
+ * and by group id. Several packages can share a uid (sharedUserId) and
+ * a group; the indexes keep them in registration order too.
+ */
+class PckgRegistry {
+public:
+    typedef std::list<PckgObj>::const_iterator const_iterator;
+
+    const_iterator begin(void) const { return mPckgs.begin(); }
+    const_iterator end(void) const { return mPckgs.end(); }
+    size_t size(void) const { return mPckgs.size(); }
+    bool empty(void) const { return mPckgs.empty(); }
+    const std::list<PckgObj> &getPckgs(void) const { return mPckgs; }
+
+    /* Adds pckg last, replacing the package of the same name if any. */
+    void add(const PckgObj &pckg);
+    /* Returns false if the package is not registered. */
+    bool remove(const std::string &package);
+    void clear(void);
+    /* Moves the package to uid, as the last package registered with it. */
+    bool setUid(const std::string &package, unsigned int uid);
+
+    /* All of these return NULL when nothing matches. */
+    const PckgObj *find(const std::string &package) const;
+    /* The last package registered with the uid. */
+    const PckgObj *findUid(unsigned int uid) const;
+    /* The package whose uid names the group, else the first one of the group. */
+    const PckgObj *findGroupOwner(unsigned int gid) const;
+
+    void getUids(std::list<unsigned int> &uids) const;
+    void getGroupIds(std::list<unsigned int> &gids) const;
+
+    /* Sets the remaining KB of every package of the group. */
+    void setGroupClq(unsigned int gid, unsigned long long clq);
+
+private:
+    typedef std::list<PckgObj>::iterator PckgIterator;
+    typedef std::map<unsigned int, std::list<PckgIterator> > IdIndex;
+
+    static void addToIndex(IdIndex &index, unsigned int id, PckgIterator pckgIt);
+    static void removeFromIndex(IdIndex &index, unsigned int id, PckgIterator pckgIt);
+
+    std::list<PckgObj> mPckgs;
+    std::map<std::string, PckgIterator> mByName;
+    IdIndex mByUid;
+    IdIndex mByGid;
+};
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "PolicyDelta"
+#include <cutils/log.h>
+
+#include "PolicyDelta.h"
+
+/* Shorter names are dropped, as they always were. */
+static const size_t MIN_PACKAGE_LEN = 5;
+
+bool PolicyDelta::parseNumber(const StrSpan &token, unsigned long long &value) {
+    unsigned long long number = 0;
+    size_t i;
+
+    for (i = 0; i < token.size; i++) {
+        if (token.data[i] < '0' || token.data[i] > '9')
+            return false;
+        if (number > (~0ULL - (token.data[i] - '0')) / 10)
+            return false;
+        number = number * 10 + (token.data[i] - '0');
+    }
+    value = number;
+    return token.size != 0;
+}
+
+int PolicyDelta::parse(const std::string &restrictStr, const std::string &usageInfo,
+                       PolicyDelta &delta) {
+    const char *ptr = restrictStr.data();
+    const char *end = ptr + restrictStr.size();
+    const char *start;
+    Group *group = NULL;
+    bool groupDone = false;
+    StrSpan token;
+
+    delta.action = NONE;
+    delta.groups.clear();
+
+    while (ptr < end && isBlank(*ptr))
+        ptr++;
+    start = ptr;
+    while (ptr < end && !isBlank(*ptr))
+        ptr++;
+    token = StrSpan(start, ptr - start);
+    if (token.equals("no")) {
+        delta.action = NO_RESTRICT;
+        return 0;
+    } else if (token.equals("new")) {
+        delta.action = NEW;
+    } else if (token.equals("add")) {
+        delta.action = ADD;
+    } else if (token.equals("rem")) {
+        delta.action = REMOVE;
+    } else {
+        LOGE("Unknown dw-restrict %s", restrictStr.c_str());
+        return -1;
+    }
+
+    /*
+     * The first number after a package ends the group, anything up to
+     * the comma after it is ignored. A group without its comma at the
+     * end of the string is dropped.
+     */
+    ptr = usageInfo.data();
+    end = ptr + usageInfo.size();
+    while (ptr < end) {
+        if (isBlank(*ptr)) {
+            ptr++;
+            continue;
+        }
+        if (*ptr == ',') {
+            if (group && group->packages.empty())
+                delta.groups.pop_back();
+            group = NULL;
+            groupDone = false;
+            ptr++;
+            continue;
+        }
+
+        start = ptr;
+        while (ptr < end && !isBlank(*ptr) && *ptr != ',')
+            ptr++;
+        token = StrSpan(start, ptr - start);
+
+        if (!group) {
+            delta.groups.push_back(Group());
+            group = &delta.groups.back();
+        }
+        if (groupDone)
+            continue;
+        if (!group->packages.empty() && parseNumber(token, group->clq)) {
+            groupDone = true;
+        } else if (token.size >= MIN_PACKAGE_LEN) {
+            group->packages.push_back(token);
+        }
+    }
+    if (group)
+        delta.groups.pop_back();
+    return 0;
+}
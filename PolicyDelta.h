@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _POLICY_DELTA_H
+#define _POLICY_DELTA_H
+
+#include <string.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+/* A run of chars inside a string owned by someone else, not NUL terminated. */
+class StrSpan {
+public:
+    StrSpan() : data(NULL), size(0) {}
+    StrSpan(const char *d, size_t s) : data(d), size(s) {}
+
+    std::string str(void) const { return std::string(data, size); }
+    bool equals(const char *s) const { return strlen(s) == size && !memcmp(data, s, size); }
+
+    const char *data;
+    size_t size;
+};
+
+/*
+ * The change of the restricted package set sent by the server:
+ * dw-restrict is one of "no", "new", "add" or "rem", and dw-usageinfo
+ * holds comma terminated groups of space separated package names, each
+ * ended by the remaining KB of the group, e.g.
+ *   "com.a.one com.a.two 10240,com.b 2048,"
+ * Package names are spans into the dw-usageinfo string, which has to
+ * outlive the PolicyDelta.
+ */
+class PolicyDelta {
+public:
+    enum Action { NONE, NO_RESTRICT, NEW, ADD, REMOVE };
+
+    class Group {
+    public:
+        Group() : clq(0) {}
+
+        std::vector<StrSpan> packages;
+        unsigned long long clq;
+    };
+
+    PolicyDelta() : action(NONE) {}
+
+    /*
+     * Tokenizes both values in one pass, without copying them.
+     * Returns -1 if dw-restrict is not a known action.
+     */
+    static int parse(const std::string &restrictStr, const std::string &usageInfo,
+                     PolicyDelta &delta);
+
+    Action action;
+    std::list<Group> groups;
+
+private:
+    static bool isBlank(char c) { return c == ' ' || c == '\t'; }
+    static bool parseNumber(const StrSpan &token, unsigned long long &value);
+};
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// #define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LOG_TAG "QuotaJournal"
+#include <cutils/log.h>
+
+#include "PckgRegistry.h"
+#include "QuotaJournal.h"
+
+const uint32_t QuotaJournal::MAGIC = 0x4a415451;  /* "QTAJ" */
+const uint32_t QuotaJournal::VERSION = 2;
+/* magic and version only */
+const size_t QuotaJournal::V1_HEADER_SIZE = 8;
+const uint32_t QuotaJournal::PCKG_TAG = 0x50;
+const uint32_t QuotaJournal::GROUP_TAG = 0x47;
+/* 8KB of GroupRecords */
+const int QuotaJournal::MAX_APPENDS = 512;
+
+QuotaJournal::QuotaJournal(const char *path) :
+                mPath(path), mFd(-1), mNumAppends(0) {
+}
+
+QuotaJournal::~QuotaJournal() {
+    closeFd();
+}
+
+void QuotaJournal::closeFd(void) {
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
+    }
+}
+
+int QuotaJournal::writeAll(int fd, const void *buf, size_t len) {
+    const char *ptr = (const char *) buf;
+
+    while (len) {
+        ssize_t written = write(fd, ptr, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += written;
+        len -= written;
+    }
+    return 0;
+}
+
+std::string QuotaJournal::makePckgKey(const std::list<PckgObj> &packages) {
+    std::list<PckgObj>::const_iterator it;
+    std::string key;
+    char *buff;
+
+    for (it = packages.begin(); it != packages.end(); it++) {
+        asprintf(&buff, "%s %u %u,", it->package.c_str(), it->uid, it->gid);
+        key += buff;
+        free(buff);
+    }
+    return key;
+}
+
+int QuotaJournal::read(std::list<PckgObj> &packages) {
+    std::map<unsigned int, unsigned long long> groupClqs;
+    std::map<unsigned int, unsigned long long>::iterator groupIt;
+    std::list<PckgObj>::iterator it;
+    std::list<PckgObj> filePackages;
+    const PckgRecord *pckgRec;
+    const GroupRecord *groupRec;
+    const Header *header;
+    const char *base;
+    struct stat sb;
+    size_t offset;
+    uint32_t numPckgs = 0;
+    int res = 0;
+    int fd;
+
+    fd = open(mPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fstat(fd, &sb) || (size_t) sb.st_size < V1_HEADER_SIZE) {
+        close(fd);
+        return 1;
+    }
+    base = (const char *) mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOGE("Failed to map %s (%s)", mPath.c_str(), strerror(errno));
+        return -1;
+    }
+
+    header = (const Header *) base;
+    if (header->magic != MAGIC) {
+        munmap((void *) base, sb.st_size);
+        return 1;
+    }
+    if (header->version == 1) {
+        offset = V1_HEADER_SIZE;
+    } else if (header->version == VERSION && (size_t) sb.st_size >= sizeof(Header)
+            && header->numPckgs <= (sb.st_size - sizeof(Header)) / sizeof(PckgRecord)) {
+        numPckgs = header->numPckgs;
+        offset = sizeof(Header);
+        if (crc32(0, (const Bytef *) base + offset, numPckgs * sizeof(PckgRecord))
+                != header->checksum) {
+            LOGE("Bad snapshot checksum in %s", mPath.c_str());
+            munmap((void *) base, sb.st_size);
+            return -1;
+        }
+    } else {
+        LOGE("Unsupported version %u in %s", header->version, mPath.c_str());
+        munmap((void *) base, sb.st_size);
+        return -1;
+    }
+
+    /*
+     * One pass over the records in place: the snapshot, then the usage
+     * appended since, of which the last one per group wins.
+     * Version 1 files have no package count, their records are told
+     * apart by tag.
+     */
+    while (offset + sizeof(GroupRecord) <= (size_t) sb.st_size) {
+        groupRec = (const GroupRecord *) (base + offset);
+        if (groupRec->tag == PCKG_TAG && (header->version == 1 || numPckgs)) {
+            if (offset + sizeof(PckgRecord) > (size_t) sb.st_size) {
+                break;
+            }
+            pckgRec = (const PckgRecord *) (base + offset);
+            if (!memchr(pckgRec->package, '\0', sizeof(pckgRec->package))) {
+                LOGE("Bad package record in %s", mPath.c_str());
+                res = -1;
+                break;
+            }
+            filePackages.push_back(PckgObj(pckgRec->package, pckgRec->uid, pckgRec->gid,
+                                           pckgRec->clq));
+            offset += sizeof(PckgRecord);
+            if (numPckgs)
+                numPckgs--;
+        } else if (groupRec->tag == GROUP_TAG && !numPckgs) {
+            groupClqs[groupRec->gid] = groupRec->clq;
+            offset += sizeof(GroupRecord);
+        } else {
+            LOGE("Bad record tag 0x%x in %s", groupRec->tag, mPath.c_str());
+            res = -1;
+            break;
+        }
+    }
+    munmap((void *) base, sb.st_size);
+
+    for (it = filePackages.begin(); it != filePackages.end() && !groupClqs.empty(); it++) {
+        groupIt = groupClqs.find(it->gid);
+        if (groupIt != groupClqs.end())
+            it->clq = groupIt->second;
+    }
+    packages.splice(packages.end(), filePackages);
+    return res;
+}
+
+int QuotaJournal::compact(const std::list<PckgObj> &packages) {
+    std::list<PckgObj>::const_iterator it;
+    std::string tmpPath = mPath + ".tmp";
+    std::string buffer;
+    Header header;
+    PckgRecord pckgRec;
+    int fd;
+
+    closeFd();
+    mGroupClqs.clear();
+    mNumAppends = 0;
+    mPckgKey.clear();
+
+    /* The header goes in front once the snapshot checksum is known. */
+    for (it = packages.begin(); it != packages.end(); it++) {
+        if (it->package.size() >= sizeof(pckgRec.package)) {
+            LOGE("Package name %s too long", it->package.c_str());
+            continue;
+        }
+        memset(&pckgRec, 0, sizeof(pckgRec));
+        pckgRec.tag = PCKG_TAG;
+        pckgRec.uid = it->uid;
+        pckgRec.gid = it->gid;
+        pckgRec.clq = it->clq;
+        strcpy(pckgRec.package, it->package.c_str());
+        buffer.append((const char *) &pckgRec, sizeof(pckgRec));
+        mGroupClqs[it->gid] = it->clq;
+    }
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.numPckgs = buffer.size() / sizeof(PckgRecord);
+    header.checksum = crc32(0, (const Bytef *) buffer.data(), buffer.size());
+    buffer.insert(0, (const char *) &header, sizeof(header));
+
+    fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGE("Failed to open %s (%s)", tmpPath.c_str(), strerror(errno));
+        return -1;
+    }
+    if (writeAll(fd, buffer.data(), buffer.size()) || fsync(fd)) {
+        LOGE("Failed to write %s (%s)", tmpPath.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+    close(fd);
+    if (rename(tmpPath.c_str(), mPath.c_str())) {
+        LOGE("Failed to rename %s (%s)", tmpPath.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+
+    mFd = open(mPath.c_str(), O_WRONLY | O_APPEND);
+    if (mFd < 0) {
+        LOGE("Failed to open %s (%s)", mPath.c_str(), strerror(errno));
+        return -1;
+    }
+    mPckgKey = makePckgKey(packages);
+    LOGV("Compacted %d packages into %s", (int) packages.size(), mPath.c_str());
+    return 0;
+}
+
+int QuotaJournal::append(const std::list<PckgObj> &packages) {
+    std::map<unsigned int, unsigned long long> groupClqs;
+    std::map<unsigned int, unsigned long long>::iterator it;
+    std::map<unsigned int, unsigned long long>::iterator writtenIt;
+    std::list<PckgObj>::const_iterator pckgIt;
+    std::string buffer;
+    GroupRecord groupRec;
+    int numRecords = 0;
+
+    for (pckgIt = packages.begin(); pckgIt != packages.end(); pckgIt++) {
+        groupClqs[pckgIt->gid] = pckgIt->clq;
+    }
+    for (it = groupClqs.begin(); it != groupClqs.end(); it++) {
+        writtenIt = mGroupClqs.find(it->first);
+        if (writtenIt != mGroupClqs.end() && writtenIt->second == it->second)
+            continue;
+        groupRec.tag = GROUP_TAG;
+        groupRec.gid = it->first;
+        groupRec.clq = it->second;
+        buffer.append((const char *) &groupRec, sizeof(groupRec));
+        numRecords++;
+    }
+    if (!numRecords) {
+        return 0;
+    }
+
+    if (writeAll(mFd, buffer.data(), buffer.size()) || fdatasync(mFd)) {
+        LOGE("Failed to append to %s (%s)", mPath.c_str(), strerror(errno));
+        /* The next update() compacts. */
+        closeFd();
+        return -1;
+    }
+    mGroupClqs = groupClqs;
+    mNumAppends += numRecords;
+    return 0;
+}
+
+int QuotaJournal::update(const std::list<PckgObj> &packages) {
+    if (mFd < 0 || mNumAppends >= MAX_APPENDS || makePckgKey(packages) != mPckgKey) {
+        return compact(packages);
+    }
+    return append(packages);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _QUOTA_JOURNAL_H
+#define _QUOTA_JOURNAL_H
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+class PckgObj;
+
+/*
+ * Keeps the OEM package quota registry (package, uid, gid and remaining
+ * KB) on flash as fixed-size binary records:
+ *   Header, one PckgRecord per package, then GroupRecords.
+ * The Header holds the package count and a crc32 of the PckgRecords, the
+ * snapshot, which read() checks and walks in place in an mmap()ed copy.
+ * A GroupRecord is appended when the remaining KB of a group changes,
+ * and it applies to every package of the group. The file is rewritten
+ * to a temp file and renamed over the old one when the package set
+ * changes or too many GroupRecords piled up.
+ */
+class QuotaJournal {
+public:
+    QuotaJournal(const char *path);
+    virtual ~QuotaJournal();
+
+    /*
+     * Appends the packages of the file, with the usage of the last
+     * GroupRecords applied, in one pass over the mapped file.
+     * A torn record at the end is ignored.
+     * Returns 1 if the file is not a journal, e.g. the old deflated
+     * format, -1 on errors and 0 on success.
+     */
+    int read(std::list<PckgObj> &packages);
+
+    /*
+     * Saves packages: only appends a GroupRecord per changed group when
+     * the package set is the one last written, compacts otherwise.
+     * Returns 0 on success.
+     */
+    int update(const std::list<PckgObj> &packages);
+
+private:
+    static const uint32_t MAGIC;
+    static const uint32_t VERSION;
+    static const size_t V1_HEADER_SIZE;
+    static const uint32_t PCKG_TAG;
+    static const uint32_t GROUP_TAG;
+    static const int MAX_APPENDS;
+
+    class Header {
+    public:
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numPckgs;
+        uint32_t checksum;  /* crc32 of the numPckgs PckgRecords */
+    };
+
+    class PckgRecord {
+    public:
+        uint32_t tag;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t reserved;
+        uint64_t clq;
+        char package[128];
+    };
+
+    class GroupRecord {
+    public:
+        uint32_t tag;
+        uint32_t gid;
+        uint64_t clq;
+    };
+
+    /* Rewrites the file with packages through a temp file and rename(). */
+    int compact(const std::list<PckgObj> &packages);
+    int append(const std::list<PckgObj> &packages);
+    static std::string makePckgKey(const std::list<PckgObj> &packages);
+    static int writeAll(int fd, const void *buf, size_t len);
+    void closeFd(void);
+
+    std::string mPath;
+    int mFd;             /* O_APPEND fd of the compacted file, -1 before the first compact() */
+    int mNumAppends;
+    std::string mPckgKey;  /* package uid gid of the packages last compacted */
+    std::map<unsigned int, unsigned long long> mGroupClqs;  /* as written */
+};
+
+#endif
@@ -28,6 +28,10 @@ public:
     static const int TetherInterfaceListResult = 111;
     static const int TetherDnsFwdTgtListResult = 112;
     static const int TtyListResult             = 113;
+    static const int TetheringStatsListResult  = 114;
+    static const int QuotaCounterListResult    = 115;
+    static const int UidStatsListResult        = 116;
+    static const int CounterHistoryListResult  = 117;
 
 
     // 200 series - Requested action has been successfully completed
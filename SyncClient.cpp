@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "SyncClient"
+#include <cutils/log.h>
+
+#include "SyncClient.h"
+
+const int SyncClient::MIN_BACKOFF_MS = 5000;
+const int SyncClient::MAX_BACKOFF_MS = 600000;
+const long SyncClient::CONNECT_TIMEOUT_S = 30;
+const long SyncClient::TIMEOUT_S = 120;
+
+static pthread_once_t curlOnce = PTHREAD_ONCE_INIT;
+
+void SyncClient::initCurl(void) {
+    /* Never cleaned up, other threads of netd could still be using curl. */
+    curl_global_init(CURL_GLOBAL_ALL);
+    srand48(time(NULL) ^ getpid());
+}
+
+SyncClient::SyncClient(const char *url, const char *etagPath) :
+                mUrl(url), mETagPath(etagPath), mBackoffMs(MIN_BACKOFF_MS) {
+    pthread_once(&curlOnce, initCurl);
+    mCurl = curl_easy_init();
+    if (!mCurl) {
+        LOGE("curl_easy_init failed");
+        return;
+    }
+
+    curl_easy_setopt(mCurl, CURLOPT_URL, mUrl.c_str());
+    curl_easy_setopt(mCurl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(mCurl, CURLOPT_NOPROGRESS, 1);
+    curl_easy_setopt(mCurl, CURLOPT_VERBOSE, 0);
+    curl_easy_setopt(mCurl, CURLOPT_HEADERFUNCTION, headerCallback);
+    curl_easy_setopt(mCurl, CURLOPT_WRITEHEADER, (void *) this);
+    curl_easy_setopt(mCurl, CURLOPT_WRITEFUNCTION, discardCallback);
+    curl_easy_setopt(mCurl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    /* Every encoding libcurl was built with. */
+    curl_easy_setopt(mCurl, CURLOPT_ENCODING, "");
+    curl_easy_setopt(mCurl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT_S);
+    curl_easy_setopt(mCurl, CURLOPT_TIMEOUT, TIMEOUT_S);
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(mCurl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+
+    loadETag();
+}
+
+SyncClient::~SyncClient() {
+    if (mCurl)
+        curl_easy_cleanup(mCurl);
+}
+
+size_t SyncClient::headerCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    SyncClient *client = (SyncClient *) userp;
+    const char *line = (const char *) contents;
+    size_t len = size * nmemb;
+
+    client->mHeaders.append(line, len);
+
+    /* Called once per header line. */
+    if (len > 5 && !strncasecmp(line, "ETag:", 5)) {
+        size_t start = 5;
+        while (start < len && (line[start] == ' ' || line[start] == '\t'))
+            start++;
+        while (len > start && (line[len - 1] == '\r' || line[len - 1] == '\n'
+                || line[len - 1] == ' '))
+            len--;
+        client->mNewETag.assign(line + start, len - start);
+    }
+    return size * nmemb;
+}
+
+size_t SyncClient::discardCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    return size * nmemb;
+}
+
+bool SyncClient::isTransient(CURLcode res) {
+    switch (res) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+SyncClient::Result SyncClient::post(const char *fields, bool useETag, std::string &headers) {
+    struct curl_slist *httpHeaders = NULL;
+    std::string ifNoneMatch;
+    long status = 0;
+    CURLcode res;
+
+    if (!mCurl)
+        return FAILED;
+
+    /* The server answers at once, no need for a 100-continue round trip. */
+    httpHeaders = curl_slist_append(httpHeaders, "Expect:");
+    if (useETag && !mETag.empty()) {
+        ifNoneMatch = "If-None-Match: " + mETag;
+        httpHeaders = curl_slist_append(httpHeaders, ifNoneMatch.c_str());
+    }
+
+    mHeaders.clear();
+    mNewETag.clear();
+    curl_easy_setopt(mCurl, CURLOPT_POSTFIELDS, fields);
+    curl_easy_setopt(mCurl, CURLOPT_HTTPHEADER, httpHeaders);
+    res = curl_easy_perform(mCurl);
+    curl_easy_setopt(mCurl, CURLOPT_HTTPHEADER, NULL);
+    curl_slist_free_all(httpHeaders);
+
+    if (res != CURLE_OK) {
+        LOGE("POST to %s failed: %s", mUrl.c_str(), curl_easy_strerror(res));
+        return isTransient(res) ? RETRY : FAILED;
+    }
+
+    curl_easy_getinfo(mCurl, CURLINFO_RESPONSE_CODE, &status);
+    if (status == 304) {
+        mBackoffMs = MIN_BACKOFF_MS;
+        return NOT_MODIFIED;
+    }
+    if (status >= 500 || status == 429) {
+        LOGE("POST to %s failed: HTTP %ld", mUrl.c_str(), status);
+        return RETRY;
+    }
+
+    mBackoffMs = MIN_BACKOFF_MS;
+    headers.swap(mHeaders);
+    return RESPONSE;
+}
+
+int SyncClient::nextBackoffMs(void) {
+    int delayMs = mBackoffMs / 2 + lrand48() % (mBackoffMs / 2 + 1);
+
+    mBackoffMs = mBackoffMs > MAX_BACKOFF_MS / 2 ? MAX_BACKOFF_MS : mBackoffMs * 2;
+    return delayMs;
+}
+
+void SyncClient::loadETag(void) {
+    char buff[256];
+    FILE *fp;
+
+    mETag.clear();
+    fp = fopen(mETagPath.c_str(), "r");
+    if (!fp)
+        return;
+    if (fgets(buff, sizeof(buff), fp)) {
+        buff[strcspn(buff, "\r\n")] = '\0';
+        mETag = buff;
+    }
+    fclose(fp);
+}
+
+int SyncClient::commitETag(void) {
+    std::string tmpPath = mETagPath + ".tmp";
+    FILE *fp;
+
+    if (mNewETag.empty()) {
+        if (unlink(mETagPath.c_str()) && errno != ENOENT) {
+            LOGE("Failed to remove %s (%s)", mETagPath.c_str(), strerror(errno));
+            return -1;
+        }
+        mETag.clear();
+        return 0;
+    }
+
+    fp = fopen(tmpPath.c_str(), "w");
+    if (!fp) {
+        LOGE("Failed to open %s (%s)", tmpPath.c_str(), strerror(errno));
+        return -1;
+    }
+    if (fprintf(fp, "%s\n", mNewETag.c_str()) < 0 || fflush(fp) || fsync(fileno(fp))) {
+        LOGE("Failed to write %s (%s)", tmpPath.c_str(), strerror(errno));
+        fclose(fp);
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmpPath.c_str(), mETagPath.c_str())) {
+        LOGE("Failed to rename %s (%s)", tmpPath.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+    mETag = mNewETag;
+    return 0;
+}
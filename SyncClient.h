@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYNC_CLIENT_H
+#define _SYNC_CLIENT_H
+
+#include <stddef.h>
+
+#include <string>
+
+#include <curl/curl.h>
+
+/*
+ * Posts to the OEM config server with one curl handle, so retries reuse
+ * its kept alive connection and TLS session. The ETag of the response
+ * is saved to a file once the caller has applied the response, and is
+ * sent back as If-None-Match, so an unchanged policy costs a 304.
+ */
+class SyncClient {
+public:
+    enum Result {
+        RESPONSE,       /* the response headers are in headers */
+        NOT_MODIFIED,   /* 304 to the saved ETag */
+        RETRY,          /* network error or server busy, retry after nextBackoffMs() */
+        FAILED
+    };
+
+    SyncClient(const char *url, const char *etagPath);
+    virtual ~SyncClient();
+
+    /* Sends If-None-Match with the saved ETag if useETag is set. */
+    Result post(const char *fields, bool useETag, std::string &headers);
+
+    /* Saves the ETag of the last response, or removes the file if it had none. */
+    int commitETag(void);
+
+    /* Equal jitter over a delay doubled on every call, up to MAX_BACKOFF_MS. */
+    int nextBackoffMs(void);
+
+private:
+    static const int MIN_BACKOFF_MS;
+    static const int MAX_BACKOFF_MS;
+    static const long CONNECT_TIMEOUT_S;
+    static const long TIMEOUT_S;
+
+    static void initCurl(void);
+    static size_t headerCallback(void *contents, size_t size, size_t nmemb, void *userp);
+    static size_t discardCallback(void *contents, size_t size, size_t nmemb, void *userp);
+    static bool isTransient(CURLcode res);
+    void loadETag(void);
+
+    CURL *mCurl;
+    std::string mUrl;
+    std::string mETagPath;
+    std::string mETag;      /* saved */
+    std::string mNewETag;   /* of the last response */
+    std::string mHeaders;
+    int mBackoffMs;
+};
+
+#endif
@@ -49,6 +49,9 @@ int main() {
 
 //    signal(SIGCHLD, sigchld_handler);
 
+    /* Rule commits write to iptables-restore pipes; a dead reader must not kill us. */
+    signal(SIGPIPE, SIG_IGN);
+
     if (!(nm = NetlinkManager::Instance())) {
         LOGE("Unable to create NetlinkManager");
         exit(1);
@@ -25,12 +25,17 @@
 #define LOG_TAG "OemIptablesHook"
 #include <cutils/log.h>
 
+#include "IptablesRestoreController.h"
+
 extern "C" int system_nosh(const char *command);
 
 static char IPTABLES_PATH[] = "/system/bin/iptables";
 static char OEM_SCRIPT_PATH[] = "/system/bin/oem-iptables-init.sh";
 
-static int runIptablesCmd(const char *cmd) {
+/* The -N of an existing chain and the -D/-F/-X of a missing one are expected to fail. */
+static int runIptablesCmd(const char *cmd,
+                          IptablesRestoreController::IptFailureHandling failureHandling =
+                                  IptablesRestoreController::IptFailureBad) {
     char *buffer;
     size_t len = strnlen(cmd, 255);
     int res;
@@ -40,6 +45,11 @@ static int runIptablesCmd(const char *cmd) {
         return -1;
     }
 
+    if (IptablesRestoreController::isEnabled()) {
+        return IptablesRestoreController::executeCommand(IptablesRestoreController::IptIpV4, cmd,
+                                                         failureHandling);
+    }
+
     asprintf(&buffer, "%s %s", IPTABLES_PATH, cmd);
     res = system_nosh(buffer);
     free(buffer);
@@ -52,18 +62,18 @@ static bool oemSetupHooks() {
     // -D to delete any pre-existing jump rule, to prevent dupes (no-op if doesn't exist)
     // -I to insert our jump rule into the default chain
 
-    runIptablesCmd("-N oem_out");
-    runIptablesCmd("-D OUTPUT -j oem_out");
+    runIptablesCmd("-N oem_out", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-D OUTPUT -j oem_out", IptablesRestoreController::IptFailureOk);
     if (runIptablesCmd("-I OUTPUT -j oem_out"))
         return false;
 
-    runIptablesCmd("-N oem_fwd");
-    runIptablesCmd("-D FORWARD -j oem_fwd");
+    runIptablesCmd("-N oem_fwd", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-D FORWARD -j oem_fwd", IptablesRestoreController::IptFailureOk);
     if (runIptablesCmd("-I FORWARD -j oem_fwd"))
         return false;
 
-    runIptablesCmd("-t nat -N oem_nat_pre");
-    runIptablesCmd("-t nat -D PREROUTING -j oem_nat_pre");
+    runIptablesCmd("-t nat -N oem_nat_pre", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-t nat -D PREROUTING -j oem_nat_pre", IptablesRestoreController::IptFailureOk);
     if (runIptablesCmd("-t nat -I PREROUTING -j oem_nat_pre"))
         return false;
 
@@ -76,17 +86,17 @@ static bool oemCleanupHooks() {
     // -F to empty the chain
     // -X to delete the chain
 
-    runIptablesCmd("-D OUTPUT -j oem_out");
-    runIptablesCmd("-F oem_out");
-    runIptablesCmd("-X oem_out");
+    runIptablesCmd("-D OUTPUT -j oem_out", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-F oem_out", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-X oem_out", IptablesRestoreController::IptFailureOk);
 
-    runIptablesCmd("-D FORWARD -j oem_fwd");
-    runIptablesCmd("-F oem_fwd");
-    runIptablesCmd("-X oem_fwd");
+    runIptablesCmd("-D FORWARD -j oem_fwd", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-F oem_fwd", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-X oem_fwd", IptablesRestoreController::IptFailureOk);
 
-    runIptablesCmd("-t nat -D PREROUTING -j oem_nat_pre");
-    runIptablesCmd("-t nat -F oem_nat_pre");
-    runIptablesCmd("-t nat -X oem_nat_pre");
+    runIptablesCmd("-t nat -D PREROUTING -j oem_nat_pre", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-t nat -F oem_nat_pre", IptablesRestoreController::IptFailureOk);
+    runIptablesCmd("-t nat -X oem_nat_pre", IptablesRestoreController::IptFailureOk);
 
     return true;
 }
@@ -0,0 +1,37 @@
+LOCAL_PATH:= $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:=                                      \
+                  BandwidthControllerTest.cpp          \
+                  ConfigDataTest.cpp                   \
+                  PolicyDeltaTest.cpp                  \
+                  QuotaJournalTest.cpp                 \
+                  ../BandwidthController.cpp           \
+                  ../ConfigData.cpp                    \
+                  ../CounterSampler.cpp                \
+                  ../IptablesRestoreController.cpp     \
+                  ../IptablesRuleSet.cpp               \
+                  ../NetfilterTableReader.cpp          \
+                  ../OEMListener.cpp                   \
+                  ../PckgRegistry.cpp                  \
+                  ../PolicyDelta.cpp                   \
+                  ../QuotaJournal.cpp                  \
+                  ../SyncClient.cpp                    \
+                  ../oem_iptables_hook.cpp             \
+                  ../logwrapper.c                      \
+
+LOCAL_MODULE:= netd_unit_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES := $(KERNEL_HEADERS) \
+                    $(LOCAL_PATH)/.. \
+                    bionic \
+                    external/stlport/stlport \
+                    external/zlib \
+                    external/curl/include
+
+LOCAL_STATIC_LIBRARIES := libcurl libsssl libscrypto libz
+LOCAL_SHARED_LIBRARIES := libstlport libsysutils libcutils
+
+include $(BUILD_NATIVE_TEST)
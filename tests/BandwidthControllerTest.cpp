@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "BandwidthController.h"
+
+/* Opens up the protected helpers, none of them touches the kernel. */
+class TestBandwidthController : public BandwidthController {
+public:
+    using BandwidthController::compareLiveRules;
+    using BandwidthController::makeThresholdUpdates;
+};
+
+typedef std::list<std::pair<std::string, int64_t> > QuotaUpdates;
+
+TEST(BandwidthControllerTest, ThresholdsOfRestartedQuota) {
+    std::list<int> pcts;
+    QuotaUpdates updates;
+
+    pcts.push_back(50);
+    pcts.push_back(90);
+    TestBandwidthController::makeThresholdUpdates("rmnet0", 1000, 0, pcts, updates);
+
+    ASSERT_EQ(2U, updates.size());
+    EXPECT_EQ("rmnet0Alert50", updates.front().first);
+    EXPECT_EQ(500, updates.front().second);
+    EXPECT_EQ("rmnet0Alert90", updates.back().first);
+    EXPECT_EQ(900, updates.back().second);
+}
+
+TEST(BandwidthControllerTest, ThresholdAddedAfterUsage) {
+    std::list<int> pcts;
+    QuotaUpdates updates;
+
+    /* 300 of the 1000 bytes are used, the 50% alert is 200 bytes away. */
+    pcts.push_back(50);
+    pcts.push_back(20);
+    TestBandwidthController::makeThresholdUpdates("shared", 1000, 300, pcts, updates);
+
+    ASSERT_EQ(2U, updates.size());
+    EXPECT_EQ("sharedAlert50", updates.front().first);
+    EXPECT_EQ(200, updates.front().second);
+    /* Already passed, it fires on the next byte. */
+    EXPECT_EQ("sharedAlert20", updates.back().first);
+    EXPECT_EQ(1, updates.back().second);
+}
+
+TEST(BandwidthControllerTest, AdoptsFilledOemChain) {
+    IptablesRuleSet rules;
+    std::map<std::string, int> liveCounts;
+    std::map<std::string, std::list<std::string> > liveQuotaNames;
+
+    ASSERT_EQ(0, rules.apply("-N costly_shared", false));
+    ASSERT_EQ(0, rules.apply("-N p30dw", false));
+    ASSERT_EQ(0, rules.apply("-A costly_shared --jump p30dw", false));
+    ASSERT_EQ(0, rules.apply("-A OUTPUT -o ppp0 --goto p30dw", false));
+
+    /* OEMListener filled p30dw, and another controller added to OUTPUT. */
+    liveCounts["INPUT"] = 0;
+    liveCounts["OUTPUT"] = 3;
+    liveCounts["FORWARD"] = 0;
+    liveCounts["costly_shared"] = 1;
+    liveCounts["p30dw"] = 12;
+    liveQuotaNames["p30dw"].push_back("p30_10061");
+    EXPECT_EQ(0, TestBandwidthController::compareLiveRules(rules, liveCounts, liveQuotaNames));
+
+    /* The chains we fill ourselves must match. */
+    liveCounts["costly_shared"] = 2;
+    EXPECT_NE(0, TestBandwidthController::compareLiveRules(rules, liveCounts, liveQuotaNames));
+    liveCounts["costly_shared"] = 1;
+
+    liveCounts.erase("p30dw");
+    EXPECT_NE(0, TestBandwidthController::compareLiveRules(rules, liveCounts, liveQuotaNames));
+}
+
+TEST(BandwidthControllerTest, RejectsOtherQuotas) {
+    IptablesRuleSet rules;
+    std::map<std::string, int> liveCounts;
+    std::map<std::string, std::list<std::string> > liveQuotaNames;
+
+    ASSERT_EQ(0, rules.apply("-N costly_rmnet0", false));
+    ASSERT_EQ(0, rules.apply("-A costly_rmnet0 -m quota2 ! --quota 1000 --name rmnet0", true));
+    ASSERT_EQ(0, rules.apply("-I costly_rmnet0 -m quota2 ! --quota 500 --name rmnet0Alert",
+                             false));
+
+    liveCounts["INPUT"] = 0;
+    liveCounts["OUTPUT"] = 0;
+    liveCounts["FORWARD"] = 0;
+    liveCounts["costly_rmnet0"] = 2;
+    liveQuotaNames["costly_rmnet0"].push_back("rmnet0Alert");
+    liveQuotaNames["costly_rmnet0"].push_back("rmnet0");
+    EXPECT_EQ(0, TestBandwidthController::compareLiveRules(rules, liveCounts, liveQuotaNames));
+
+    /* Same rule count, but an alert threshold instead of the alert. */
+    liveQuotaNames["costly_rmnet0"].front() = "rmnet0Alert50";
+    EXPECT_NE(0, TestBandwidthController::compareLiveRules(rules, liveCounts, liveQuotaNames));
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "ConfigData.h"
+
+static std::string decode(const char *in) {
+    std::string out("stale");
+
+    ConfigData::decode(in, strlen(in), out);
+    return out;
+}
+
+TEST(ConfigDataTest, Decode) {
+    EXPECT_EQ("", decode(""));
+    EXPECT_EQ("serial", decode("c2VyaWFs"));
+    EXPECT_EQ("1234,acme,x1", decode("MTIzNCxhY21lLHgx"));
+}
+
+TEST(ConfigDataTest, DecodePartialQuad) {
+    EXPECT_EQ("a", decode("YQ=="));
+    EXPECT_EQ("ab", decode("YWI="));
+    /* Padding is optional. */
+    EXPECT_EQ("a", decode("YQ"));
+    EXPECT_EQ("ab", decode("YWI"));
+    /* A single sextet holds no whole byte. */
+    EXPECT_EQ("ab", decode("YWJ"));
+    EXPECT_EQ("", decode("Y"));
+}
+
+TEST(ConfigDataTest, DecodeSkipsInvalid) {
+    EXPECT_EQ("serial", decode("c2Vy\naWFs\n"));
+    EXPECT_EQ("serial", decode(" c2V-yaW.Fs\r\n"));
+    EXPECT_EQ("", decode("\n==\n"));
+}
+
+TEST(ConfigDataTest, DecodeBinary) {
+    std::string out;
+
+    ConfigData::decode("AP8A", 4, out);
+    ASSERT_EQ(3U, out.size());
+    EXPECT_EQ('\0', out[0]);
+    EXPECT_EQ('\xff', out[1]);
+    EXPECT_EQ('\0', out[2]);
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "PolicyDelta.h"
+
+TEST(PolicyDeltaTest, UnknownAction) {
+    PolicyDelta delta;
+
+    EXPECT_EQ(-1, PolicyDelta::parse("yes", "com.a.one 10,", delta));
+    EXPECT_EQ(-1, PolicyDelta::parse("", "com.a.one 10,", delta));
+    EXPECT_EQ(-1, PolicyDelta::parse("none", "com.a.one 10,", delta));
+}
+
+TEST(PolicyDeltaTest, NoRestrictIgnoresUsage) {
+    PolicyDelta delta;
+
+    ASSERT_EQ(0, PolicyDelta::parse(" no", "com.a.one 10,", delta));
+    EXPECT_EQ(PolicyDelta::NO_RESTRICT, delta.action);
+    EXPECT_TRUE(delta.groups.empty());
+}
+
+TEST(PolicyDeltaTest, Groups) {
+    std::string usage("com.a.one\tcom.a.two 10240, com.b.one 2048,");
+    PolicyDelta delta;
+
+    ASSERT_EQ(0, PolicyDelta::parse("new", usage, delta));
+    EXPECT_EQ(PolicyDelta::NEW, delta.action);
+    ASSERT_EQ(2U, delta.groups.size());
+
+    const PolicyDelta::Group &first = delta.groups.front();
+    ASSERT_EQ(2U, first.packages.size());
+    EXPECT_EQ("com.a.one", first.packages[0].str());
+    EXPECT_EQ("com.a.two", first.packages[1].str());
+    EXPECT_EQ(10240ULL, first.clq);
+
+    const PolicyDelta::Group &second = delta.groups.back();
+    ASSERT_EQ(1U, second.packages.size());
+    EXPECT_EQ("com.b.one", second.packages[0].str());
+    EXPECT_EQ(2048ULL, second.clq);
+}
+
+TEST(PolicyDeltaTest, NumberEndsGroup) {
+    std::string usage("com.a.one 10 com.a.two 20,");
+    PolicyDelta delta;
+
+    ASSERT_EQ(0, PolicyDelta::parse("add", usage, delta));
+    EXPECT_EQ(PolicyDelta::ADD, delta.action);
+    ASSERT_EQ(1U, delta.groups.size());
+    ASSERT_EQ(1U, delta.groups.front().packages.size());
+    EXPECT_EQ("com.a.one", delta.groups.front().packages[0].str());
+    EXPECT_EQ(10ULL, delta.groups.front().clq);
+}
+
+TEST(PolicyDeltaTest, LeadingNumberIsNotQuota) {
+    std::string usage("12 123456 com.a.one 30,");
+    PolicyDelta delta;
+
+    /* A number before any package is a package name, if long enough. */
+    ASSERT_EQ(0, PolicyDelta::parse("add", usage, delta));
+    ASSERT_EQ(1U, delta.groups.size());
+    ASSERT_EQ(2U, delta.groups.front().packages.size());
+    EXPECT_EQ("123456", delta.groups.front().packages[0].str());
+    EXPECT_EQ("com.a.one", delta.groups.front().packages[1].str());
+    EXPECT_EQ(30ULL, delta.groups.front().clq);
+}
+
+TEST(PolicyDeltaTest, ShortNamesDropped) {
+    std::string usage("abcd abcde 1,ab 2,");
+    PolicyDelta delta;
+
+    ASSERT_EQ(0, PolicyDelta::parse("rem", usage, delta));
+    EXPECT_EQ(PolicyDelta::REMOVE, delta.action);
+    /* The second group has no package left and is dropped. */
+    ASSERT_EQ(1U, delta.groups.size());
+    ASSERT_EQ(1U, delta.groups.front().packages.size());
+    EXPECT_EQ("abcde", delta.groups.front().packages[0].str());
+}
+
+TEST(PolicyDeltaTest, TrailingGroupWithoutCommaDropped) {
+    std::string usage("com.a.one 10,com.b.one 20");
+    PolicyDelta delta;
+
+    ASSERT_EQ(0, PolicyDelta::parse("new", usage, delta));
+    ASSERT_EQ(1U, delta.groups.size());
+    EXPECT_EQ("com.a.one", delta.groups.front().packages[0].str());
+
+    ASSERT_EQ(0, PolicyDelta::parse("new", "com.b.one 20", delta));
+    EXPECT_TRUE(delta.groups.empty());
+}
+
+TEST(PolicyDeltaTest, GroupWithoutNumber) {
+    PolicyDelta delta;
+
+    ASSERT_EQ(0, PolicyDelta::parse("add", "com.a.one com.a.two,", delta));
+    ASSERT_EQ(1U, delta.groups.size());
+    EXPECT_EQ(2U, delta.groups.front().packages.size());
+    EXPECT_EQ(0ULL, delta.groups.front().clq);
+}
+
+TEST(PolicyDeltaTest, Overflow) {
+    std::string usage("com.a.one 18446744073709551616,");
+    PolicyDelta delta;
+
+    ASSERT_EQ(0, PolicyDelta::parse("add", "com.a.one 18446744073709551615,", delta));
+    ASSERT_EQ(1U, delta.groups.size());
+    EXPECT_EQ(18446744073709551615ULL, delta.groups.front().clq);
+
+    /* Out of range, so not the quota: a package, and the group has none. */
+    ASSERT_EQ(0, PolicyDelta::parse("add", usage, delta));
+    ASSERT_EQ(1U, delta.groups.size());
+    ASSERT_EQ(2U, delta.groups.front().packages.size());
+    EXPECT_EQ("18446744073709551616", delta.groups.front().packages[1].str());
+    EXPECT_EQ(0ULL, delta.groups.front().clq);
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <list>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "PckgRegistry.h"
+#include "QuotaJournal.h"
+
+/* sizeof(QuotaJournal::GroupRecord) */
+static const off_t GROUP_RECORD_SIZE = 16;
+
+class QuotaJournalTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        const char *dir = getenv("TMPDIR");
+
+        mPath = std::string(dir ? dir : "/data/local/tmp") + "/netd_quota_journal_test";
+        unlink(mPath.c_str());
+    }
+
+    virtual void TearDown() {
+        unlink(mPath.c_str());
+        unlink((mPath + ".tmp").c_str());
+    }
+
+    off_t fileSize(void) {
+        struct stat sb;
+
+        if (stat(mPath.c_str(), &sb))
+            return -1;
+        return sb.st_size;
+    }
+
+    void expectPackage(const PckgObj &pckg, const char *package, unsigned int uid,
+                       unsigned int gid, unsigned long long clq) {
+        EXPECT_EQ(package, pckg.package);
+        EXPECT_EQ(uid, pckg.uid);
+        EXPECT_EQ(gid, pckg.gid);
+        EXPECT_EQ(clq, pckg.clq);
+    }
+
+    std::string mPath;
+};
+
+TEST_F(QuotaJournalTest, MissingFile) {
+    QuotaJournal journal(mPath.c_str());
+    std::list<PckgObj> packages;
+
+    EXPECT_EQ(0, journal.read(packages));
+    EXPECT_TRUE(packages.empty());
+}
+
+TEST_F(QuotaJournalTest, RoundTrip) {
+    std::list<PckgObj> packages;
+    std::list<PckgObj> readBack;
+
+    packages.push_back(PckgObj("com.a.one", 10061, 10061, 10240));
+    packages.push_back(PckgObj("com.a.two", 10062, 10061, 10240));
+    packages.push_back(PckgObj("com.b.one", 10070, 10070, 0));
+    {
+        QuotaJournal journal(mPath.c_str());
+        ASSERT_EQ(0, journal.update(packages));
+    }
+
+    QuotaJournal journal(mPath.c_str());
+    ASSERT_EQ(0, journal.read(readBack));
+    ASSERT_EQ(3U, readBack.size());
+    expectPackage(readBack.front(), "com.a.one", 10061, 10061, 10240);
+    expectPackage(*++readBack.begin(), "com.a.two", 10062, 10061, 10240);
+    expectPackage(readBack.back(), "com.b.one", 10070, 10070, 0);
+}
+
+TEST_F(QuotaJournalTest, AppendedUsage) {
+    QuotaJournal journal(mPath.c_str());
+    std::list<PckgObj> packages;
+    std::list<PckgObj> readBack;
+    off_t compacted;
+
+    packages.push_back(PckgObj("com.a.one", 10061, 10061, 10240));
+    packages.push_back(PckgObj("com.a.two", 10062, 10061, 10240));
+    packages.push_back(PckgObj("com.b.one", 10070, 10070, 2048));
+    ASSERT_EQ(0, journal.update(packages));
+    compacted = fileSize();
+
+    /* Only the usage changed: one GroupRecord per changed group. */
+    packages.front().clq = 8000;
+    (++packages.begin())->clq = 8000;
+    ASSERT_EQ(0, journal.update(packages));
+    packages.front().clq = 6000;
+    (++packages.begin())->clq = 6000;
+    ASSERT_EQ(0, journal.update(packages));
+    EXPECT_EQ(compacted + 2 * GROUP_RECORD_SIZE, fileSize());
+
+    ASSERT_EQ(0, journal.read(readBack));
+    ASSERT_EQ(3U, readBack.size());
+    expectPackage(readBack.front(), "com.a.one", 10061, 10061, 6000);
+    expectPackage(*++readBack.begin(), "com.a.two", 10062, 10061, 6000);
+    expectPackage(readBack.back(), "com.b.one", 10070, 10070, 2048);
+}
+
+TEST_F(QuotaJournalTest, TornRecordIgnored) {
+    QuotaJournal journal(mPath.c_str());
+    std::list<PckgObj> packages;
+    std::list<PckgObj> readBack;
+
+    packages.push_back(PckgObj("com.a.one", 10061, 10061, 10240));
+    ASSERT_EQ(0, journal.update(packages));
+    packages.front().clq = 8000;
+    ASSERT_EQ(0, journal.update(packages));
+    packages.front().clq = 6000;
+    ASSERT_EQ(0, journal.update(packages));
+
+    /* The last append was cut short, the one before it stands. */
+    ASSERT_EQ(0, truncate(mPath.c_str(), fileSize() - GROUP_RECORD_SIZE / 2));
+    ASSERT_EQ(0, journal.read(readBack));
+    ASSERT_EQ(1U, readBack.size());
+    expectPackage(readBack.front(), "com.a.one", 10061, 10061, 8000);
+}
+
+TEST_F(QuotaJournalTest, TornSnapshotRejected) {
+    QuotaJournal journal(mPath.c_str());
+    std::list<PckgObj> packages;
+    std::list<PckgObj> readBack;
+
+    packages.push_back(PckgObj("com.a.one", 10061, 10061, 10240));
+    packages.push_back(PckgObj("com.b.one", 10070, 10070, 2048));
+    ASSERT_EQ(0, journal.update(packages));
+
+    ASSERT_EQ(0, truncate(mPath.c_str(), fileSize() - 1));
+    EXPECT_EQ(-1, journal.read(readBack));
+    EXPECT_TRUE(readBack.empty());
+}
+
+TEST_F(QuotaJournalTest, NotAJournal) {
+    QuotaJournal journal(mPath.c_str());
+    std::list<PckgObj> packages;
+    const char deflated[] = "\x78\x9c\x03\x00\x00\x00\x00\x01";
+    int fd;
+
+    fd = open(mPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ((ssize_t) sizeof(deflated), write(fd, deflated, sizeof(deflated)));
+    close(fd);
+
+    EXPECT_EQ(1, journal.read(packages));
+    EXPECT_TRUE(packages.empty());
+}